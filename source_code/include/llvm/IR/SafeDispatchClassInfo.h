@@ -0,0 +1,54 @@
+#ifndef LLVM_IR_SAFEDISPATCH_CLASSINFO_H
+#define LLVM_IR_SAFEDISPATCH_CLASSINFO_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Metadata.h"
+
+/**
+ * The parts of the SafeDispatch class info format that are needed outside of
+ * the SafeDispatch passes (the IR linker merges the sd.class_info named md).
+ * The encoding itself is described in
+ * llvm/Transforms/IPO/SafeDispatchClassInfoMD.h.
+ */
+
+/**
+ * named md used to store the vtable info
+ */
+#define SD_MD_CLASSINFO  "sd.class_info."
+
+/**
+ * first bytes of the blob of a compact class info record
+ */
+#define SD_MD_CLASSINFO_MAGIC "\xff" "SDCI" "\x01"
+
+/**
+ * Number of operands of the class record starting at operand op of a
+ * sd.class_info named md, in either format.
+ */
+static inline unsigned sd_getClassRecordSize(const llvm::NamedMDNode *md, unsigned op) {
+  const llvm::MDNode *first = md->getOperand(op);
+
+  if (first->getNumOperands() == 2) {
+    const llvm::MDString *blob = llvm::dyn_cast_or_null<llvm::MDString>(first->getOperand(0).get());
+    if (blob && blob->getString().startswith(SD_MD_CLASSINFO_MAGIC))
+      return 1;
+  }
+
+  // old format: name, vtable gv, #sub-vtables, sub-vtables...
+  assert(op + 2 < md->getNumOperands());
+  uint64_t numSubVTables =
+      llvm::mdconst::extract<llvm::ConstantInt>(md->getOperand(op + 2)->getOperand(0))->getZExtValue();
+  return 3 + numSubVTables;
+}
+
+/**
+ * Hash of the operands of one class record. Metadata is uniqued, so records
+ * of identical classes hash (and compare) equal operand by operand.
+ */
+static inline size_t sd_hashClassRecord(llvm::ArrayRef<const llvm::MDNode *> record) {
+  return llvm::hash_combine_range(record.begin(), record.end());
+}
+
+#endif
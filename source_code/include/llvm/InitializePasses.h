@@ -324,6 +324,9 @@ void initializeSDSubstModulePass(PassRegistry&);
 void initializeSDAnalysisPass(PassRegistry&);
 
 void initializeSDCleanupPass(PassRegistry&);
+
+//this pass removes vptr checks implied by an earlier check
+void initializeSDCheckElimPass(PassRegistry&);
 }
 
 #endif
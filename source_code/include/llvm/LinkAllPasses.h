@@ -195,6 +195,7 @@ namespace {
       (void) llvm::createSDAnalysisPass();
       (void) llvm::createSDMoveBasicBlocksPass();
       (void) llvm::createSDSubstModulePass();
+      (void) llvm::createSDCheckElimPass();
     }
   } ForcePassLinking; // Force link by creating a global definition.
 }
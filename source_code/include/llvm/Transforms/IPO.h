@@ -24,6 +24,7 @@ class Pass;
 class Function;
 class BasicBlock;
 class GlobalValue;
+class SDCHACache;
 
 //===----------------------------------------------------------------------===//
 //
@@ -208,12 +209,13 @@ this are the safedispatch passes*/
 
 // safedispatch additions
 ModulePass* createSDFixPass();
-ModulePass* createSDBuildCHAPass();
+ModulePass* createSDBuildCHAPass(SDCHACache *cache = nullptr);
 ModulePass* createSDLayoutBuilderPass(bool interleave = false);
 ModulePass* createSDUpdateIndicesPass();
 ModulePass* createSDCleanupPass();
 ModulePass* createSDMoveBasicBlocksPass();
 ModulePass* createSDSubstModulePass();
+ModulePass* createSDCheckElimPass();
 ModulePass* createSDAnalysisPass();
 
 } // End llvm namespace
@@ -19,6 +19,7 @@
 
 namespace llvm {
 class Pass;
+class SDCHACache;
 class TargetLibraryInfoImpl;
 class TargetMachine;
 
@@ -124,6 +125,7 @@ public:
   bool EmitIVTBLs; //Paul: flag variable used for interleaving the v tables
   bool EmitOVTBLs; //Paul: flag variable used for ordering the v tables
   bool EmitReturnChecks; //Matt: flag variable used for backward edge checks
+  SDCHACache *SDClassInfoCache; // class hierarchy records already taken out of the input modules
 
 private:
   /// ExtensionList - This is list of all of the extensions that are registered.
@@ -0,0 +1,425 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_ANALYSIS_FILE_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_ANALYSIS_FILE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Columnar binary output of SDAnalysis (.sda), written next to the CSVs and
+ * read with SDAnalysisFile (see tools/sd-analysis-export).
+ *
+ *   header        SDAnalysisFileHeader
+ *   string table  NUL terminated names, a string id is its byte offset
+ *   set pool      uint32: (#members, member string id*)*, a set id is its
+ *                 index into the pool, a target set shared by many call
+ *                 sites is stored once
+ *   columns       NUM_COLUMNS columns of #call sites int64 each
+ *
+ * Everything is little endian and every section starts 8 byte aligned, so
+ * the file can be used straight from an mmap'ed buffer.
+ */
+#define SD_ANALYSIS_FILE_MAGIC "SDANA\x01\r\n"
+
+namespace llvm {
+namespace sdanalysis {
+
+  enum Column {
+    COL_KIND,                       // KIND_VIRTUAL / KIND_INDIRECT
+
+    // string ids, NO_ID if the call site has none
+    COL_DWARF,
+    COL_FUNCTION_NAME,
+    COL_CLASS_NAME,
+    COL_PRECISE_NAME,
+    COL_CALLER,
+
+    COL_PARAMS,
+
+    // number of targets
+    COL_PRECISE_SRC_TYPE,           // vTrust
+    COL_SRC_TYPE,                   // IFCC
+    COL_SAFE_SRC_TYPE,              // IFCC-safe
+    COL_BIN_TYPE,                   // TypeArmor
+    COL_PRECISE_SRC_TYPE_VIRTUAL,
+    COL_SRC_TYPE_VIRTUAL,
+    COL_SAFE_SRC_TYPE_VIRTUAL,
+    COL_BIN_TYPE_VIRTUAL,
+    COL_VTABLE_SUB_HIERARCHY,       // ShrinkWrap, -1 for indirect call sites
+    COL_CLASS_SUB_HIERARCHY,        // VTV
+    COL_CLASS_ISLAND,               // Marx
+
+    COL_METRIC,                     // float bits
+
+    // set ids, NO_ID if not computed for the call site
+    COL_SET_PRECISE_SRC_TYPE,
+    COL_SET_SRC_TYPE,
+    COL_SET_SAFE_SRC_TYPE,
+    COL_SET_PRECISE_SRC_TYPE_VIRTUAL,
+    COL_SET_SRC_TYPE_VIRTUAL,
+    COL_SET_SAFE_SRC_TYPE_VIRTUAL,
+    COL_SET_VTABLE_SUB_HIERARCHY,
+    COL_SET_CLASS_SUB_HIERARCHY,
+    COL_SET_CLASS_ISLAND,
+    COL_SET_ALL_VTABLES,            // vTint
+
+    NUM_COLUMNS
+  };
+
+  enum { KIND_VIRTUAL = 0, KIND_INDIRECT = 1 };
+
+  static const int64_t NO_ID = -1;
+
+  // the functions with 0..6 and 7+ params, the TypeArmor targets of a call
+  // site are the union of the sets up to its # of params
+  enum { NUM_PARAM_SETS = 8 };
+
+  static inline const char *getColumnName(unsigned C) {
+    static const char *const Names[NUM_COLUMNS] = {
+      "Kind", "Dwarf", "FunctionName", "ClassName", "PreciseName", "Caller", "Params",
+      "PreciseSrcType (vTrust)", "SrcType (IFCC)", "SafeSrcType (IFCC-safe)", "BinType (TypeArmor)",
+      "PreciseSrcType-VFunctions", "SrcType-VFunctions", "SafeSrcType-VFunctions", "BinType-VFunctions",
+      "VTableSubHierarchy (ShrinkWrap)", "ClassSubHierarchy (VTV)", "ClassIsland (Marx)",
+      "Metric",
+      "vTrust", "IFCC", "IFCCSafe",
+      "vTrustVirtual", "IFCCVirtual", "IFCCSafeVirtual",
+      "ShrinkWrap", "VTV", "Marx", "vTint"
+    };
+    return C < NUM_COLUMNS ? Names[C] : "";
+  }
+
+  struct SDAnalysisFileHeader {
+    char Magic[8];
+    support::ulittle64_t NumCallSites;
+    support::ulittle64_t NumColumns;
+    support::ulittle64_t BaseLine;                // # of functions
+    support::ulittle64_t BaseLineVirtual;         // # of virtual functions
+    support::ulittle64_t AllVFunctionsInVTables;
+    support::ulittle64_t StringTableOffset;
+    support::ulittle64_t StringTableSize;         // bytes
+    support::ulittle64_t SetPoolOffset;
+    support::ulittle64_t SetPoolSize;             // uint32 entries
+    support::ulittle64_t ColumnsOffset;
+    support::little64_t ParamSets[NUM_PARAM_SETS];         // set ids
+    support::little64_t ParamSetsVirtual[NUM_PARAM_SETS];  // set ids, virtual functions only
+  };
+
+  /**
+   * Collects the rows of SDAnalysis. Names are interned and target sets are
+   * deduplicated by their members, so equal sets of different call sites
+   * share one entry of the set pool.
+   */
+  class SDAnalysisFileWriter {
+  public:
+    typedef int64_t row_t[NUM_COLUMNS];
+
+    SDAnalysisFileWriter() {
+      StringTable.push_back('\0');
+      for (unsigned N = 0; N < NUM_PARAM_SETS; N++)
+        ParamSets[N] = ParamSetsVirtual[N] = NO_ID;
+    }
+
+    int64_t addString(StringRef Str) {
+      auto Res = StringIds.insert(std::make_pair(Str, (uint32_t) StringTable.size()));
+      if (Res.second) {
+        StringTable.append(Str.begin(), Str.end());
+        StringTable.push_back('\0');
+      }
+      return Res.first->second;
+    }
+
+    /** Name maps a member of the set to its name (the members themselves by default) */
+    template<typename SetT, typename NameFn>
+    int64_t addSet(const SetT &Set, NameFn Name) {
+      SmallVector<uint32_t, 16> Members;
+      for (const auto &Member : Set)
+        Members.push_back(addString(Name(Member)));
+
+      // sets with the same hash are told apart by their members
+      size_t Hash = hash_combine_range(Members.begin(), Members.end());
+      std::vector<uint64_t> &Candidates = SetIds[Hash];
+      for (uint64_t Id : Candidates) {
+        if (SetPool[Id] == Members.size() &&
+            std::equal(Members.begin(), Members.end(), SetPool.begin() + Id + 1))
+          return Id;
+      }
+
+      uint64_t Id = SetPool.size();
+      SetPool.push_back(Members.size());
+      SetPool.insert(SetPool.end(), Members.begin(), Members.end());
+      Candidates.push_back(Id);
+      return Id;
+    }
+
+    template<typename SetT>
+    int64_t addSet(const SetT &Set) {
+      return addSet(Set, MemberName());
+    }
+
+    template<typename SetT, typename NameFn>
+    void setParamSet(unsigned N, bool Virtual, const SetT &Set, NameFn Name) {
+      assert(N < NUM_PARAM_SETS);
+      (Virtual ? ParamSetsVirtual : ParamSets)[N] = addSet(Set, Name);
+    }
+
+    template<typename SetT>
+    void setParamSet(unsigned N, bool Virtual, const SetT &Set) {
+      setParamSet(N, Virtual, Set, MemberName());
+    }
+
+    void addRow(const row_t &Row) {
+      Rows.insert(Rows.end(), Row, Row + NUM_COLUMNS);
+    }
+
+    uint64_t getNumRows() const { return Rows.size() / NUM_COLUMNS; }
+
+    std::error_code write(StringRef Path, uint64_t BaseLine, uint64_t BaseLineVirtual,
+                          uint64_t AllVFunctionsInVTables) const {
+      std::error_code EC;
+      raw_fd_ostream OS(Path, EC, sys::fs::F_None);
+      if (EC)
+        return EC;
+
+      uint64_t NumRows = getNumRows();
+      uint64_t StringTableSize = alignTo8(StringTable.size());
+      uint64_t SetPoolBytes = alignTo8(SetPool.size() * 4);
+
+      SDAnalysisFileHeader Header;
+      memcpy(Header.Magic, SD_ANALYSIS_FILE_MAGIC, sizeof(Header.Magic));
+      Header.NumCallSites = NumRows;
+      Header.NumColumns = NUM_COLUMNS;
+      Header.BaseLine = BaseLine;
+      Header.BaseLineVirtual = BaseLineVirtual;
+      Header.AllVFunctionsInVTables = AllVFunctionsInVTables;
+      Header.StringTableOffset = sizeof(SDAnalysisFileHeader);
+      Header.StringTableSize = StringTable.size();
+      Header.SetPoolOffset = Header.StringTableOffset + StringTableSize;
+      Header.SetPoolSize = SetPool.size();
+      Header.ColumnsOffset = Header.SetPoolOffset + SetPoolBytes;
+      for (unsigned N = 0; N < NUM_PARAM_SETS; N++) {
+        Header.ParamSets[N] = ParamSets[N];
+        Header.ParamSetsVirtual[N] = ParamSetsVirtual[N];
+      }
+      OS.write((const char *) &Header, sizeof(Header));
+
+      OS << StringTable;
+      writePadding(OS, StringTableSize - StringTable.size());
+
+      for (uint32_t Entry : SetPool) {
+        support::ulittle32_t LE;
+        LE = Entry;
+        OS.write((const char *) &LE, sizeof(LE));
+      }
+      writePadding(OS, SetPoolBytes - SetPool.size() * 4);
+
+      for (unsigned C = 0; C < NUM_COLUMNS; C++) {
+        for (uint64_t R = 0; R < NumRows; R++) {
+          support::little64_t LE;
+          LE = Rows[R * NUM_COLUMNS + C];
+          OS.write((const char *) &LE, sizeof(LE));
+        }
+      }
+
+      OS.close();
+      return OS.has_error() ? std::make_error_code(std::errc::io_error) : std::error_code();
+    }
+
+  private:
+    std::string StringTable;
+    StringMap<uint32_t> StringIds;
+    std::vector<uint32_t> SetPool;
+    std::unordered_map<size_t, std::vector<uint64_t>> SetIds;  // hash of the members -> set ids
+    int64_t ParamSets[NUM_PARAM_SETS];
+    int64_t ParamSetsVirtual[NUM_PARAM_SETS];
+    std::vector<int64_t> Rows;               // row major until written
+
+    struct MemberName {
+      StringRef operator()(StringRef Member) const { return Member; }
+    };
+
+    static uint64_t alignTo8(uint64_t Size) { return (Size + 7) & ~(uint64_t) 7; }
+
+    static void writePadding(raw_ostream &OS, uint64_t Size) {
+      static const char Zeros[8] = {0};
+      OS.write(Zeros, Size);
+    }
+  };
+
+  /**
+   * Read-only view of a .sda file, all accessors read the buffer in place
+   */
+  class SDAnalysisFile {
+  public:
+    static ErrorOr<std::unique_ptr<SDAnalysisFile>> open(StringRef Path) {
+      ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr = MemoryBuffer::getFile(Path);
+      if (!BufOrErr)
+        return BufOrErr.getError();
+
+      std::unique_ptr<SDAnalysisFile> File(new SDAnalysisFile(std::move(*BufOrErr)));
+      if (!File->isValid())
+        return std::make_error_code(std::errc::illegal_byte_sequence);
+      return File;
+    }
+
+    uint64_t getNumCallSites() const { return Header->NumCallSites; }
+    uint64_t getBaseLine() const { return Header->BaseLine; }
+    uint64_t getBaseLineVirtual() const { return Header->BaseLineVirtual; }
+    uint64_t getAllVFunctionsInVTables() const { return Header->AllVFunctionsInVTables; }
+
+    int64_t get(uint64_t Row, Column C) const {
+      assert(Row < getNumCallSites() && C < NUM_COLUMNS);
+      return Columns[C * getNumCallSites() + Row];
+    }
+
+    ArrayRef<support::little64_t> getColumn(Column C) const {
+      return ArrayRef<support::little64_t>(Columns + C * getNumCallSites(), getNumCallSites());
+    }
+
+    /** set id of the functions with N (7: 7 or more) params */
+    int64_t getParamSet(unsigned N, bool Virtual) const {
+      assert(N < NUM_PARAM_SETS);
+      return Virtual ? Header->ParamSetsVirtual[N] : Header->ParamSets[N];
+    }
+
+    bool isVirtual(uint64_t Row) const { return get(Row, COL_KIND) == KIND_VIRTUAL; }
+
+    float getMetric(uint64_t Row) const {
+      uint32_t Bits = get(Row, COL_METRIC);
+      float Metric;
+      memcpy(&Metric, &Bits, sizeof(Metric));
+      return Metric;
+    }
+
+    /** the empty string for NO_ID */
+    StringRef getString(int64_t Id) const {
+      if (Id < 0 || (uint64_t) Id >= StringTableSize)
+        return StringRef();
+      return StringRef(StringTable + Id, strnlen(StringTable + Id, StringTableSize - Id));
+    }
+
+    /** string ids of the members, empty for NO_ID */
+    ArrayRef<support::ulittle32_t> getSet(int64_t Id) const {
+      if (Id < 0 || (uint64_t) Id >= SetPoolSize)
+        return ArrayRef<support::ulittle32_t>();
+      uint64_t Size = SetPool[Id];
+      if (Size > SetPoolSize - Id - 1)
+        return ArrayRef<support::ulittle32_t>();
+      return ArrayRef<support::ulittle32_t>(SetPool + Id + 1, Size);
+    }
+
+  private:
+    std::unique_ptr<MemoryBuffer> Buffer;
+    const SDAnalysisFileHeader *Header;
+    const char *StringTable;
+    uint64_t StringTableSize;
+    const support::ulittle32_t *SetPool;
+    uint64_t SetPoolSize;
+    const support::little64_t *Columns;
+
+    SDAnalysisFile(std::unique_ptr<MemoryBuffer> Buf) : Buffer(std::move(Buf)) {}
+
+    bool isValid() {
+      StringRef Data = Buffer->getBuffer();
+      if (Data.size() < sizeof(SDAnalysisFileHeader) ||
+          memcmp(Data.data(), SD_ANALYSIS_FILE_MAGIC, 8) != 0)
+        return false;
+
+      Header = reinterpret_cast<const SDAnalysisFileHeader *>(Data.data());
+      uint64_t Size = Data.size();
+      uint64_t NumCallSites = Header->NumCallSites;
+      if (Header->NumColumns != NUM_COLUMNS ||
+          Header->StringTableOffset > Size || Header->StringTableSize > Size - Header->StringTableOffset ||
+          Header->SetPoolOffset > Size || Header->SetPoolSize > (Size - Header->SetPoolOffset) / 4 ||
+          Header->ColumnsOffset > Size || (Header->ColumnsOffset & 7) != 0 ||
+          NumCallSites > (Size - Header->ColumnsOffset) / (8 * NUM_COLUMNS))
+        return false;
+
+      StringTable = Data.data() + Header->StringTableOffset;
+      StringTableSize = Header->StringTableSize;
+      SetPool = reinterpret_cast<const support::ulittle32_t *>(Data.data() + Header->SetPoolOffset);
+      SetPoolSize = Header->SetPoolSize;
+      Columns = reinterpret_cast<const support::little64_t *>(Data.data() + Header->ColumnsOffset);
+      return hasValidValues();
+    }
+
+    /**
+     * The accessors (and sd-analysis-export) rely on every id pointing at a
+     * string or at the start of a set and on the other values being in range
+     */
+    bool hasValidValues() const {
+      if (StringTableSize != 0 && StringTable[StringTableSize - 1] != '\0')
+        return false;
+
+      // the sets are stored back to back, a set id is the index of a size
+      BitVector SetStarts(SetPoolSize);
+      for (uint64_t Id = 0; Id < SetPoolSize;) {
+        uint64_t Size = SetPool[Id];
+        if (Size > SetPoolSize - Id - 1)
+          return false;
+        for (uint64_t M = Id + 1; M <= Id + Size; M++)
+          if (SetPool[M] >= StringTableSize)
+            return false;
+        SetStarts.set(Id);
+        Id += Size + 1;
+      }
+      auto isSetId = [&](int64_t Id) {
+        return Id == NO_ID || (Id >= 0 && (uint64_t) Id < SetPoolSize && SetStarts.test(Id));
+      };
+
+      for (unsigned N = 0; N < NUM_PARAM_SETS; N++)
+        if (!isSetId(Header->ParamSets[N]) || !isSetId(Header->ParamSetsVirtual[N]))
+          return false;
+
+      for (unsigned C = 0; C < NUM_COLUMNS; C++) {
+        for (int64_t Value : getColumn((Column) C)) {
+          bool Valid;
+          switch (C) {
+          case COL_KIND:
+            Valid = Value == KIND_VIRTUAL || Value == KIND_INDIRECT;
+            break;
+          case COL_DWARF:
+          case COL_FUNCTION_NAME:
+          case COL_CLASS_NAME:
+          case COL_PRECISE_NAME:
+          case COL_CALLER:
+            Valid = Value == NO_ID || (Value >= 0 && (uint64_t) Value < StringTableSize);
+            break;
+          case COL_PARAMS:
+            Valid = Value >= 0;
+            break;
+          case COL_METRIC:
+            Valid = Value >= 0 && Value <= std::numeric_limits<uint32_t>::max();
+            break;
+          default:
+            // target counts are >= 0, -1 (ShrinkWrap of an indirect call) is NO_ID
+            Valid = C < COL_SET_PRECISE_SRC_TYPE ? Value >= NO_ID : isSetId(Value);
+          }
+          if (!Valid)
+            return false;
+        }
+      }
+      return true;
+    }
+  };
+
+} // namespace sdanalysis
+} // namespace llvm
+
+#endif
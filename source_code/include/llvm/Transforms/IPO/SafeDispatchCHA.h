@@ -1,3 +1,6 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CHA_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CHA_H
+
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/SafeDispatch.h"
 #include "llvm/Transforms/IPO.h"
@@ -16,6 +19,8 @@
 #include "llvm/IR/CallSite.h"
 
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/Transforms/IPO/SafeDispatchClassGraph.h"
+#include "llvm/Transforms/IPO/SafeDispatchDemangle.h"
 
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Transforms/Utils/Cloning.h"
@@ -38,6 +43,8 @@
 // 5. lib/Transforms/IPO/PassManagerBuilder.cpp
 
 namespace llvm {
+  class SDCHACache;
+
   /**
    * Module pass for the SafeDispatch Gold Plugin
    */
@@ -91,34 +98,6 @@ namespace llvm {
     typedef std::map<FunctionEntry, range_t>                       function_range_map_t;
     typedef std::map<FunctionEntry, uint64_t>                      function_id_map_t;
 
-  private:
-    cloud_map_t cloudMap;                              // (vtbl,ind) -> set<(vtbl,ind)>; pair -> set
-    parent_map_t parentMap;                            // vtbl -> [(vtbl, ind)]; string -> vector of sets
-    roots_t roots;                                     // set<vtbl> set
-    subvtbl_map_t subObjNameMap;                       // vtbl -> [vtbl]; string (vtable name) -> vector of strings (vtable name)
-    addrpt_map_t addrPtMap;                            // vtbl -> [addr pt]; string (vtable name) -> vector of addresses (vtable address)
-    range_map_t rangeMap;                              // vtbl -> [(start,end)]
-    ancestor_map_t ancestorMap;                        // (vtbl,ind) -> root vtbl
-    oldvtbl_map_t oldVTables;                          // vtbl -> &[vtable element]
-    std::map<vtbl_t, uint32_t> cloudSizeMap;           // vtbl -> # vtables derived from (vtbl,0), holds the range width for each v table 
-    std::set<vtbl_name_t> undefinedVTables;            // contains dynamic classes that don't have vtables defined
-
-    vtbl_function_map_t vTableFunctionMap;
-    function_map_t functionMap;
-    function_impl_map_t functionImplMap;
-    function_range_map_t functionRangeMap;
-    function_id_map_t functionIDMap;
-    uint64_t  currentID;
-
-    std::map<func_name_t, func_name_t> functionParentMap;
-    
-    /**
-     * These functions and variables used to deal with duplication
-     * of the vthunks in the vtables
-     */
-    unsigned vcallMDId;
-    std::set<Function*> vthunksToRemove;
-
     // these should match the structs defined at SafeDispatchVtblMD.h
     struct nmd_sub_t {
       uint64_t    order;
@@ -141,6 +120,52 @@ namespace llvm {
       std::vector<nmd_sub_t> subVTables; // Paul: see the struct from above
     };
 
+    typedef SDClassGraph::node_id_t                         node_id_t;      // dense id of a (vtbl,ind) pair
+    typedef SDClassGraph::class_id_t                        class_id_t;     // dense id of a vtbl name
+
+  private:
+    SDClassGraph graph;                                // interned (vtbl,ind) nodes, CSR children/parents
+    SDDemangleCache demangleCache;                     // demangled function names, filled on lookup
+    roots_t roots;                                     // set<vtbl> set
+    oldvtbl_map_t oldVTables;                          // vtbl -> &[vtable element], only used for ordered iteration
+
+    // per node attributes, indexed by node_id_t
+    std::vector<uint64_t>   nodeAddrPt;                // original address point of the sub-vtable
+    std::vector<range_t>    nodeRange;                 // original (start,end) of the sub-vtable
+    std::vector<class_id_t> nodeAncestor;              // root of the cloud the node belongs to
+    std::vector<class_id_t> nodeLayoutClass;           // class name of the sub-object
+    std::vector<uint32_t>   nodeCloudSize;             // # defined vtables derived from the node (range width)
+    std::vector<std::vector<FunctionEntry>> nodeFunctions;
+
+    // preorder (Euler tour) index of every cloud, see buildPreorderIndex()
+    std::vector<std::vector<node_id_t>> classPreorder; // root class -> preorder of its cloud
+    std::vector<uint32_t>   nodePreEnter;              // position in the preorder of its cloud
+    std::vector<uint32_t>   nodePreExit;               // one past the last node of its DFS subtree
+    std::vector<bool>       nodeExactSubtree;          // [enter,exit) holds exactly the descendants
+    std::vector<uint32_t>   nodeDescendantCount;       // # of descendants, including the node
+    std::vector<node_id_t>  nodeFirstDefined;          // first defined descendant in preorder
+
+    // per class attributes, indexed by class_id_t
+    std::vector<uint32_t>      classNumSubVTables;     // 0 for classes we never got metadata for
+    std::vector<bool>          classUndefined;         // dynamic classes that don't have vtables defined
+    std::vector<bool>          classIsRoot;
+    std::vector<ConstantArray*> classOldVTable;
+
+    function_map_t functionMap;
+    function_impl_map_t functionImplMap;
+    function_range_map_t functionRangeMap;
+    function_id_map_t functionIDMap;
+    uint64_t  currentID;
+
+    std::map<func_name_t, func_name_t> functionParentMap;
+    
+    /**
+     * These functions and variables used to deal with duplication
+     * of the vthunks in the vtables
+     */
+    unsigned vcallMDId;
+    std::set<Function*> vthunksToRemove;
+
 //  SW node elements 
 //  vec<tree> vtbl_map_uniqueparents;   /* List of unique parents (type)      */
 //  vec<tree> vtbl_map_uniquebinfos;    /* List of unique parents (binfo)     */
@@ -155,11 +180,52 @@ namespace llvm {
      * Reads the NamedMDNodes in the given module and creates the class hierarchy
      */
     void buildClouds(Module &M);
+
+    /**
+     * Intern the given (vtbl,ind) pair and grow the per node and per class
+     * attribute vectors to match
+     */
+    node_id_t internNode(const vtbl_t& vtbl);
+
     /**
      * Recursive function that calculates the number of deriving (primitive) sub-vtables of each
      * (primitive) vtable
      */
-    uint32_t calculateChildrenCounts(const vtbl_t& vtbl);
+    uint32_t calculateChildrenCounts(node_id_t node);
+
+    /**
+     * Node id based preorder, shared by all the name based traversals
+     */
+    void preorderIDs(node_id_t root, std::vector<node_id_t> &nodes);
+
+    /**
+     * Number every cloud once in preorder and record the enter/exit index of
+     * each node, so that subtree membership, subtree size and the first
+     * defined descendant don't need a traversal. Also fills the ancestor of
+     * each node.
+     *
+     * With virtual inheritance a cloud is a DAG, and a node can reach a
+     * sub-tree that was already entered from a sibling. Only for such nodes
+     * the [enter,exit) interval is not exact and the queries fall back to a
+     * traversal.
+     */
+    void buildPreorderIndex();
+
+    bool isIndexed(node_id_t n) const {
+      return nodePreEnter[n] != SDClassGraph::InvalidID;
+    }
+
+    bool isAncestor(node_id_t base, node_id_t derived);
+
+    bool isUndefinedClass(class_id_t c) const {
+      return c != SDClassGraph::InvalidID && classUndefined[c];
+    }
+
+    node_id_t getNode(const vtbl_t &vtbl) const {
+      node_id_t n = graph.lookupNode(vtbl);
+      assert(n != SDClassGraph::InvalidID && "unknown vtable");
+      return n;
+    }
     
     /**
      * Remove diamonds created due to virtual inheritance
@@ -177,18 +243,25 @@ namespace llvm {
     */
     void printClouds(const std::string &suffix);
 
-    /**
-     * Extract the vtable info from the metadata and put it into a struct
-     */
-    std::vector<nmd_t> static extractMetadata(NamedMDNode* md);
-
     range_t buildFunctionInfoForFunction(FunctionEntry &function, std::string rootFunctionName);
 
     void topoSortHelper(vtbl_name_t node, std::deque<vtbl_name_t> &ordered,
                         std::set<vtbl_name_t> &visited, std::set<vtbl_name_t> &tempMarked);
 
+    /**
+     * Records of modules whose metadata was already extracted (e.g. loaded from
+     * the on-disk cache by the gold plugin); their sd.class_info nodes are no
+     * longer in the module
+     */
+    SDCHACache *cache;
+
   public:
-    SDBuildCHA() : ModulePass(ID) {
+    /**
+     * Extract the vtable info from the metadata and put it into a struct
+     */
+    std::vector<nmd_t> static extractMetadata(NamedMDNode* md);
+
+    SDBuildCHA(SDCHACache *cache = nullptr) : ModulePass(ID), cache(cache) {
       std::cerr << "\nCreating SDBuildCHA pass!\n";
       currentID = -1;
       initializeSDBuildCHAPass(*PassRegistry::getPassRegistry());
@@ -230,7 +303,7 @@ namespace llvm {
       //for each root node it counts the number of children 
       //this value is stored when calculating the range width 
       for (auto rootName : roots) {
-        calculateChildrenCounts(vtbl_t(rootName, 0));
+        calculateChildrenCounts(getNode(vtbl_t(rootName, 0)));
       }
 
       //Paul: do a verification of the clouds.
@@ -239,8 +312,9 @@ namespace llvm {
       verifyClouds(M); 
 
       std::cerr << "Undefined vtables: \n";
-      for (auto i : undefinedVTables) {
-        std::cerr << i << "\n";
+      for (class_id_t c = 0; c < graph.numClasses(); c++) {
+        if (classUndefined[c])
+          std::cerr << graph.className(c) << "\n";
       }
 
       sd_print("\nP2. Finished building CHA ...\n");
@@ -255,6 +329,9 @@ namespace llvm {
       AU.setPreservesAll();
     }
 
+    /// shared by the passes after SDBuildCHA, each name is demangled once per link
+    SDDemangleCache &getDemangleCache() { return demangleCache; }
+
     int getNumberOfRoots(){
       return this->roots.size();
     }
@@ -271,7 +348,7 @@ namespace llvm {
      * Address point accessors
      */
     uint64_t addrPt(const vtbl_name_t& vtbl, uint64_t ind) {
-      return addrPtMap[vtbl][ind];
+      return nodeAddrPt[getNode(vtbl_t(vtbl, ind))];
     }
 
     uint64_t addrPt(const vtbl_t& vtbl) {
@@ -283,19 +360,24 @@ namespace llvm {
     }
 
     int64_t getAddrPtOrder(const vtbl_name_t& vtbl, uint64_t addrPt) {
-      for (uint64_t order = 0; order < addrPtMap[vtbl].size(); order ++)
-        if (addrPtMap[vtbl][order] == addrPt)
+      class_id_t c = graph.lookupClass(vtbl);
+      if (c == SDClassGraph::InvalidID)
+        return -1;
+      ArrayRef<node_id_t> nodes = graph.classNodeIDs(c);
+      for (uint64_t order = 0; order < classNumSubVTables[c]; order ++)
+        if (nodeAddrPt[nodes[order]] == addrPt)
           return order; 
       return -1;
     }
 
     uint64_t getNumAddrPts(const vtbl_name_t& vtbl) {
-      return addrPtMap[vtbl].size();
+      class_id_t c = graph.lookupClass(vtbl);
+      return c == SDClassGraph::InvalidID ? 0 : classNumSubVTables[c];
     }
 
-    //Paul: the v table is checked if it is contained in the undefinedVTables set 
+    //Paul: the v table is checked if it was marked as undefined while building the clouds
     bool isUndefined(const vtbl_name_t &vtbl) {
-      return undefinedVTables.find(vtbl) != undefinedVTables.end();
+      return isUndefinedClass(graph.lookupClass(vtbl));
     }
 
     bool isDefined(const vtbl_name_t &vtbl) {
@@ -314,22 +396,27 @@ namespace llvm {
      * Ancestor Map Accessors
      */
     bool hasAncestor(const vtbl_t &v) {
-      return ancestorMap.find(v) != ancestorMap.end();
+      node_id_t n = graph.lookupNode(v);
+      return n != SDClassGraph::InvalidID && nodeAncestor[n] != SDClassGraph::InvalidID;
     }
 
     vtbl_name_t getAncestor(const vtbl_t &v) {
-      return ancestorMap[v];
+      if (!hasAncestor(v))
+        return "";
+      return graph.className(nodeAncestor[graph.lookupNode(v)]);
     }
 
     /*
      * Old VTable Accessors
      */
     bool hasOldVTable(const vtbl_name_t &vtbl) {
-      return oldVTables.find(vtbl) != oldVTables.end();
+      class_id_t c = graph.lookupClass(vtbl);
+      return c != SDClassGraph::InvalidID && classOldVTable[c] != nullptr;
     }
 
     ConstantArray *getOldVTable(const vtbl_name_t &vtbl) {
-      return oldVTables[vtbl];
+      class_id_t c = graph.lookupClass(vtbl);
+      return c == SDClassGraph::InvalidID ? nullptr : classOldVTable[c];
     }
 
     oldvtbl_map_t::const_iterator oldVTables_begin() {
@@ -340,19 +427,26 @@ namespace llvm {
       return oldVTables.cend();
     }
 
-    vtbl_set_t::const_iterator children_begin(const vtbl_t &v) {
-      return cloudMap[v].begin();
+    SDClassGraph::key_iterator children_begin(const vtbl_t &v) {
+      node_id_t n = graph.lookupNode(v);
+      if (n == SDClassGraph::InvalidID)
+        return SDClassGraph::key_iterator();
+      return graph.keys_begin(graph.children(n));
     }
 
-    vtbl_set_t::const_iterator children_end(const vtbl_t &v) {
-      return cloudMap[v].end();
+    SDClassGraph::key_iterator children_end(const vtbl_t &v) {
+      node_id_t n = graph.lookupNode(v);
+      if (n == SDClassGraph::InvalidID)
+        return SDClassGraph::key_iterator();
+      return graph.keys_end(graph.children(n));
     }
     
     /*
      * Roots Set Accessors
      */
     bool isRoot(const vtbl_name_t& v) {
-      return roots.find(v) != roots.end();
+      class_id_t c = graph.lookupClass(v);
+      return c != SDClassGraph::InvalidID && classIsRoot[c];
     }
 
     const roots_t::const_iterator roots_begin() {
@@ -367,36 +461,39 @@ namespace llvm {
      * Range Map Accessors based on v table pair
      */
     const range_t& getRange(const vtbl_t &v) {
-      return rangeMap[v.first][v.second];
+      return nodeRange[getNode(v)];
     }
 
     /* Paul:
      * Range Map Accessors based on v table name and numeric order
      */
     const range_t& getRange(const vtbl_name_t &name, uint64_t order) {
-      return rangeMap[name][order];
+      return getRange(vtbl_t(name, order));
     }
 
     bool hasRange(const vtbl_t &name) {
-      return rangeMap.find(name.first) != rangeMap.end() &&
-             rangeMap[name.first].size() > name.second;
+      class_id_t c = graph.lookupClass(name.first);
+      return c != SDClassGraph::InvalidID && classNumSubVTables[c] > name.second;
     }
     /* Paul:
      * SubObj Name Map Accessors, pair based (for this reason you see .first and .second accessors)
      */
     const vtbl_name_t& getLayoutClassName(const vtbl_t &vtbl) {
-      return subObjNameMap[vtbl.first][vtbl.second];
+      return graph.className(nodeLayoutClass[getNode(vtbl)]);
     }
 
     /*Paul:
      * SubObj Name Map Accessors based on v table name and index
      */
     const vtbl_name_t& getLayoutClassName(const vtbl_name_t &name, uint64_t ind) {
-      return subObjNameMap[name][ind];
+      return getLayoutClassName(vtbl_t(name, ind));
     }
 
     const std::vector<vtbl_name_t> getSubVTables(const vtbl_name_t &name) {
-      return subObjNameMap[name];
+      std::vector<vtbl_name_t> res;
+      for (uint64_t ind = 0; ind < getNumAddrPts(name); ind++)
+        res.push_back(getLayoutClassName(name, ind));
+      return res;
     }
 
     /**
@@ -405,9 +502,44 @@ namespace llvm {
      */
     order_t preorder(const vtbl_t& root);
 
-    /*Paul: 
-    the preorder function from above calls this preorderHelper function*/
-    void preorderHelper(order_t& nodes, const vtbl_t& root, vtbl_set_t &visited);
+    /**
+     * Position of the vtable in the preorder traversal of its cloud
+     */
+    uint64_t getPreorderIndex(const vtbl_t& vtbl) {
+      node_id_t n = getNode(vtbl);
+      assert(isIndexed(n));
+      return nodePreEnter[n];
+    }
+
+    /**
+     * Return true if the preorder traversal starting at vtbl is the
+     * [getPreorderIndex(vtbl), getPreorderIndex(vtbl) + getSubtreeSize(vtbl))
+     * slice of the preorder traversal of its cloud
+     */
+    bool hasExactSubtree(const vtbl_t& vtbl) {
+      node_id_t n = graph.lookupNode(vtbl);
+      return n != SDClassGraph::InvalidID && isIndexed(n) && nodeExactSubtree[n];
+    }
+
+    /**
+     * Number of vtables reachable from the given one, including itself
+     * (i.e. the size of preorder(vtbl))
+     */
+    uint64_t getSubtreeSize(const vtbl_t& vtbl);
+
+    /**
+     * Is vtbl reachable from root (or equal to it)?
+     */
+    bool isInSubtree(const vtbl_t& root, const vtbl_t& vtbl);
+
+    /**
+     * Order the children of every node by decreasing weight of their
+     * sub-trees (missing vtables weigh 0, ties keep the old order), so the
+     * hot vtables of a cloud are next to each other in its preorder. Only
+     * single parent children with exact sub-trees are moved, so every range
+     * stays contiguous. Returns the number of reordered children lists.
+     */
+    unsigned orderSiblingsByWeight(const std::map<vtbl_t, uint64_t>& weights);
 
     /**
      * Return the number of vtables in a given primary vtable's cloud(including
@@ -444,14 +576,17 @@ namespace llvm {
     std::deque<vtbl_name_t> topoSort();
 
     FunctionEntry getFunctionEntry(const vtbl_t &v, uint64_t offsetInVtable) {
-      for (auto &entry : vTableFunctionMap[v]) {
+      for (auto &entry : nodeFunctions[getNode(v)]) {
         if (entry.offsetInVTable == offsetInVtable)
           return entry;
       }
     }
 
     std::vector<FunctionEntry> getFunctionEntries(const vtbl_t &v) {
-      return vTableFunctionMap[v];
+      node_id_t n = graph.lookupNode(v);
+      if (n == SDClassGraph::InvalidID)
+        return std::vector<FunctionEntry>();
+      return nodeFunctions[n];
     }
 
     uint64_t getMaxID() {
@@ -461,3 +596,5 @@ namespace llvm {
 
   };
 }
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CHA_CACHE_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CHA_CACHE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Transforms/IPO/SafeDispatchCHA.h"
+
+#include <string>
+#include <vector>
+
+namespace llvm {
+  class Module;
+
+  /**
+   * On-disk cache of the class hierarchy records (SDBuildCHA::nmd_t) of the
+   * input modules of an LTO link, keyed by a hash of each module's bitcode.
+   *
+   * The gold plugin hands every module to takeModuleRecords() before linking
+   * it. The records are loaded from the cache (or extracted and stored on a
+   * miss) and the sd.class_info nodes they came from are erased from the
+   * module, so neither the IR linker nor SDBuildCHA has to look at them again.
+   * SDBuildCHA then starts from records().
+   *
+   * sd.class_info nodes that reference a vtable with local linkage are left
+   * in the module: the IR linker may rename such vtables, so their names are
+   * only known after linking.
+   */
+  class SDCHACache {
+  public:
+    typedef std::vector<SDBuildCHA::nmd_t> records_t;
+
+    SDCHACache(StringRef dir) : cacheDir(dir.str()), hits(0), misses(0) {}
+
+    /**
+     * Move the cacheable sd.class_info records of M into records().
+     * bitcode is the buffer M was read from.
+     */
+    void takeModuleRecords(Module &M, StringRef bitcode);
+
+    const records_t &records() const { return Records; }
+
+    unsigned getHits() const { return hits; }
+    unsigned getMisses() const { return misses; }
+
+  private:
+    std::string cacheDir;
+    records_t Records;
+    unsigned hits;
+    unsigned misses;
+
+    std::string entryPath(StringRef bitcode) const;
+
+    bool load(const std::string &path, records_t &records,
+              std::vector<std::string> &mdNames) const;
+    void store(const std::string &path, const records_t &records,
+               const std::vector<std::string> &mdNames) const;
+  };
+}
+
+#endif
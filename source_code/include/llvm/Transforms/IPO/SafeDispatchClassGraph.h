@@ -0,0 +1,158 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CLASS_GRAPH_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CLASS_GRAPH_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <cassert>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+  /**
+   * Interned, integer indexed class hierarchy used by SDBuildCHA.
+   *
+   * Every (vtbl, ind) pair gets a dense node id and every vtable name a dense
+   * class id. Edges are collected while the metadata is read and then frozen
+   * into CSR (offset + index) child and parent lists by finalize(). Both lists
+   * are sorted by (vtbl name, ind), which is the order the old std::set based
+   * cloud map used, so every traversal visits the nodes in the same order.
+   */
+  class SDClassGraph {
+  public:
+    typedef std::string                      vtbl_name_t;
+    typedef std::pair<vtbl_name_t, uint64_t> vtbl_t;
+    typedef uint32_t                         node_id_t;
+    typedef uint32_t                         class_id_t;
+
+    static const uint32_t InvalidID = ~0U;
+
+    /**
+     * Iterates over a list of node ids and dereferences to the (vtbl, ind)
+     * key of each node, so callers that used to walk a std::set<vtbl_t> can
+     * walk the CSR lists unchanged.
+     */
+    class key_iterator
+        : public std::iterator<std::forward_iterator_tag, const vtbl_t> {
+      const SDClassGraph *G;
+      const node_id_t *P;
+
+    public:
+      key_iterator() : G(nullptr), P(nullptr) {}
+      key_iterator(const SDClassGraph *G, const node_id_t *P) : G(G), P(P) {}
+
+      const vtbl_t &operator*() const { return G->key(*P); }
+      const vtbl_t *operator->() const { return &G->key(*P); }
+      node_id_t id() const { return *P; }
+
+      key_iterator &operator++() { ++P; return *this; }
+      key_iterator operator++(int) { key_iterator tmp = *this; ++P; return tmp; }
+
+      bool operator==(const key_iterator &rhs) const { return P == rhs.P; }
+      bool operator!=(const key_iterator &rhs) const { return P != rhs.P; }
+    };
+
+    SDClassGraph() : finalized(false) {}
+
+    /// Return the id of the given class, creating it if necessary.
+    class_id_t internClass(StringRef name);
+
+    /// Return the id of the given class or InvalidID.
+    class_id_t lookupClass(StringRef name) const {
+      auto it = classIDs.find(name);
+      return it == classIDs.end() ? InvalidID : it->second;
+    }
+
+    /// Return the id of the (name, ind) node, creating it if necessary.
+    node_id_t internNode(StringRef name, uint64_t ind);
+
+    /// Return the id of the (name, ind) node or InvalidID.
+    node_id_t lookupNode(StringRef name, uint64_t ind) const {
+      class_id_t c = lookupClass(name);
+      if (c == InvalidID || ind >= classNodes[c].size())
+        return InvalidID;
+      return classNodes[c][ind];
+    }
+
+    node_id_t lookupNode(const vtbl_t &v) const {
+      return lookupNode(v.first, v.second);
+    }
+
+    /// Record a parent -> child edge. Duplicates are dropped by finalize().
+    void addEdge(node_id_t parent, node_id_t child) {
+      assert(!finalized && "graph is already frozen");
+      edges.push_back(std::make_pair(parent, child));
+    }
+
+    /// Freeze the collected edges into sorted CSR child and parent lists.
+    void finalize();
+
+    bool isFinalized() const { return finalized; }
+
+    void clear();
+
+    unsigned numNodes() const { return keys.size(); }
+    unsigned numClasses() const { return classNames.size(); }
+
+    const vtbl_t &key(node_id_t n) const { return keys[n]; }
+    class_id_t classOf(node_id_t n) const { return nodeClass[n]; }
+    const vtbl_name_t &className(class_id_t c) const { return classNames[c]; }
+
+    /// Node ids of a class indexed by ind; never seen indices are InvalidID.
+    ArrayRef<node_id_t> classNodeIDs(class_id_t c) const {
+      return classNodes[c];
+    }
+
+    ArrayRef<node_id_t> children(node_id_t n) const {
+      assert(finalized);
+      return ArrayRef<node_id_t>(childIndex.data() + childOffsets[n],
+                                 childOffsets[n + 1] - childOffsets[n]);
+    }
+
+    /// Children in place, for callers that pick a different sibling order.
+    MutableArrayRef<node_id_t> mutableChildren(node_id_t n) {
+      assert(finalized);
+      return MutableArrayRef<node_id_t>(childIndex.data() + childOffsets[n],
+                                        childOffsets[n + 1] - childOffsets[n]);
+    }
+
+    ArrayRef<node_id_t> parents(node_id_t n) const {
+      assert(finalized);
+      return ArrayRef<node_id_t>(parentIndex.data() + parentOffsets[n],
+                                 parentOffsets[n + 1] - parentOffsets[n]);
+    }
+
+    key_iterator keys_begin(ArrayRef<node_id_t> ids) const {
+      return key_iterator(this, ids.begin());
+    }
+
+    key_iterator keys_end(ArrayRef<node_id_t> ids) const {
+      return key_iterator(this, ids.end());
+    }
+
+  private:
+    StringMap<class_id_t>               classIDs;     // vtbl name -> class id
+    std::vector<vtbl_name_t>            classNames;   // class id -> vtbl name
+    std::vector<std::vector<node_id_t>> classNodes;   // class id -> [ind -> node id]
+
+    std::vector<vtbl_t>                 keys;         // node id -> (vtbl, ind)
+    std::vector<class_id_t>             nodeClass;    // node id -> class id
+
+    std::vector<std::pair<node_id_t, node_id_t>> edges; // (parent, child) until finalize()
+
+    std::vector<uint32_t>               childOffsets; // CSR, numNodes() + 1 entries
+    std::vector<node_id_t>              childIndex;
+    std::vector<uint32_t>               parentOffsets;
+    std::vector<node_id_t>              parentIndex;
+
+    bool finalized;
+
+    void buildCSR(bool byParent, std::vector<uint32_t> &offsets,
+                  std::vector<node_id_t> &index) const;
+  };
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CLASSINFO_MD_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_CLASSINFO_MD_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/SafeDispatchClassInfo.h"
+
+#include <string>
+
+/**
+ * Compact encoding of the sd.class_info named metadata.
+ *
+ * Instead of one MDString/MDTuple tree per sub-vtable, every class gets a
+ * single operand {blob, {vtbl gv md...}}. The blob is an MDString holding
+ *
+ *   magic
+ *   #vtbl names,     (len, bytes)*      <- index 0 is the class itself
+ *   #function names, (len, bytes)*
+ *   #sub-vtables
+ *     order, start, end - start, addrPt - start
+ *     #parents,   (vtbl name index, order)*
+ *     #functions, (function name index, offset)*
+ *
+ * where every number is an ULEB128 varint. The second operand holds the
+ * vtable global variable (or NO_VTABLE) of every vtbl name, so the names can
+ * still be fixed up after the IR linker renamed a local vtable.
+ *
+ * The old tree format is emitted with -fsd-legacy-class-info, SDBuildCHA
+ * reads both. The magic and the record size helper the IR linker needs are
+ * in llvm/IR/SafeDispatchClassInfo.h.
+ */
+
+static inline void sd_writeULEB(std::string &out, uint64_t val) {
+  do {
+    uint8_t byte = val & 0x7f;
+    val >>= 7;
+    if (val != 0)
+      byte |= 0x80;
+    out.push_back((char) byte);
+  } while (val != 0);
+}
+
+static inline void sd_writeULEBString(std::string &out, llvm::StringRef str) {
+  sd_writeULEB(out, str.size());
+  out.append(str.begin(), str.end());
+}
+
+/**
+ * Bounds checked reader for the compact class info blob
+ */
+struct sd_classinfo_reader_t {
+  llvm::StringRef buf;
+  bool failed;
+
+  sd_classinfo_reader_t(llvm::StringRef buf) : buf(buf), failed(false) {}
+
+  uint64_t readULEB() {
+    uint64_t val = 0;
+    unsigned shift = 0;
+    while (!failed) {
+      if (buf.empty() || shift >= 64) {
+        failed = true;
+        break;
+      }
+      uint8_t byte = buf[0];
+      buf = buf.drop_front(1);
+      val |= (uint64_t)(byte & 0x7f) << shift;
+      shift += 7;
+      if ((byte & 0x80) == 0)
+        return val;
+    }
+    return 0;
+  }
+
+  /// A number of entries that follow. Every entry takes at least one byte,
+  /// so a count larger than the rest of the buffer is malformed.
+  uint64_t readCount() {
+    uint64_t count = readULEB();
+    if (count > buf.size())
+      failed = true;
+    return failed ? 0 : count;
+  }
+
+  llvm::StringRef readString() {
+    uint64_t size = readULEB();
+    if (failed || buf.size() < size) {
+      failed = true;
+      return llvm::StringRef();
+    }
+    llvm::StringRef str = buf.substr(0, size);
+    buf = buf.drop_front(size);
+    return str;
+  }
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_DEMANGLE_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_DEMANGLE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+
+#include <mutex>
+
+namespace llvm {
+  /**
+   * Module wide cache of demangled function names, owned by SDBuildCHA
+   * (getDemangleCache()) and shared by the passes that run after it.
+   *
+   * A name is demangled the first time it is looked up and never again. The
+   * demangled strings are interned in the cache, so the StringRefs it hands
+   * out stay valid as long as the SDBuildCHA pass. Lookups may come from
+   * several threads at once (SDAnalysis -sd-analysis-threads).
+   */
+  class SDDemangleCache {
+  public:
+    struct entry_t {
+      bool demangled;       // false: not an Itanium name, baseName is the name itself
+      StringRef full;       // ns::A::foo(int)
+      StringRef baseName;   // foo
+      StringRef qualifier;  // ns::A, empty for free functions
+    };
+
+    SDDemangleCache() : misses(0) {}
+
+    /// Only names starting with '_' are demangled.
+    const entry_t &lookup(StringRef mangled);
+
+    /// The function name PreciseTargetSignature (vTrust) keys on.
+    StringRef getBaseName(StringRef mangled) { return lookup(mangled).baseName; }
+
+    StringRef getQualifier(StringRef mangled) { return lookup(mangled).qualifier; }
+
+    unsigned size() const { return entries.size(); }
+    unsigned getMisses() const { return misses; }
+
+  private:
+    StringMap<entry_t> entries;
+    BumpPtrAllocator strings;
+    std::mutex lock;              // guards entries and strings, not the demangling
+    unsigned misses;
+
+    StringRef intern(StringRef str);
+  };
+}
+
+#endif
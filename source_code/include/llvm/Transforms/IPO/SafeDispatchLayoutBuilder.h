@@ -65,6 +65,29 @@ namespace llvm {
     typedef std::map<vtbl_t, std::vector<mem_range_t> >     mem_range_map_t;
     typedef std::map<vtbl_t, uint64_t>                      pad_map_t;
 
+    /**
+     * Everything computed for one cloud before the IR is touched. Clouds
+     * are independent, so these are filled concurrently (see
+     * -sd-layout-threads) and then merged into the maps below in the order
+     * of the roots.
+     */
+    struct cloud_layout_t {
+      interleaving_list_t interleaving;                     // new layout of the cloud
+      unsigned            alignment;
+      pad_map_t           prePad;
+      new_layout_inds_t   newLayoutInds;
+      range_map_t         ranges;                           // vptr ranges in terms of preorder indices
+
+      // size in entries and number of memory ranges of the ordered layout,
+      // and of the default (largest vtable) stride, see -sd-layout-min-padding
+      uint64_t            paddedSize = 0;
+      uint64_t            numMemRanges = 0;
+      uint64_t            baseSize = 0;
+      uint64_t            baseNumMemRanges = 0;
+
+      std::string         log;                              // sdLog output, see computeCloudLayout
+    };
+
     new_layout_inds_t newLayoutInds;                        // (vtbl,ind) -> [new ind inside interleaved vtbl]
     interleaving_map_t interleavingMap;                     // root -> new layouts map
     vtbl_start_map_t newVTableStartAddrMap;                 // Starting addresses of all new vtables
@@ -103,7 +126,10 @@ namespace llvm {
       The v tables area interleaved or ordered depending 
       on the used interleaving flag. 
       */
-      
+
+      // with -sd-layout-profile, order the siblings by hotness first
+      applyProfileOrder(M);
+
       buildNewLayouts(M);
 
       //after building the new layout verify them according to some imposed conditions 
@@ -121,6 +147,10 @@ namespace llvm {
       AU.addPreserved<SDBuildCHA>();
     }
  
+    /*Paul:
+    reorder the children in the CHA by the -sd-layout-profile counts*/
+    void applyProfileOrder(Module &M);
+
      /*Paul:
     build the analysis results of interleave and order*/
     virtual void buildNewLayouts(Module &M);
@@ -163,41 +193,88 @@ namespace llvm {
     Value* newVtblAddress(Module& M, const vtbl_name_t& name, Instruction* inst);
     Constant* newVtblAddressConst(Module& M, const vtbl_t& vtbl);
 
+    /**
+     * Compute the layout, the new indices and the vptr ranges of one cloud.
+     * Only reads the CHA, so it is safe to run for several roots at once.
+     */
+    void computeCloudLayout(const vtbl_name_t& vtbl, cloud_layout_t& layout);
+
+    /**
+     * Move the results of computeCloudLayout into the pass wide maps
+     */
+    void commitCloudLayout(const vtbl_name_t& vtbl, cloud_layout_t& layout);
+
     /**
      * Order and pad the cloud given by the root element.
      */
-    void orderCloud(vtbl_name_t& vtbl);
+    void orderCloud(const vtbl_name_t& vtbl, cloud_layout_t& layout, raw_ostream& log);
+
+    /**
+     * Pad the vtables of pre so that every address point is a multiple of
+     * stride entries. slots receives the stride slot of each defined vtable
+     * (-1 for undefined ones).
+     */
+    void padOrderedCloud(const order_t& pre, uint64_t stride,
+                         interleaving_vec_t& ordered, std::vector<int64_t>& slots,
+                         raw_ostream& log);
+
+    /**
+     * Number of memory ranges the checks of the cloud need when the defined
+     * vtables of pre sit in the given stride slots. A vptr range is split
+     * wherever a vtable spans more than one slot.
+     */
+    uint64_t countOrderedMemRanges(const order_t& pre, const std::vector<int64_t>& slots,
+                                   const range_map_t& ranges);
 
     /**
      * Interleave and pad the cloud given by the root element.
      */
-    void interleaveCloud(vtbl_name_t& vtbl);
+    void interleaveCloud(const vtbl_name_t& vtbl, cloud_layout_t& layout);
 
     /**
      * New Interleaving method 
      */
-    void interleaveCloudNew(vtbl_name_t& vtbl);
+    void interleaveCloudNew(const vtbl_name_t& vtbl, cloud_layout_t& layout);
 
 
     /**
      * Calculate the new layout indices for each vtable inside the given cloud
      */
-    void calculateNewLayoutInds(vtbl_name_t& vtbl);
+    void calculateNewLayoutInds(const vtbl_name_t& vtbl, cloud_layout_t& layout);
+
+    /** Paul
+     * Calculate the v pointer ranges (in terms of preorder indices)
+     */
+    void calculateVPtrRanges(const vtbl_name_t& vtbl, range_map_t& ranges, raw_ostream& log);
 
     /** Paul
-     * Calculate the v pointer ranges
+     * Turn the v pointer ranges of the cloud into memory ranges
      */
-    void calculateVPtrRanges(Module& M, vtbl_name_t& vtbl);
+    void calculateMemRanges(Module& M, vtbl_name_t& vtbl);
   
     /** Paul
      * helper for the above function
      */
-    void calculateVPtrRangesHelper(const vtbl_t& vtbl, std::map<vtbl_t, uint64_t> &indMap);
+    void calculateVPtrRangesHelper(const vtbl_t& vtbl, std::map<vtbl_t, uint64_t> &indMap,
+                                   range_map_t& ranges, raw_ostream& log);
 
      /** Paul
      * after calculating the ranges, see method above, these will be checked
      */
-    void verifyVPtrRanges(vtbl_name_t& vtbl);
+    void verifyVPtrRanges(const vtbl_name_t& vtbl, range_map_t& ranges);
+
+    /**
+     * Emit the range table libdlcfi checks the vptrs of classes of this
+     * module against when they are used from another module
+     */
+    void emitRangeTable(Module& M);
+
+    /**
+     * Emit the (address point, RTTI offset, offset-to-top offset) table of
+     * all interleaved vtables and register it with libdyncast, so
+     * __ivtbl_dynamic_cast can find the RTTI of the whole object.
+     */
+    void emitAddressPointTable(Module& M);
 
     /**
      * Interleave the actual vtable elements inside the cloud and
@@ -213,7 +290,8 @@ namespace llvm {
      * @param order       : A list that contains the preorder traversal
      * @param positiveOff : true if we're filling the positive (function pointers) part
      */
-    void fillVtablePart(interleaving_list_t& part, const order_t& order, bool positiveOff);
+    void fillVtablePart(interleaving_list_t& part, const order_t& order, bool positiveOff,
+                        pad_map_t& prePad);
 
     /**
      * These functions and variables used to deal with duplication
@@ -2,12 +2,51 @@
 #define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_MD_H
 
 #include "llvm/IR/Metadata.h"
+#include "llvm/IR/SafeDispatchClassInfo.h"
 
 /**
  * name of the replacement function for __dynamic_cast
  */
 #define SD_DYNCAST_FUNC_NAME "__ivtbl_dynamic_cast"
 
+/**
+ * libdyncast functions the interleaved address point table of a module
+ * (address point, RTTI offset, offset-to-top offset) is handed to
+ */
+#define SD_APINFO_REGISTER_FUNC_NAME   "__ivtbl_register_apinfo"
+#define SD_APINFO_UNREGISTER_FUNC_NAME "__ivtbl_unregister_apinfo"
+
+/**
+ * range table of a linked module, read by libdlcfi (SDRangeTable_t)
+ *
+ *   magic, #entries,
+ *   (class name hash, start - &entry, width, alignment)*   sorted by hash
+ */
+#define SD_RANGE_TABLE_NAME    "__sd_range_table"
+#define SD_RANGE_TABLE_SECTION ".sd_range_table"
+#define SD_RANGE_TABLE_MAGIC   0x3130525444534fULL // "OSDTR01"
+
+/**
+ * libdlcfi functions a constructor of the module hands its range table to
+ * (and a destructor takes it back from). They are called through weak
+ * declarations, modules not linked with libdlcfi do not need them.
+ *
+ *   void SD_RANGE_TABLE_REGISTER_FUNC_NAME(const void *table)
+ */
+#define SD_RANGE_TABLE_REGISTER_FUNC_NAME   "__sd_register_range_table"
+#define SD_RANGE_TABLE_UNREGISTER_FUNC_NAME "__sd_unregister_range_table"
+
+/**
+ * failed vptr checks of a module call its internal cold SD_CHECK_FAIL_FUNC_NAME
+ * (call site id, class name hash, vptr), which calls the optional
+ *
+ *   void SD_CHECK_FAILED_HOOK_NAME(uint64_t id, uint64_t classHash, const void *vptr)
+ *
+ * (defined by libdlcfi) and traps
+ */
+#define SD_CHECK_FAIL_FUNC_NAME   "__sd_check_fail"
+#define SD_CHECK_FAILED_HOOK_NAME "__sd_vptr_check_failed"
+
 /**
  * metadata names used for the SafeDispatch project.
  * This meta data names are added to the new metadata
@@ -22,10 +61,5 @@
 #define SD_MD_MEMPTR_OPT "sd.memptr3"     // class name, annotate the member pointer 3
 #define SD_MD_CHECK      "sd.check"       // class name, annotate the check 
 
-/**
- * named md used to store the vtable info
- */
-#define SD_MD_CLASSINFO  "sd.class_info." 
-
 #endif
 
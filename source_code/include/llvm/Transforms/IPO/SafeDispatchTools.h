@@ -37,5 +37,19 @@ static bool sd_isVtableName(std::string& className) {
 
   return sd_isVtableName_ref(name);
 }
+
+/**
+ * Stable 64 bit (FNV-1a) hash of a mangled class name. The cross-DSO check
+ * passes it to vptr_safe_id instead of the name, and the range map and
+ * whitelist entries carry it, so libdlcfi (dlcfi_hash) must use the same.
+ */
+static inline uint64_t sd_getClassNameHash(llvm::StringRef name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : name) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
 #endif
 
@@ -10,6 +10,7 @@
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
 #include "llvm/Transforms/IPO/SafeDispatchMD.h"
 #include "llvm/Transforms/IPO/SafeDispatchGVMd.h"
+#include "llvm/Transforms/IPO/SafeDispatchClassInfoMD.h"
 
 #include <iostream>
 #include <string>
@@ -103,6 +104,88 @@ public:
         << addressPoint;
   }
 };
+
+/**
+ * Interns the names used by a compact class info blob
+ */
+class SD_StringTable
+{
+public:
+  std::vector<std::string> names;
+  std::map<std::string, uint64_t> index;
+
+  uint64_t get(const std::string &name)
+  {
+    auto res = index.insert(std::make_pair(name, (uint64_t)names.size()));
+    if (res.second)
+    {
+      names.push_back(name);
+    }
+    return res.first->second;
+  }
+};
+}
+
+/**
+ * Encodes the sub-vtables of a class into a single {blob, {vtbl gv md...}}
+ * node, see SafeDispatchClassInfoMD.h for the layout.
+ */
+static llvm::MDNode *sd_getCompactClassInfoMD(llvm::Module &M,
+                                              llvm::LLVMContext &C,
+                                              const std::string &className,
+                                              llvm::GlobalVariable *VTable,
+                                              const std::vector<SD_VtableMD> &subVtables)
+{
+  SD_StringTable vtbls;
+  SD_StringTable functions;
+  std::string body;
+
+  vtbls.get(className);
+
+  sd_writeULEB(body, subVtables.size());
+  for (const SD_VtableMD &sub : subVtables)
+  {
+    sd_writeULEB(body, sub.order);
+    sd_writeULEB(body, sub.start);
+    sd_writeULEB(body, sub.end - sub.start);
+    sd_writeULEB(body, sub.addressPoint - sub.start);
+
+    sd_writeULEB(body, sub.parents.size());
+    for (auto &pt : sub.parents)
+    {
+      sd_writeULEB(body, vtbls.get(pt.first));
+      sd_writeULEB(body, pt.second);
+    }
+
+    sd_writeULEB(body, sub.functions.size());
+    for (auto &fn : sub.functions)
+    {
+      sd_writeULEB(body, functions.get(fn.first));
+      sd_writeULEB(body, fn.second);
+    }
+  }
+
+  // the string tables go in front of the sub-vtables
+  std::string blob(SD_MD_CLASSINFO_MAGIC);
+  sd_writeULEB(blob, vtbls.names.size());
+  for (auto &name : vtbls.names)
+  {
+    sd_writeULEBString(blob, name);
+  }
+  sd_writeULEB(blob, functions.names.size());
+  for (auto &name : functions.names)
+  {
+    sd_writeULEBString(blob, name);
+  }
+  blob += body;
+
+  std::vector<llvm::Metadata *> gvs;
+  for (unsigned i = 0; i < vtbls.names.size(); ++i)
+  {
+    gvs.push_back(sd_getClassVtblGVMD(vtbls.names[i], M, i == 0 ? VTable : NULL));
+  }
+
+  return llvm::MDNode::get(C, {llvm::MDString::get(C, blob), llvm::MDNode::get(C, gvs)});
 }
 
 /**
@@ -426,19 +509,27 @@ static void sd_insertVtableMD(clang::CodeGen::CodeGenModule *CGM,
 
   llvm::Module &M = CGM->getModule();
 
-  // first put the class name
-  classInfo->addOperand(llvm::MDNode::get(C, sd_getMDString(C, className)));
+  if (!CGM->getCodeGenOpts().SDLegacyClassInfo)
+  {
+    // a single operand holding the whole class
+    classInfo->addOperand(sd_getCompactClassInfoMD(M, C, className, VTable, subVtables));
+  }
+  else
+  {
+    // first put the class name
+    classInfo->addOperand(llvm::MDNode::get(C, sd_getMDString(C, className)));
 
-  // second put the vtable global variable as a new MDNode into classInfo
-  classInfo->addOperand(sd_getClassVtblGVMD(className, M, VTable));
+    // second put the vtable global variable as a new MDNode into classInfo
+    classInfo->addOperand(sd_getClassVtblGVMD(className, M, VTable));
 
-  // third put the size of the tuple
-  classInfo->addOperand(llvm::MDNode::get(C, sd_getMDNumber(C, subVtables.size())));
+    // third put the size of the tuple
+    classInfo->addOperand(llvm::MDNode::get(C, sd_getMDNumber(C, subVtables.size())));
 
-  // then add md for each sub-vtable
-  for (unsigned i = 0; i < subVtables.size(); ++i)
-  {
-    classInfo->addOperand(subVtables[i].getMDNode(M, C));
+    // then add md for each sub-vtable
+    for (unsigned i = 0; i < subVtables.size(); ++i)
+    {
+      classInfo->addOperand(subVtables[i].getMDNode(M, C));
+    }
   }
 
   // make sure parent class' metadata is added too
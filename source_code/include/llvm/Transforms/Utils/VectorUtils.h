@@ -100,8 +100,11 @@ getIntrinsicIDForCall(CallInst *CI, const TargetLibraryInfo *TLI) {
   // If we have an intrinsic call, check if it is trivially vectorizable.
   if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(CI)) {
     Intrinsic::ID ID = II->getIntrinsicID();
+    // sd_get_checked_vptr is widened to sd_get_checked_vptrs by the loop
+    // vectorizer, it is not trivially vectorizable
     if (isTriviallyVectorizable(ID) || ID == Intrinsic::lifetime_start ||
-        ID == Intrinsic::lifetime_end || ID == Intrinsic::assume)
+        ID == Intrinsic::lifetime_end || ID == Intrinsic::assume ||
+        ID == Intrinsic::sd_get_checked_vptr)
       return ID;
     else
       return Intrinsic::not_intrinsic;
@@ -483,6 +483,11 @@ static std::string getMangledTypeStr(Type* Ty) {
   } else if (ArrayType* ATyp = dyn_cast<ArrayType>(Ty)) {
     Result += "a" + llvm::utostr(ATyp->getNumElements()) +
       getMangledTypeStr(ATyp->getElementType());
+  } else if (VectorType* VTyp = dyn_cast<VectorType>(Ty)) {
+    // same as the EVT string for vectors of integers and floats, but also
+    // handles vectors of pointers (e.g. sd_get_checked_vptrs)
+    Result += "v" + llvm::utostr(VTyp->getNumElements()) +
+      getMangledTypeStr(VTyp->getElementType());
   } else if (StructType* STyp = dyn_cast<StructType>(Ty)) {
     if (!STyp->isLiteral())
       Result += STyp->getName();
@@ -25,6 +25,7 @@
 #include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/SafeDispatchClassInfo.h"
 #include "llvm/IR/TypeFinder.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
@@ -32,6 +33,7 @@
 #include "llvm/Transforms/Utils/Cloning.h"
 #include <cctype>
 #include <tuple>
+#include <unordered_map>
 using namespace llvm;
 
 
@@ -505,6 +507,7 @@ private:
   bool linkGlobalValueBody(GlobalValue &Src);
 
   void linkNamedMDNodes();
+  void linkSDClassInfo(const NamedMDNode &SrcNMD, NamedMDNode &DestNMD);
   void stripReplacedSubprograms();
 };
 }
@@ -1260,6 +1263,10 @@ void ModuleLinker::linkNamedMDNodes() {
     // Don't link module flags here. Do them separately.
     if (&*I == SrcModFlags) continue;
     NamedMDNode *DestNMD = DstM->getOrInsertNamedMetadata(I->getName());
+    if (I->getName().startswith(SD_MD_CLASSINFO)) {
+      linkSDClassInfo(*I, *DestNMD);
+      continue;
+    }
     // Add Src elements into Dest node.
     for (unsigned i = 0, e = I->getNumOperands(); i != e; ++i)
       DestNMD->addOperand(MapMetadata(I->getOperand(i), ValueMap, RF_None,
@@ -1267,6 +1274,51 @@ void ModuleLinker::linkNamedMDNodes() {
   }
 }
 
+/// SafeDispatch class hierarchy records are emitted by every TU that emits
+/// the vtable of a class. Metadata is uniqued, so the mapped records of
+/// identical classes are pointer-identical; only append the source records
+/// whose hash (and operands) are not in the destination yet.
+void ModuleLinker::linkSDClassInfo(const NamedMDNode &SrcNMD,
+                                   NamedMDNode &DestNMD) {
+  // hash -> first operands, every hash value is a valid key (unlike DenseMap)
+  std::unordered_map<size_t, SmallVector<unsigned, 1>> Known;
+  for (unsigned i = 0, e = DestNMD.getNumOperands(); i != e;) {
+    unsigned Size = sd_getClassRecordSize(&DestNMD, i);
+    SmallVector<const MDNode *, 4> Record;
+    for (unsigned j = i; j != i + Size; ++j)
+      Record.push_back(DestNMD.getOperand(j));
+    Known[sd_hashClassRecord(Record)].push_back(i);
+    i += Size;
+  }
+
+  for (unsigned i = 0, e = SrcNMD.getNumOperands(); i != e;) {
+    unsigned Size = sd_getClassRecordSize(&SrcNMD, i);
+    SmallVector<const MDNode *, 4> Record;
+    for (unsigned j = i; j != i + Size; ++j)
+      Record.push_back(MapMetadata(SrcNMD.getOperand(j), ValueMap, RF_None,
+                                   &TypeMap, &ValMaterializer));
+    i += Size;
+
+    SmallVector<unsigned, 1> &Bucket = Known[sd_hashClassRecord(Record)];
+    bool Duplicate = false;
+    for (unsigned Start : Bucket) {
+      if (Start + Record.size() > DestNMD.getNumOperands())
+        continue;
+      Duplicate = true;
+      for (unsigned j = 0; j != Record.size() && Duplicate; ++j)
+        Duplicate = DestNMD.getOperand(Start + j) == Record[j];
+      if (Duplicate)
+        break;
+    }
+    if (Duplicate)
+      continue;
+
+    Bucket.push_back(DestNMD.getNumOperands());
+    for (const MDNode *N : Record)
+      DestNMD.addOperand(const_cast<MDNode *>(N));
+  }
+}
+
 /// Drop DISubprograms that have been superseded.
 ///
 /// FIXME: this creates an asymmetric result: we strip functions from losing
@@ -46,6 +46,17 @@ void llvm::initializeIPO(PassRegistry &Registry) {
   initializeStripDeadDebugInfoPass(Registry);
   initializeStripNonDebugSymbolsPass(Registry);
   initializeBarrierNoopPass(Registry);
+
+  // safedispatch passes, so that opt can run them on their own
+  initializeSDFixPass(Registry);
+  initializeSDBuildCHAPass(Registry);
+  initializeSDLayoutBuilderPass(Registry);
+  initializeSDUpdateIndicesPass(Registry);
+  initializeSDMoveBasicBlocksPass(Registry);
+  initializeSDSubstModulePass(Registry);
+  initializeSDAnalysisPass(Registry);
+  initializeSDCleanupPass(Registry);
+  initializeSDCheckElimPass(Registry);
 }
 
 void LLVMInitializeIPO(LLVMPassRegistryRef R) {
@@ -55,6 +55,10 @@ static cl::opt<bool> UseNewSROA("use-new-sroa",
   cl::init(true), cl::Hidden,
   cl::desc("Enable the new, experimental SROA pass"));
 
+static cl::opt<bool>
+RunSDCheckElim("sd-check-elim", cl::init(true), cl::Hidden,
+               cl::desc("Remove SafeDispatch vptr checks implied by earlier checks"));
+
 static cl::opt<bool>
 RunLoopRerolling("reroll-loops", cl::Hidden,
                  cl::desc("Run the loop rerolling pass"));
@@ -105,6 +109,7 @@ PassManagerBuilder::PassManagerBuilder() {
     EmitIVTBLs = false;
     EmitOVTBLs = false;
     EmitReturnChecks = false;
+    SDClassInfoCache = nullptr;
 }
 
 PassManagerBuilder::~PassManagerBuilder() {
@@ -538,7 +543,7 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
 
     //Paul: these are the 4 four passes, the other 2 passes are down
     PM.add(llvm::createSDFixPass());
-    PM.add(llvm::createSDBuildCHAPass());
+    PM.add(llvm::createSDBuildCHAPass(SDClassInfoCache));
 
     if (EmitReturnChecks) {
       PM.add(llvm::createSDAnalysisPass());
@@ -546,6 +551,8 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
     if (EmitIVTBLs || EmitOVTBLs) {
       PM.add(llvm::createSDLayoutBuilderPass(EmitIVTBLs));
       PM.add(llvm::createSDUpdateIndicesPass());
+      if (RunSDCheckElim)
+        PM.add(llvm::createSDCheckElimPass());
       //Paul: this pass adds the checks
       PM.add(llvm::createSDSubstModulePass());
     }
@@ -560,10 +567,8 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
   if (OptLevel != 0)
     addLateLTOOptimizationPasses(PM);
 
-  if (EmitIVTBLs || EmitOVTBLs || EmitReturnChecks) {
-     //Paul: this pass moves some bb
-    PM.add(llvm::createSDMoveBasicBlocksPass());
-  }
+  // the failed vptr checks of a function share one trap block that is
+  // created at its end, so SDMoveBasicBlocks is no longer needed here
 
   if (VerifyOutput)
     PM.add(createVerifierPass());
@@ -11,19 +11,40 @@
 //
 //===----------------------------------------------------------------------===//
 
-#include "llvm/Demangle/Demangle.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/DebugInfo.h"
+#include "llvm/Transforms/IPO/SafeDispatchAnalysisFile.h"
 #include "llvm/Transforms/IPO/SafeDispatchLayoutBuilder.h"
 #include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
 
+#include <llvm/Support/CommandLine.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/Path.h>
+#include <llvm/Support/Threading.h>
+#include <array>
+#include <atomic>
 #include <fstream>
+#include <iterator>
 #include <sstream>
+#include <thread>
 
 using namespace llvm;
 
+// the .sda file holds the target sets of every call site, the CSVs only the counts
+static cl::opt<bool> SDAnalysisBinary("sd-analysis-binary",
+                                      cl::desc("Also write the SDAnalysis results as a columnar binary .sda file"),
+                                      cl::init(true));
+
+// the CallSites of different functions are analysed independently, the rows are written in the serial order
+static cl::opt<unsigned> SDAnalysisThreads("sd-analysis-threads",
+                                           cl::desc("Number of threads analysing the SDAnalysis CallSites "
+                                                    "(0 = one per core)"),
+                                           cl::init(1));
+
 static const std::string itaniumConstructorTokens[3] = {"C0Ev", "C1Ev", "C2Ev"};
 
 static StringRef sd_getClassNameFromMD(llvm::MDNode *MDNode, unsigned operandNo = 0) {
@@ -197,6 +218,7 @@ private:
         std::string ClassName = "";
         std::string PreciseName = "";
         std::string DisplayName = "";
+        StringRef DemangledName = "";       // key of the precise signature (vTrust), interned by the CHA
 
         const int Params;
         std::string Dwarf = "";
@@ -217,76 +239,162 @@ private:
         int64_t HierarchyIslandMatches = -1;
     };
 
-    typedef std::set<SDBuildCHA::func_name_t> func_name_set;
-    typedef std::map<uint64_t, SDBuildCHA::func_name_t> offset_to_func_name;
-    typedef std::map<uint64_t, std::set<SDBuildCHA::func_name_t>> offset_to_func_name_set;
-    typedef std::pair<std::string, uint64_t> preciseFunctionSignature_t;
+    /** target sets hold dense function ids (see getFunctionId), so merging sub
+     *  hierarchies is a word-wise OR. The number of targets is counted once by
+     *  countTargets, the CallSites only read it. */
+    class func_id_set {
+        BitVector Ids;
+        int64_t Count = 0;                  // -1 until counted again
+
+    public:
+        class const_iterator : public std::iterator<std::forward_iterator_tag, unsigned> {
+            const BitVector *Ids;
+            int Id;
+
+        public:
+            const_iterator(const BitVector *Ids, int Id) : Ids(Ids), Id(Id) {}
+            unsigned operator*() const { return Id; }
+            const_iterator &operator++() {
+                Id = Ids->find_next(Id);
+                return *this;
+            }
+            bool operator==(const const_iterator &Other) const { return Id == Other.Id; }
+            bool operator!=(const const_iterator &Other) const { return Id != Other.Id; }
+        };
+
+        void set(unsigned Id) {
+            if (Id >= Ids.size())
+                Ids.resize(Id + 1);
+            Ids.set(Id);
+            Count = -1;
+        }
+
+        bool test(unsigned Id) const { return Id < Ids.size() && Ids.test(Id); }
+
+        func_id_set &operator|=(const func_id_set &Other) {
+            Ids |= Other.Ids;
+            Count = -1;
+            return *this;
+        }
+
+        void updateCount() { Count = Ids.count(); }
+
+        int64_t count() const {
+            assert(Count >= 0 && "target set changed since it was counted");
+            return Count;
+        }
+
+        const_iterator begin() const { return const_iterator(&Ids, Ids.find_first()); }
+        const_iterator end() const { return const_iterator(&Ids, -1); }
+    };
+
+    typedef std::map<uint64_t, unsigned> offset_to_func_id;
+    typedef std::map<uint64_t, func_id_set> offset_to_func_id_set;
+    typedef std::pair<StringRef, uint64_t> preciseFunctionSignature_t;  // (demangled base name, encoding)
 
     SDBuildCHA *CHA{};
+    SDDemangleCache *Demangler{};
 
     std::set<CallSite> VirtualCallSites{};  // analysed vcall (used to filter the remaining indirect calls)
     int64_t CallSiteCount = 0;              // counts analysed CallSites
-    std::vector<CallSiteInfo> Data{};       // info for every analysed CallSite
 
-    // metric results (used for sorting CallSiteInfo)
-    std::map<float, std::vector<CallSiteInfo>> MetricVirtual{};
-    std::map<float, std::vector<CallSiteInfo>> MetricIndirect{};
+    /** CallSites found but not analysed yet, analyseCall fills in the Info */
+    struct PendingCallSite {
+        CallSite Call;
+        std::unique_ptr<CallSiteInfo> Info;
+    };
+    std::vector<PendingCallSite> PendingCallSites{};
+    // analysed and written in batches, so only a batch of CallSiteInfos is kept at a time
+    static const unsigned CallSiteBatchSize = 1 << 14;
+
+    /** The rows are written while the CallSites are analysed, only this index of
+     *  them is kept for the metric files, which are sorted by the metric. */
+    struct MetricIndexEntry {
+        float Metric;
+        uint32_t DwarfLength;               // the Dwarf column is free text, the others have no ','
+        uint32_t Length;                    // without the newline
+        uint64_t Offset;                    // of the row in the CSV
+        uint64_t EncodingNormal;
+        uint64_t EncodingShort;
+        uint64_t EncodingPrecise;
+        const Function *Caller;
+    };
+
+    Module *CurrentModule = nullptr;
+    std::pair<std::string, std::string> FileNames{};
+    std::unique_ptr<raw_fd_ostream> OutfileVirtual{};
+    std::unique_ptr<raw_fd_ostream> OutfileIndirect{};
+    bool OutputFailed = false;
+    std::unique_ptr<sdanalysis::SDAnalysisFileWriter> BinaryOutput{};
+    // set id of every target set written so far, the sets do not change after countTargets
+    DenseMap<const func_id_set *, int64_t> BinarySetIds{};
 
-    func_name_set AllFunctions{};           // baseline
-    func_name_set AllVFunctions{};          // baseline virtual functions
+    // metric index (sorted by metric before the metric files are written)
+    std::vector<MetricIndexEntry> MetricVirtual{};
+    std::vector<MetricIndexEntry> MetricIndirect{};
+
+    std::vector<SDBuildCHA::func_name_t> FunctionNames{};  // function id -> name
+    StringMap<unsigned> FunctionIds{};
+
+    func_id_set AllFunctions{};             // baseline
+    func_id_set AllVFunctions{};            // baseline virtual functions
 
     /** hierarchy analysis data */
 
     // vTable hierarchy (ShrinkWrap / IVT)
-    std::map<SDBuildCHA::vtbl_t, offset_to_func_name> FunctionNameInVTableAtOffset{};
+    std::map<SDBuildCHA::vtbl_t, offset_to_func_id> FunctionNameInVTableAtOffset{};
     std::map<SDBuildCHA::vtbl_t, std::set<SDBuildCHA::vtbl_t>> VTableSubHierarchy{};
-    std::map<SDBuildCHA::func_and_class_t, func_name_set> VTableSubHierarchyPerFunction{};
+    std::map<SDBuildCHA::func_and_class_t, func_id_set> VTableSubHierarchyPerFunction{};
 
     // class hierarchy (VTV)
-    std::map<SDBuildCHA::vtbl_name_t, offset_to_func_name_set> FunctionNamesInClassAtOffset{};
+    std::map<SDBuildCHA::vtbl_name_t, offset_to_func_id_set> FunctionNamesInClassAtOffset{};
     std::map<SDBuildCHA::vtbl_name_t, std::set<SDBuildCHA::vtbl_name_t>> ClassSubHierarchy{};
-    std::map<SDBuildCHA::func_and_class_t, func_name_set> ClassSubHierarchyPerFunction{};
+    std::map<SDBuildCHA::func_and_class_t, func_id_set> ClassSubHierarchyPerFunction{};
 
     // class hierarchy islands (Marx)
-    std::map<SDBuildCHA::func_and_class_t, func_name_set> ClassToIsland{};
+    std::map<SDBuildCHA::func_and_class_t, func_id_set> ClassToIsland{};
     // all functions in any vTable (vTint)
     int64_t AllVFunctionsInVTables = 0;
 
     /** function type matching data */
 
-    std::map<preciseFunctionSignature_t, func_name_set> PreciseTargetSignature{};
-    std::map<uint64_t, func_name_set> TargetSignature{};
-    std::map<uint64_t, func_name_set> ShortTargetSignature{};
-    std::array<int64_t, 8> NumberOfParameters{};
-    std::array<func_name_set, 8> NumberOfParametersList{};
+    std::map<preciseFunctionSignature_t, func_id_set> PreciseTargetSignature{};
+    std::map<uint64_t, func_id_set> TargetSignature{};
+    std::map<uint64_t, func_id_set> ShortTargetSignature{};
+    std::array<func_id_set, 8> NumberOfParametersList{};
+    std::array<func_id_set, 8> NumberOfParametersUpTo{};   // TypeArmor: union of the lists 0..n
+
+    std::map<preciseFunctionSignature_t, func_id_set> PreciseTargetSignature_virtual{};
+    std::map<uint64_t, func_id_set> TargetSignature_virtual{};
+    std::map<uint64_t, func_id_set> ShortTargetSignature_virtual{};
+    std::array<func_id_set, 8> NumberOfParametersList_virtual{};
+    std::array<func_id_set, 8> NumberOfParametersUpTo_virtual{};
 
-    std::map<preciseFunctionSignature_t, func_name_set> PreciseTargetSignature_virtual{};
-    std::map<uint64_t, func_name_set> TargetSignature_virtual{};
-    std::map<uint64_t, func_name_set> ShortTargetSignature_virtual{};
-    std::array<int64_t, 8> NumberOfParameters_virtual{};
-    std::array<func_name_set, 8> NumberOfParametersList_virtual{};
+    const func_id_set NoTargets{};
 
     bool runOnModule(Module &M) override {
         sdLog::blankLine();
         sdLog::stream() << "P7a. Started running the SDAnalysis pass ..." << sdLog::newLine << "\n";
 
         // setup CHA info
+        CurrentModule = &M;
         CHA = &getAnalysis<SDBuildCHA>();
+        Demangler = &CHA->getDemangleCache();
         analyseCHA();
         computeVTableIslands();
         findAllVFunctions();
 
         // setup callee and callee signature info
         analyseCallees(M);
+        countTargets();
 
         // process the CallSites
         processVirtualCallSites(M);
         processIndirectCallSites(M);
         sdLog::stream() << "Total number of CallSites: " << CallSiteCount << "\n";
+        sdLog::stream() << "Demangled function names: " << Demangler->size() << "\n";
 
-        // apply the metric to the CallSiteInfo's in order to sort them
-        applyCallSiteMetric();
-        // store the analysis data
+        // close the CSVs and write the CallSites with the highest metric
         storeData(M);
 
         sdLog::stream() << sdLog::newLine << "P7a. Finished running the SDAnalysis pass ..." << "\n";
@@ -308,8 +416,8 @@ private:
         sdLog::log() << "VTable hierarchy:\n";
         for (auto &entry : VTableSubHierarchyPerFunction) {
             sdLog::log() << entry.first.second << ", " << entry.first.first << ":";
-            for (auto name : entry.second) {
-                sdLog::logNoToken() << " " << name;
+            for (unsigned id : entry.second) {
+                sdLog::logNoToken() << " " << FunctionNames[id];
             }
             sdLog::logNoToken() << "\n";
         }
@@ -317,8 +425,8 @@ private:
         sdLog::log() << "Class hierarchy:\n";
         for (auto &entry : ClassSubHierarchyPerFunction) {
             sdLog::log() << entry.first.second << ", " << entry.first.first << ":";
-            for (auto name : entry.second) {
-                sdLog::log() << " " << name;
+            for (unsigned id : entry.second) {
+                sdLog::log() << " " << FunctionNames[id];
             }
             sdLog::log() << "\n";
         }
@@ -331,7 +439,6 @@ private:
             sdLog::log() << "\t" << *className << " with " << vTableList.size() << " vTables:\n";
 
             std::set<SDBuildCHA::vtbl_name_t> classChildren;
-            offset_to_func_name_set functionNamesAtOffset;
             int vTableIndex = 0;
             for (auto &vTableType : vTableList) {
                 auto vTable = SDBuildCHA::vtbl_t(*className, vTableIndex);
@@ -339,8 +446,9 @@ private:
 
                 for (auto functionEntry : CHA->getFunctionEntries(vTable)) {
                     sdLog::log() << "\t\t" << functionEntry.functionName << "@" << functionEntry.offsetInVTable << "\n";
-                    FunctionNameInVTableAtOffset[vTable][functionEntry.offsetInVTable] = functionEntry.functionName;
-                    FunctionNamesInClassAtOffset[vTable.first][functionEntry.offsetInVTable].insert(functionEntry.functionName);
+                    unsigned functionId = getFunctionId(functionEntry.functionName);
+                    FunctionNameInVTableAtOffset[vTable][functionEntry.offsetInVTable] = functionId;
+                    FunctionNamesInClassAtOffset[vTable.first][functionEntry.offsetInVTable].set(functionId);
                 }
 
                 std::set<SDBuildCHA::vtbl_t> vTableChildren;
@@ -371,14 +479,17 @@ private:
             for (auto &functionNameEntry : FunctionNameInVTableAtOffset[rootVTable]) {
                 auto offsetInVTable = functionNameEntry.first;
 
-                std::set<SDBuildCHA::func_name_t> functionNames;
+                func_id_set functionIds;
                 for (auto &vTable : subHierarchy.second) {
                     if (CHA->isDefined(vTable.first)) {
-                        functionNames.insert(FunctionNameInVTableAtOffset[vTable][offsetInVTable]);
+                        auto &functionsInVTable = FunctionNameInVTableAtOffset[vTable];
+                        auto functionAtOffset = functionsInVTable.find(offsetInVTable);
+                        if (functionAtOffset != functionsInVTable.end())
+                            functionIds.set(functionAtOffset->second);
                     }
                 }
-                VTableSubHierarchyPerFunction[SDBuildCHA::func_and_class_t(functionNameEntry.second, rootVTable.first)]
-                        = functionNames;
+                VTableSubHierarchyPerFunction[SDBuildCHA::func_and_class_t(FunctionNames[functionNameEntry.second],
+                                                                           rootVTable.first)] = functionIds;
             }
         }
     }
@@ -394,16 +505,15 @@ private:
             for (auto &functionNameEntry : FunctionNamesInClassAtOffset[rootClassName]) {
                 auto offsetInVTable = functionNameEntry.first;
 
-                std::set<SDBuildCHA::func_name_t> functionNames;
+                func_id_set functionIds;
                 for (auto &className : subHierarchy.second) {
                     if (CHA->isDefined(className)) {
-                        auto &functionNamesInChild  = FunctionNamesInClassAtOffset[className][offsetInVTable];
-                        functionNames.insert(functionNamesInChild.begin(), functionNamesInChild.end());
+                        functionIds |= FunctionNamesInClassAtOffset[className][offsetInVTable];
                     }
                 }
-                for (auto &functionName : functionNameEntry.second) {
-                    ClassSubHierarchyPerFunction[SDBuildCHA::func_and_class_t(functionName, rootClassName)]
-                            = functionNames;
+                for (unsigned functionId : functionNameEntry.second) {
+                    ClassSubHierarchyPerFunction[SDBuildCHA::func_and_class_t(FunctionNames[functionId], rootClassName)]
+                            = functionIds;
                 }
             }
         }
@@ -413,11 +523,12 @@ private:
         for (auto &classEntries : FunctionNamesInClassAtOffset) {
             if (CHA->isDefined(classEntries.first)) {
                 for (auto &functionEntries : classEntries.second) {
-                    AllVFunctions.insert(functionEntries.second.begin(), functionEntries.second.end());
+                    AllVFunctions |= functionEntries.second;
                 }
             }
         }
-        AllVFunctionsInVTables = AllVFunctions.size();
+        AllVFunctions.updateCount();
+        AllVFunctionsInVTables = AllVFunctions.count();
     }
 
     void computeVTableIslands() {
@@ -445,12 +556,12 @@ private:
             islands[islandRoot].insert(island.begin(), island.end());
         }
 
-        std::map<SDBuildCHA::vtbl_name_t, offset_to_func_name_set> islandToFunctionsAtOffset;
+        std::map<SDBuildCHA::vtbl_name_t, offset_to_func_id_set> islandToFunctionsAtOffset;
         for(auto &island : islands) {
             for (auto &className : island.second) {
                 if (CHA->isDefined(className)) {
                     for (auto &entry : FunctionNamesInClassAtOffset[className]) {
-                        islandToFunctionsAtOffset[island.first][entry.first].insert(entry.second.begin(), entry.second.end());
+                        islandToFunctionsAtOffset[island.first][entry.first] |= entry.second;
                     }
                 }
             }
@@ -459,8 +570,8 @@ private:
         for(auto &entry : classToIslandRoot) {
             for (auto &functionNameEntry : FunctionNamesInClassAtOffset[entry.first]) {
                 auto offsetInVTable = functionNameEntry.first;
-                for (auto &functionName : functionNameEntry.second) {
-                    ClassToIsland[{functionName, entry.first}] = islandToFunctionsAtOffset[entry.second][offsetInVTable];
+                for (unsigned functionId : functionNameEntry.second) {
+                    ClassToIsland[{FunctionNames[functionId], entry.first}] = islandToFunctionsAtOffset[entry.second][offsetInVTable];
                 }
             }
         }
@@ -485,41 +596,75 @@ private:
             auto Encode = Encodings::encode(F.getFunctionType());
             std::string FunctionName = F.getName();
 
-            std::string DemangledFunctionName = FunctionName;
-            int Status = 0;
-            if (F.getName().startswith("_")) {
-                auto DemangledPair = itaniumDemanglePair(F.getName(), Status);
-                if (Status == 0 && DemangledPair.second != "") {
-                    DemangledFunctionName = DemangledPair.second;
-                }
-            }
+            StringRef DemangledFunctionName = Demangler->getBaseName(FunctionName);
 
-            AllFunctions.insert(F.getName());
-            NumberOfParameters[NumOfParams]++;
-            NumberOfParametersList[NumOfParams].insert(F.getName());
-            TargetSignature[Encode.Normal].insert(F.getName());
-            ShortTargetSignature[Encode.Short].insert(F.getName());
+            unsigned FunctionId = getFunctionId(FunctionName);
+            AllFunctions.set(FunctionId);
+            NumberOfParametersList[NumOfParams].set(FunctionId);
+            TargetSignature[Encode.Normal].set(FunctionId);
+            ShortTargetSignature[Encode.Short].set(FunctionId);
             PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName, Encode.Precise)]
-                    .insert(FunctionName);
+                    .set(FunctionId);
 
             if (isVirtualFunction(F)) {
-                AllVFunctions.insert(F.getName());
-                NumberOfParameters_virtual[NumOfParams]++;
-                NumberOfParametersList_virtual[NumOfParams].insert(F.getName());
-                TargetSignature_virtual[Encode.Normal].insert(F.getName());
-                ShortTargetSignature_virtual[Encode.Short].insert(F.getName());
+                AllVFunctions.set(FunctionId);
+                NumberOfParametersList_virtual[NumOfParams].set(FunctionId);
+                TargetSignature_virtual[Encode.Normal].set(FunctionId);
+                ShortTargetSignature_virtual[Encode.Short].set(FunctionId);
                 PreciseTargetSignature_virtual[preciseFunctionSignature_t(DemangledFunctionName, Encode.Precise)]
-                        .insert(FunctionName);
+                        .set(FunctionId);
             }
         }
 
+        // the TypeArmor targets of a CallSite with n params, computed once instead of per CallSite
+        for (unsigned i = 0; i < NumberOfParametersList.size(); ++i) {
+            if (i > 0) {
+                NumberOfParametersUpTo[i] = NumberOfParametersUpTo[i - 1];
+                NumberOfParametersUpTo_virtual[i] = NumberOfParametersUpTo_virtual[i - 1];
+            }
+            NumberOfParametersUpTo[i] |= NumberOfParametersList[i];
+            NumberOfParametersUpTo_virtual[i] |= NumberOfParametersList_virtual[i];
+        }
+    }
+
+    template<typename MapT>
+    static void countTargets(MapT &Map) {
+        for (auto &Entry : Map)
+            Entry.second.updateCount();
+    }
+
+    /** every target set is complete once the callees are analysed */
+    void countTargets() {
+        AllFunctions.updateCount();
+        AllVFunctions.updateCount();
+
+        countTargets(VTableSubHierarchyPerFunction);
+        countTargets(ClassSubHierarchyPerFunction);
+        countTargets(ClassToIsland);
+
+        countTargets(PreciseTargetSignature);
+        countTargets(TargetSignature);
+        countTargets(ShortTargetSignature);
+        countTargets(PreciseTargetSignature_virtual);
+        countTargets(TargetSignature_virtual);
+        countTargets(ShortTargetSignature_virtual);
+
+        for (unsigned i = 0; i < NumberOfParametersList.size(); ++i) {
+            NumberOfParametersList[i].updateCount();
+            NumberOfParametersList_virtual[i].updateCount();
+            NumberOfParametersUpTo[i].updateCount();
+            NumberOfParametersUpTo_virtual[i].updateCount();
+        }
+
         sdLog::stream() << "\n";
-        for (int i = 0; i < NumberOfParameters.size() - 1; ++i) {
+        for (unsigned i = 0; i < NumberOfParametersList.size() - 1; ++i) {
             sdLog::stream() << "Number of functions with " << i << " params: ("
-                            << NumberOfParameters[i] << "," << NumberOfParameters_virtual[i] << ")\n";
+                            << NumberOfParametersList[i].count() << ","
+                            << NumberOfParametersList_virtual[i].count() << ")\n";
         }
         sdLog::stream() << "Number of functions with 7+ params: "
-                        << NumberOfParameters[7] << "," << NumberOfParameters_virtual[7] << ")\n";
+                        << NumberOfParametersList[7].count() << ","
+                        << NumberOfParametersList_virtual[7].count() << ")\n";
 
     }
 
@@ -537,14 +682,14 @@ private:
                     // Try to use I as a CallInst or a InvokeInst
                     if (Call.getInstruction()) {
                         if (CallSite(Call).isIndirectCall() && VirtualCallSites.find(Call) == VirtualCallSites.end()) {
-                            CallSiteInfo Info(Call.getFunctionType()->getNumParams(), false);
-                            analyseCall(Call, Info);
+                            addPendingCallSite(Call, new CallSiteInfo(Call.getFunctionType()->getNumParams(), false));
                             ++countIndirect;
                         }
                     }
                 }
             }
         }
+        analysePendingCallSites();
         sdLog::stream() << "Found indirect CallSites: " << countIndirect << "\n";
         sdLog::stream() << "\n";
     }
@@ -592,6 +737,7 @@ private:
             }
             ++count;
         }
+        analysePendingCallSites();
         sdLog::stream() << "Found virtual CallSites: " << count << "\n";
     }
 
@@ -616,12 +762,60 @@ private:
         const StringRef PreciseName = sd_getClassNameFromMD(PreciseNameNode);
         const StringRef FunctionName = sd_getFunctionNameFromMD(FunctionNameNode);
 
-        CallSiteInfo Info(FunctionName, ClassName, PreciseName, CallSite.getFunctionType()->getNumParams());
-        analyseCall(CallSite, Info);
+        addPendingCallSite(CallSite, new CallSiteInfo(FunctionName, ClassName, PreciseName,
+                                                      CallSite.getFunctionType()->getNumParams()));
+    }
+
+    void addPendingCallSite(CallSite CallSite, CallSiteInfo *Info) {
+        PendingCallSites.push_back(PendingCallSite{CallSite, std::unique_ptr<CallSiteInfo>(Info)});
+        if (PendingCallSites.size() >= CallSiteBatchSize)
+            analysePendingCallSites();
     }
 
-    void analyseCall(CallSite CallSite, CallSiteInfo Info) {
-        CallSiteCount++;
+    /** Analyse the pending CallSites sharded by caller, then write them in the order they were found */
+    void analysePendingCallSites() {
+        std::vector<std::vector<PendingCallSite *>> Shards;
+        DenseMap<const Function *, unsigned> ShardOfFunction;
+        for (PendingCallSite &Pending : PendingCallSites) {
+            auto Res = ShardOfFunction.insert(std::make_pair(Pending.Call.getCaller(), (unsigned) Shards.size()));
+            if (Res.second)
+                Shards.emplace_back();
+            Shards[Res.first->second].push_back(&Pending);
+        }
+
+        unsigned NumThreads = SDAnalysisThreads;
+        if (NumThreads == 0)
+            NumThreads = std::thread::hardware_concurrency();
+        if (!llvm_is_multithreaded())
+            NumThreads = 1;
+        NumThreads = std::min<unsigned>(NumThreads, Shards.size());
+
+        if (NumThreads <= 1) {
+            for (PendingCallSite &Pending : PendingCallSites)
+                analyseCall(Pending.Call, *Pending.Info);
+        } else {
+            std::atomic<unsigned> Next(0);
+            std::vector<std::thread> Workers;
+            for (unsigned t = 0; t < NumThreads; t++) {
+                Workers.push_back(std::thread([&]() {
+                    for (unsigned i = Next++; i < Shards.size(); i = Next++)
+                        for (PendingCallSite *Pending : Shards[i])
+                            analyseCall(Pending->Call, *Pending->Info);
+                }));
+            }
+            for (auto &Worker : Workers)
+                Worker.join();
+        }
+
+        for (PendingCallSite &Pending : PendingCallSites) {
+            CallSiteCount++;
+            writeRow(Pending.Call, *Pending.Info);
+        }
+        PendingCallSites.clear();
+    }
+
+    /** Only reads the CHA and callee tables (no map::operator[]), so it may run on several threads */
+    void analyseCall(CallSite CallSite, CallSiteInfo &Info) const {
         const DebugLoc &Loc = CallSite.getInstruction()->getDebugLoc();
         std::string Dwarf;
         if (Loc) {
@@ -636,94 +830,247 @@ private:
 
         auto Encode = Encodings::encode(CallSite.getFunctionType());
         Info.Encoding = Encode;
-        Info.TargetSignatureMatches = TargetSignature[Encode.Normal].size();
-        Info.ShortTargetSignatureMatches = ShortTargetSignature[Encode.Short].size();
+        Info.TargetSignatureMatches = lookupTargets(TargetSignature, Encode.Normal).count();
+        Info.ShortTargetSignatureMatches = lookupTargets(ShortTargetSignature, Encode.Short).count();
+        Info.NumberOfParamMatches = NumberOfParametersUpTo[NumberOfParam].count();
 
-        Info.NumberOfParamMatches = 0;
-        for (int i = 0; i <= NumberOfParam; ++i) {
-            Info.NumberOfParamMatches += NumberOfParameters[i];
-        }
+        Info.TargetSignatureMatches_virtual = lookupTargets(TargetSignature_virtual, Encode.Normal).count();
+        Info.ShortTargetSignatureMatches_virtual = lookupTargets(ShortTargetSignature_virtual, Encode.Short).count();
+        Info.NumberOfParamMatches_virtual = NumberOfParametersUpTo_virtual[NumberOfParam].count();
+
+        if (Info.isVirtual) {
+            auto func_and_class = SDBuildCHA::func_and_class_t(Info.FunctionName, Info.PreciseName);
+
+            Info.SubHierarchyMatches = lookupTargets(ClassSubHierarchyPerFunction, func_and_class).count();
+            Info.PreciseSubHierarchyMatches = lookupTargets(VTableSubHierarchyPerFunction, func_and_class).count();
+            Info.HierarchyIslandMatches = lookupTargets(ClassToIsland, func_and_class).count();
 
-        Info.TargetSignatureMatches_virtual = TargetSignature_virtual[Encode.Normal].size();
-        Info.ShortTargetSignatureMatches_virtual = ShortTargetSignature_virtual[Encode.Short].size();
+            Info.DemangledName = Demangler->getBaseName(Info.FunctionName);
 
-        Info.NumberOfParamMatches_virtual = 0;
-        for (int i = 0; i <= NumberOfParam; ++i) {
-            Info.NumberOfParamMatches_virtual += NumberOfParameters_virtual[i];
+            auto precise = preciseFunctionSignature_t(Info.DemangledName, Encode.Precise);
+            Info.PreciseTargetSignatureMatches = lookupTargets(PreciseTargetSignature, precise).count();
+            Info.PreciseTargetSignatureMatches_virtual = lookupTargets(PreciseTargetSignature_virtual, precise).count();
+        } else {
+            Info.DisplayName = CallSite.getCaller()->getName();
         }
+    }
+
+    template<typename MapT>
+    const func_id_set &lookupTargets(const MapT &Map, const typename MapT::key_type &Key) const {
+        auto Entry = Map.find(Key);
+        return Entry != Map.end() ? Entry->second : NoTargets;
+    }
 
+    /** Helper functions */
+
+    /** the row of a CallSite, the metric files repeat it in front of the target lists */
+    void formatRow(raw_ostream &Out, const CallSiteInfo &Info) {
+        auto BaseLine = AllFunctions.count();
+        auto BaseLineVirtual = AllVFunctions.count();
         if (Info.isVirtual) {
-            auto func_and_class = SDBuildCHA::func_and_class_t(Info.FunctionName, Info.PreciseName);
+            Out << Info.Dwarf
+                << "," << Info.FunctionName
+                << "," << Info.ClassName
+                << "," << Info.PreciseName
+                << "," << Info.Params
+                << ","
+                << "," << Info.PreciseTargetSignatureMatches
+                << "," << Info.TargetSignatureMatches
+                << "," << Info.ShortTargetSignatureMatches
+                << "," << Info.NumberOfParamMatches
+                << "," << BaseLine
+                << ","
+                << "," << Info.PreciseTargetSignatureMatches_virtual
+                << "," << Info.TargetSignatureMatches_virtual
+                << "," << Info.ShortTargetSignatureMatches_virtual
+                << "," << Info.NumberOfParamMatches_virtual
+                << "," << BaseLineVirtual
+                << ","
+                << "," << Info.PreciseSubHierarchyMatches
+                << "," << Info.SubHierarchyMatches
+                << "," << Info.HierarchyIslandMatches
+                << "," << AllVFunctionsInVTables;
+        } else {
+            Out << Info.Dwarf
+                << ","
+                << ","
+                << ","
+                << "," << Info.Params
+                << ","
+                << ","
+                << "," << Info.TargetSignatureMatches
+                << "," << Info.ShortTargetSignatureMatches
+                << "," << Info.NumberOfParamMatches
+                << "," << BaseLine
+                << ","
+                << ","
+                << "," << Info.TargetSignatureMatches_virtual
+                << "," << Info.ShortTargetSignatureMatches_virtual
+                << "," << Info.NumberOfParamMatches_virtual
+                << "," << BaseLineVirtual;
+        }
+    }
 
-            Info.SubHierarchyMatches = ClassSubHierarchyPerFunction[func_and_class].size();
-            Info.PreciseSubHierarchyMatches = VTableSubHierarchyPerFunction[func_and_class].size();
-            Info.HierarchyIslandMatches = ClassToIsland[func_and_class].size();
+    /** Write the row of a CallSite as soon as it is analysed and remember where it went */
+    void writeRow(CallSite CallSite, const CallSiteInfo &Info) {
+        if (!openOutput())
+            return;
 
-            std::string DemangledFunctionName = Info.FunctionName;
-            int Status = 0;
-            auto DemangledPair = itaniumDemanglePair(Info.FunctionName, Status);
-            if (Status == 0 && DemangledPair.second != "") {
-                DemangledFunctionName = DemangledPair.second;
-            }
+        raw_fd_ostream &Out = Info.isVirtual ? *OutfileVirtual : *OutfileIndirect;
 
+        MetricIndexEntry Entry;
+        Entry.Offset = Out.tell();
+        Entry.DwarfLength = Info.Dwarf.size();
+        Entry.EncodingNormal = Info.Encoding.Normal;
+        Entry.EncodingShort = Info.Encoding.Short;
+        Entry.EncodingPrecise = Info.Encoding.Precise;
+        Entry.Caller = CallSite.getCaller();
 
-            Info.PreciseTargetSignatureMatches =
-                    PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName,Encode.Precise)].size();
+        formatRow(Out, Info);
+        Entry.Length = Out.tell() - Entry.Offset;
+        Out << "\n";
 
-            Info.PreciseTargetSignatureMatches_virtual =
-                    PreciseTargetSignature_virtual[preciseFunctionSignature_t(DemangledFunctionName,Encode.Precise)].size();
+        if (Info.isVirtual) {
+            float metric = Info.TargetSignatureMatches - Info.PreciseSubHierarchyMatches;
+            if (Info.PreciseSubHierarchyMatches != 0) {
+                metric /= Info.PreciseSubHierarchyMatches;
+            }
+            Entry.Metric = metric;
+            MetricVirtual.push_back(Entry);
         } else {
-            Info.DisplayName = CallSite.getCaller()->getName();
+            Entry.Metric = Info.TargetSignatureMatches / (float) (AllFunctions.count());
+            MetricIndirect.push_back(Entry);
         }
 
-        Data.push_back(Info);
+        if (BinaryOutput)
+            writeBinaryRow(CallSite, Info, Entry.Metric);
     }
 
-    /** Helper functions */
+    /** Same row for the .sda file, the target sets are referenced instead of counted */
+    void writeBinaryRow(CallSite CallSite, const CallSiteInfo &Info, float Metric) {
+        using namespace sdanalysis;
+        SDAnalysisFileWriter &W = *BinaryOutput;
+        auto stringId = [&W](const std::string &Str) { return Str.empty() ? NO_ID : W.addString(Str); };
+
+        SDAnalysisFileWriter::row_t Row;
+        std::fill(Row, Row + NUM_COLUMNS, NO_ID);
+
+        Row[COL_KIND] = Info.isVirtual ? KIND_VIRTUAL : KIND_INDIRECT;
+        Row[COL_DWARF] = stringId(Info.Dwarf);
+        Row[COL_FUNCTION_NAME] = stringId(Info.FunctionName);
+        Row[COL_CLASS_NAME] = stringId(Info.ClassName);
+        Row[COL_PRECISE_NAME] = stringId(Info.PreciseName);
+        Row[COL_CALLER] = W.addString(CallSite.getCaller()->getName());
+        Row[COL_PARAMS] = Info.Params;
+
+        Row[COL_PRECISE_SRC_TYPE] = Info.PreciseTargetSignatureMatches;
+        Row[COL_SRC_TYPE] = Info.TargetSignatureMatches;
+        Row[COL_SAFE_SRC_TYPE] = Info.ShortTargetSignatureMatches;
+        Row[COL_BIN_TYPE] = Info.NumberOfParamMatches;
+        Row[COL_PRECISE_SRC_TYPE_VIRTUAL] = Info.PreciseTargetSignatureMatches_virtual;
+        Row[COL_SRC_TYPE_VIRTUAL] = Info.TargetSignatureMatches_virtual;
+        Row[COL_SAFE_SRC_TYPE_VIRTUAL] = Info.ShortTargetSignatureMatches_virtual;
+        Row[COL_BIN_TYPE_VIRTUAL] = Info.NumberOfParamMatches_virtual;
+        Row[COL_VTABLE_SUB_HIERARCHY] = Info.PreciseSubHierarchyMatches;
+        Row[COL_CLASS_SUB_HIERARCHY] = Info.SubHierarchyMatches;
+        Row[COL_CLASS_ISLAND] = Info.HierarchyIslandMatches;
+
+        uint32_t MetricBits;
+        memcpy(&MetricBits, &Metric, sizeof(MetricBits));
+        Row[COL_METRIC] = MetricBits;
+
+        auto Precise = preciseFunctionSignature_t(Info.DemangledName, Info.Encoding.Precise);
+        Row[COL_SET_PRECISE_SRC_TYPE] = addBinarySet(lookupTargets(PreciseTargetSignature, Precise));
+        Row[COL_SET_SRC_TYPE] = addBinarySet(lookupTargets(TargetSignature, Info.Encoding.Normal));
+        Row[COL_SET_SAFE_SRC_TYPE] = addBinarySet(lookupTargets(ShortTargetSignature, Info.Encoding.Short));
+        Row[COL_SET_PRECISE_SRC_TYPE_VIRTUAL] = addBinarySet(lookupTargets(PreciseTargetSignature_virtual, Precise));
+        Row[COL_SET_SRC_TYPE_VIRTUAL] = addBinarySet(lookupTargets(TargetSignature_virtual, Info.Encoding.Normal));
+        Row[COL_SET_SAFE_SRC_TYPE_VIRTUAL] =
+                addBinarySet(lookupTargets(ShortTargetSignature_virtual, Info.Encoding.Short));
 
-    void applyCallSiteMetric() {
-        for (auto& entry : Data) {
-            if (entry.isVirtual) {
-                float metric = entry.TargetSignatureMatches - entry.PreciseSubHierarchyMatches;
-                if (entry.PreciseSubHierarchyMatches != 0) {
-                    metric /= entry.PreciseSubHierarchyMatches;
-                }
-                MetricVirtual[metric].push_back(entry);
-            } else {
-                float metric = entry.TargetSignatureMatches / (float) (AllFunctions.size());
-                MetricIndirect[metric].push_back(entry);
-            }
+        if (Info.isVirtual) {
+            auto func_and_class = SDBuildCHA::func_and_class_t(Info.FunctionName, Info.PreciseName);
+            Row[COL_SET_VTABLE_SUB_HIERARCHY] = addBinarySet(lookupTargets(VTableSubHierarchyPerFunction, func_and_class));
+            Row[COL_SET_CLASS_SUB_HIERARCHY] = addBinarySet(lookupTargets(ClassSubHierarchyPerFunction, func_and_class));
+            Row[COL_SET_CLASS_ISLAND] = addBinarySet(lookupTargets(ClassToIsland, func_and_class));
+            Row[COL_SET_ALL_VTABLES] = addBinarySet(AllVFunctions);
         }
+
+        W.addRow(Row);
     }
 
-    void storeData(Module &M) {
-        if (Data.empty()) {
-            sdLog::stream() << "Nothing to store...\n";
-            return;
+    /** the writer compares the members of the sets, every set is only named once */
+    int64_t addBinarySet(const func_id_set &Set) {
+        auto Res = BinarySetIds.insert(std::make_pair(&Set, (int64_t) 0));
+        if (Res.second) {
+            Res.first->second = BinaryOutput->addSet(Set, [this](unsigned Id) -> StringRef {
+                return FunctionNames[Id];
+            });
         }
-        sdLog::stream() << "Store all CallSites for Module: " << M.getName() << "\n";
+        return Res.first->second;
+    }
 
-        auto FileNames = findOutputFileName(M);
+    /** Open the CSVs on the first row, so modules without CallSites write nothing */
+    bool openOutput() {
+        if (OutfileVirtual)
+            return true;
+        if (OutputFailed)
+            return false;
 
-        // write general analysis data
+        FileNames = findOutputFileName(*CurrentModule);
 
         std::error_code ECVirtual, ECIndirect;
-        raw_fd_ostream OutfileVirtual(FileNames.first, ECVirtual, sys::fs::OpenFlags::F_None);
-        raw_fd_ostream OutfileIndirect(FileNames.second, ECIndirect, sys::fs::OpenFlags::F_None);
+        OutfileVirtual.reset(new raw_fd_ostream(FileNames.first, ECVirtual, sys::fs::OpenFlags::F_None));
+        OutfileIndirect.reset(new raw_fd_ostream(FileNames.second, ECIndirect, sys::fs::OpenFlags::F_None));
         if (ECVirtual || ECIndirect) {
             sdLog::errs() << "Failed to write to " << FileNames.first << ", " << FileNames.second << "!\n";
+            OutfileVirtual.reset();
+            OutfileIndirect.reset();
+            OutputFailed = true;
+            return false;
+        }
+
+        writeHeader(*OutfileVirtual, true);
+        writeHeader(*OutfileIndirect, false);
+
+        if (SDAnalysisBinary)
+            BinaryOutput.reset(new sdanalysis::SDAnalysisFileWriter());
+        return true;
+    }
+
+    void storeData(Module &M) {
+        if (!OutfileVirtual) {
+            sdLog::stream() << "Nothing to store...\n";
             return;
         }
-        sdLog::stream() << "Writing " << Data.size() << " lines to "
+        sdLog::stream() << "Stored all CallSites for Module: " << M.getName() << "\n";
+
+        OutfileVirtual->close();
+        OutfileIndirect->close();
+        OutfileVirtual.reset();
+        OutfileIndirect.reset();
+        sdLog::stream() << "Wrote " << (MetricVirtual.size() + MetricIndirect.size()) << " lines to "
                         << FileNames.first << ", " << FileNames.second << ".\n";
 
-        writeAnalysisData(OutfileVirtual, OutfileIndirect);
+        if (BinaryOutput) {
+            storeBinaryData();
+            BinaryOutput.reset();
+            BinarySetIds.clear();
+        }
 
-        // write metric
+        // write metric, the rows are read back from the CSVs written above
+
+        ErrorOr<std::unique_ptr<MemoryBuffer>> RowsVirtual = MemoryBuffer::getFile(FileNames.first);
+        ErrorOr<std::unique_ptr<MemoryBuffer>> RowsIndirect = MemoryBuffer::getFile(FileNames.second);
+        if (!RowsVirtual || !RowsIndirect) {
+            sdLog::errs() << "Failed to read " << FileNames.first << ", " << FileNames.second << "!\n";
+            return;
+        }
 
         std::string MetricFileNameVirtual = FileNames.first.substr(0, FileNames.first.size() - 4) + "-metric.csv";
         std::string MetricFileNameIndirect = FileNames.second.substr(0, FileNames.second.size() - 4) + "-metric.csv";
 
+        std::error_code ECVirtual, ECIndirect;
         raw_fd_ostream OutfileMetricVirtual(MetricFileNameVirtual, ECVirtual, sys::fs::OpenFlags::F_None);
         raw_fd_ostream OutfileMetricIndirect(MetricFileNameIndirect, ECIndirect, sys::fs::OpenFlags::F_None);
         if (ECVirtual || ECIndirect) {
@@ -733,338 +1080,213 @@ private:
         sdLog::stream() << "Writing metric results to "
                         << MetricFileNameVirtual << ", " << MetricFileNameIndirect << ".\n";
 
-        writeMetricVirtual(OutfileMetricVirtual);
-        writeMetricIndirect(OutfileMetricIndirect);
+        sortMetric(MetricVirtual);
+        sortMetric(MetricIndirect);
+        writeMetricVirtual(OutfileMetricVirtual, (*RowsVirtual)->getBuffer());
+        writeMetricIndirect(OutfileMetricIndirect, (*RowsIndirect)->getBuffer());
     }
 
-    void writeAnalysisData(raw_fd_ostream &OutfileVirtual, raw_fd_ostream &OutfileIndirect) {
-        writeHeader(OutfileVirtual, true);
-        writeHeader(OutfileIndirect, false);
-
-        auto BaseLine = AllFunctions.size();
-        auto BaseLineVirtual = AllVFunctions.size();
-        for (auto &Info : Data) {
-            if (Info.isVirtual) {
-                OutfileVirtual
-                        << Info.Dwarf
-                        << "," << Info.FunctionName
-                        << "," << Info.ClassName
-                        << "," << Info.PreciseName
-                        << "," << Info.Params
-                        << ","
-                        << "," << Info.PreciseTargetSignatureMatches
-                        << "," << Info.TargetSignatureMatches
-                        << "," << Info.ShortTargetSignatureMatches
-                        << "," << Info.NumberOfParamMatches
-                        << "," << BaseLine
-                        << ","
-                        << "," << Info.PreciseTargetSignatureMatches_virtual
-                        << "," << Info.TargetSignatureMatches_virtual
-                        << "," << Info.ShortTargetSignatureMatches_virtual
-                        << "," << Info.NumberOfParamMatches_virtual
-                        << "," << BaseLineVirtual
-                        << ","
-                        << "," << Info.PreciseSubHierarchyMatches
-                        << "," << Info.SubHierarchyMatches
-                        << "," << Info.HierarchyIslandMatches
-                        << "," << AllVFunctionsInVTables
-                        << "\n";
-            } else {
-                OutfileIndirect
-                        << Info.Dwarf
-                        << ","
-                        << ","
-                        << ","
-                        << "," << Info.Params
-                        << ","
-                        << ","
-                        << "," << Info.TargetSignatureMatches
-                        << "," << Info.ShortTargetSignatureMatches
-                        << "," << Info.NumberOfParamMatches
-                        << "," << AllFunctions.size()
-                        << ","
-                        << ","
-                        << "," << Info.TargetSignatureMatches_virtual
-                        << "," << Info.ShortTargetSignatureMatches_virtual
-                        << "," << Info.NumberOfParamMatches_virtual
-                        << "," << BaseLineVirtual
-                        << "\n";
-
-            };
-        };
+    /** X-Virtual.csv, X-Indirect.csv -> X.sda */
+    void storeBinaryData() {
+        std::string FileName = FileNames.first;
+        size_t Pos = FileName.rfind("-Virtual");
+        if (Pos != std::string::npos)
+            FileName.erase(Pos, strlen("-Virtual"));
+        FileName = FileName.substr(0, FileName.size() - 4) + ".sda";
+
+        auto Name = [this](unsigned Id) -> StringRef { return FunctionNames[Id]; };
+        for (unsigned N = 0; N < sdanalysis::NUM_PARAM_SETS; N++) {
+            BinaryOutput->setParamSet(N, false, NumberOfParametersList[N], Name);
+            BinaryOutput->setParamSet(N, true, NumberOfParametersList_virtual[N], Name);
+        }
 
-        OutfileVirtual.close();
-        OutfileIndirect.close();
+        std::error_code EC = BinaryOutput->write(FileName, AllFunctions.count(), AllVFunctions.count(),
+                                                 AllVFunctionsInVTables);
+        if (EC) {
+            sdLog::errs() << "Failed to write to " << FileName << ": " << EC.message() << "!\n";
+            return;
+        }
+        sdLog::stream() << "Wrote " << BinaryOutput->getNumRows() << " CallSites to " << FileName << ".\n";
     }
 
-    void writeMetricVirtual(raw_fd_ostream &Out) {
+    /** highest metric first, CallSites with the same metric in the order they were analysed */
+    static void sortMetric(std::vector<MetricIndexEntry> &Index) {
+        std::stable_sort(Index.begin(), Index.end(),
+                         [](const MetricIndexEntry &A, const MetricIndexEntry &B) {
+                             return A.Metric > B.Metric;
+                         });
+    }
+
+    /** field N of the columns following the Dwarf column of a row */
+    static StringRef getRowField(StringRef Row, const MetricIndexEntry &Entry, unsigned N) {
+        SmallVector<StringRef, 24> Fields;
+        Row.drop_front(Entry.DwarfLength + 1).split(Fields, ",");
+        return N < Fields.size() ? Fields[N] : StringRef();
+    }
+
+    static int64_t getRowInteger(StringRef Row, const MetricIndexEntry &Entry, unsigned N) {
+        int64_t Value = 0;
+        getRowField(Row, Entry, N).getAsInteger(10, Value);
+        return Value;
+    }
+
+    void writeMetricVirtual(raw_fd_ostream &Out, StringRef Rows) {
         if (MetricVirtual.empty())
             return;
 
         writeHeader(Out, true);
 
-        auto BaseLine = AllFunctions.size();
-        auto BaseLineVirtual = AllVFunctions.size();
         std::set<std::string> ExportedLines;
 
         int i = 0;
-        for (auto I = MetricVirtual.rbegin(), E = MetricVirtual.rend(); I != E; ++I) {
-            for (auto &Info : I->second) {
-                if (ExportedLines.find(Info.Dwarf) != ExportedLines.end())
-                    continue;
-
-                ExportedLines.insert(Info.Dwarf);
-                Out << Info.Dwarf
-                    << "," << Info.FunctionName
-                    << "," << Info.ClassName
-                    << "," << Info.PreciseName
-                    << "," << Info.Params
-                    << ","
-                    << "," << Info.PreciseTargetSignatureMatches
-                    << "," << Info.TargetSignatureMatches
-                    << "," << Info.ShortTargetSignatureMatches
-                    << "," << Info.NumberOfParamMatches
-                    << "," << BaseLine
-                    << ","
-                    << "," << Info.PreciseTargetSignatureMatches_virtual
-                    << "," << Info.TargetSignatureMatches_virtual
-                    << "," << Info.ShortTargetSignatureMatches_virtual
-                    << "," << Info.NumberOfParamMatches_virtual
-                    << "," << BaseLineVirtual
-                    << ","
-                    << "," << Info.PreciseSubHierarchyMatches
-                    << "," << Info.SubHierarchyMatches
-                    << "," << Info.HierarchyIslandMatches
-                    << "," << AllVFunctionsInVTables;
-
-                std::set<std::string> vTrust, IFCC, IFCCSafe, Typearmor, vTrustVirtual, IFCCVirtual, IFCCSafeVirtual, TypearmorVirtual, ShrinkWrap, VTV, Marx, vTint;
-                // std::map<preciseFunctionSignature_t, func_name_set> PreciseTargetSignature{};
-                // std::map<SDBuildCHA::func_and_class_t, func_name_set> VTableSubHierarchyPerFunction{};
-
-                std::string DemangledFunctionName = Info.FunctionName;
-                int Status = 0;
-                auto DemangledPair = itaniumDemanglePair(Info.FunctionName, Status);
-                if (Status == 0 && DemangledPair.second != "") {
-                    DemangledFunctionName = DemangledPair.second;
-                }
-
-                vTrust = PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName,Info.Encoding.Precise)];
-                IFCC = TargetSignature[Info.Encoding.Normal];
-                IFCCSafe = ShortTargetSignature[Info.Encoding.Normal];
-
-                vTrustVirtual = PreciseTargetSignature_virtual[preciseFunctionSignature_t(DemangledFunctionName,Info.Encoding.Precise)];
-                IFCCVirtual = TargetSignature_virtual[Info.Encoding.Normal];
-                IFCCSafeVirtual = ShortTargetSignature_virtual[Info.Encoding.Normal];
-
-                auto func_and_class = SDBuildCHA::func_and_class_t(Info.FunctionName, Info.PreciseName);
-                ShrinkWrap = VTableSubHierarchyPerFunction[func_and_class];
-                VTV = ClassSubHierarchyPerFunction[func_and_class];
-                Marx = ClassToIsland[func_and_class];
-                vTint = AllVFunctions;
-
-                Out << ", vTrust(" << vTrust.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : vTrust) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+        for (auto I = MetricVirtual.begin(), E = MetricVirtual.end(); I != E; ++I) {
+            // stop after the group of equal metrics that exceeded the limit
+            if (i > 30 && I->Metric != std::prev(I)->Metric) {
+                break;
+            }
 
-                Out << ", IFCC(" << IFCC.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCC) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            const MetricIndexEntry &Entry = *I;
+            StringRef Row = Rows.substr(Entry.Offset, Entry.Length);
+            StringRef Dwarf = Row.substr(0, Entry.DwarfLength);
+            if (!ExportedLines.insert(Dwarf).second)
+                continue;
 
-                Out << ", IFCCSafe(" << IFCCSafe.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCCSafe) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            Out << Row;
 
-                int NumberOfParams = Info.Params;
-                if (NumberOfParams >= 7)
-                    NumberOfParams = 7;
+            std::string FunctionName = getRowField(Row, Entry, 0);
+            std::string PreciseName = getRowField(Row, Entry, 2);
+            int64_t Params = getRowInteger(Row, Entry, 3);
+            int64_t NumberOfParamMatches_virtual = getRowInteger(Row, Entry, 14);
 
-                Out << ", TypeArmor(" << NumberOfParams << "):";
-                for (int j = 0; j <= Info.Params; ++j) {
-                    for (const SDBuildCHA::func_name_t &Target : NumberOfParametersList[j]) {
-                        auto FunctionName = Target;
-                        FunctionName = StringRef(FunctionName);
-                        Out << ",\"" << FunctionName << "\"";
-                    }
-                }
+            StringRef DemangledFunctionName = Demangler->getBaseName(FunctionName);
 
-                // virtual versions
+            auto precise = preciseFunctionSignature_t(DemangledFunctionName, Entry.EncodingPrecise);
+            const func_id_set &vTrust = lookupTargets(PreciseTargetSignature, precise);
+            const func_id_set &IFCC = lookupTargets(TargetSignature, Entry.EncodingNormal);
+            const func_id_set &IFCCSafe = lookupTargets(ShortTargetSignature, Entry.EncodingShort);
 
-                Out << ", vTrustVirtual(" << vTrustVirtual.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : vTrustVirtual) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            const func_id_set &vTrustVirtual = lookupTargets(PreciseTargetSignature_virtual, precise);
+            const func_id_set &IFCCVirtual = lookupTargets(TargetSignature_virtual, Entry.EncodingNormal);
+            const func_id_set &IFCCSafeVirtual = lookupTargets(ShortTargetSignature_virtual, Entry.EncodingShort);
 
-                Out << ", IFCCVirtual(" << IFCCVirtual.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCCVirtual) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            auto func_and_class = SDBuildCHA::func_and_class_t(FunctionName, PreciseName);
+            const func_id_set &ShrinkWrap = lookupTargets(VTableSubHierarchyPerFunction, func_and_class);
+            const func_id_set &VTV = lookupTargets(ClassSubHierarchyPerFunction, func_and_class);
+            const func_id_set &Marx = lookupTargets(ClassToIsland, func_and_class);
+            const func_id_set &vTint = AllVFunctions;
 
-                Out << ", IFCCSafeVirtual(" << IFCCSafeVirtual.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCCSafeVirtual) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            writeTargets(Out, "vTrust", vTrust.count(), vTrust);
+            writeTargets(Out, "IFCC", IFCC.count(), IFCC);
+            writeTargets(Out, "IFCCSafe", IFCCSafe.count(), IFCCSafe);
 
-                Out << ", TypeArmorVirtual(" << Info.NumberOfParamMatches_virtual << "):";
-                for (int j = 0; j <= NumberOfParams; ++j) {
-                    for (const SDBuildCHA::func_name_t &Target : NumberOfParametersList_virtual[j]) {
-                        auto FunctionName = Target;
-                        FunctionName = StringRef(FunctionName);
-                        Out << ",\"" << FunctionName << "\"";
-                    }
-                }
+            int NumberOfParams = Params;
+            if (NumberOfParams >= 7)
+                NumberOfParams = 7;
 
-                Out << ", ShrinkWrap(" << ShrinkWrap.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : ShrinkWrap) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            writeTargets(Out, "TypeArmor", NumberOfParams, NumberOfParametersUpTo[NumberOfParams]);
 
-                Out << ", VTV(" << VTV.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : VTV) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            // virtual versions
 
-                Out << ", Marx(" << Marx.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : Marx) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            writeTargets(Out, "vTrustVirtual", vTrustVirtual.count(), vTrustVirtual);
+            writeTargets(Out, "IFCCVirtual", IFCCVirtual.count(), IFCCVirtual);
+            writeTargets(Out, "IFCCSafeVirtual", IFCCSafeVirtual.count(), IFCCSafeVirtual);
 
-                Out << ", vTint(" << vTint.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : vTint) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            writeTargets(Out, "TypeArmorVirtual", NumberOfParamMatches_virtual,
+                         NumberOfParametersUpTo_virtual[NumberOfParams]);
 
-                Out << "\n";
-                i++;
-            }
+            writeTargets(Out, "ShrinkWrap", ShrinkWrap.count(), ShrinkWrap);
+            writeTargets(Out, "VTV", VTV.count(), VTV);
+            writeTargets(Out, "Marx", Marx.count(), Marx);
+            writeTargets(Out, "vTint", vTint.count(), vTint);
 
-            if (i > 30) {
-                break;
-            }
+            Out << "\n";
+            i++;
         }
         Out.close();
 
     }
 
-    void writeMetricIndirect(raw_fd_ostream &Out) {
+    void writeMetricIndirect(raw_fd_ostream &Out, StringRef Rows) {
         if (MetricIndirect.empty())
             return;
 
         writeHeader(Out, false);
 
-        auto BaseLine = AllFunctions.size();
-        auto BaseLineVirtual = AllVFunctions.size();
         std::set<std::string> ExportedLines;
 
         int i = 0;
-        for (auto I = MetricIndirect.rbegin(), E = MetricIndirect.rend(); I != E; ++I) {
-            for (auto &Info : I->second) {
-                if (ExportedLines.find(Info.Dwarf) != ExportedLines.end())
-                    continue;
-
-                ExportedLines.insert(Info.Dwarf);
-                Out << Info.Dwarf
-                    << "," << Info.DisplayName
-                    << ","
-                    << ","
-                    << "," << Info.Params
-                    << ","
-                    << ","
-                    << "," << Info.TargetSignatureMatches
-                    << "," << Info.ShortTargetSignatureMatches
-                    << "," << Info.NumberOfParamMatches
-                    << "," << AllFunctions.size()
-                    << ","
-                    << ","
-                    << "," << Info.TargetSignatureMatches_virtual
-                    << "," << Info.ShortTargetSignatureMatches_virtual
-                    << "," << Info.NumberOfParamMatches_virtual
-                    << "," << BaseLineVirtual;
-
-                std::set<std::string> vTrust, IFCC, IFCCSafe, Typearmor;
-                // std::map<preciseFunctionSignature_t, func_name_set> PreciseTargetSignature{};
-                // std::map<SDBuildCHA::func_and_class_t, func_name_set> VTableSubHierarchyPerFunction{};
-
-                std::string DemangledFunctionName = Info.FunctionName;
-                int Status = 0;
-                auto DemangledPair = itaniumDemanglePair(Info.FunctionName, Status);
-                if (Status == 0 && DemangledPair.second != "") {
-                    DemangledFunctionName = DemangledPair.second;
-                }
+        for (auto I = MetricIndirect.begin(), E = MetricIndirect.end(); I != E; ++I) {
+            // stop after the group of equal metrics that exceeded the limit
+            if (i > 50 && I->Metric != std::prev(I)->Metric) {
+                break;
+            }
 
-                vTrust = PreciseTargetSignature[preciseFunctionSignature_t(DemangledFunctionName,Info.Encoding.Precise)];
-                IFCC = TargetSignature[Info.Encoding.Normal];
-                IFCCSafe = ShortTargetSignature[Info.Encoding.Normal];
+            const MetricIndexEntry &Entry = *I;
+            StringRef Row = Rows.substr(Entry.Offset, Entry.Length);
+            StringRef Dwarf = Row.substr(0, Entry.DwarfLength);
+            if (!ExportedLines.insert(Dwarf).second)
+                continue;
 
+            // the metric row names the calling function in the FunctionName column
+            Out << Dwarf
+                << "," << Entry.Caller->getName()
+                << Row.drop_front(Entry.DwarfLength + 1);
 
-                Out << ", vTrust(" << vTrust.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : vTrust) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            int64_t Params = getRowInteger(Row, Entry, 3);
+            int64_t NumberOfParamMatches = getRowInteger(Row, Entry, 8);
 
-                Out << ", IFCC(" << IFCC.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCC) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            // indirect CallSites have no function name
+            StringRef DemangledFunctionName = "";
 
-                Out << ", IFCCSafe(" << IFCCSafe.size() << "):";
-                for (const SDBuildCHA::func_name_t &Target : IFCCSafe) {
-                    auto FunctionName = Target;
-                    FunctionName = StringRef(FunctionName);
-                    Out << ",\"" << FunctionName << "\"";
-                }
+            const func_id_set &vTrust = lookupTargets(
+                    PreciseTargetSignature, preciseFunctionSignature_t(DemangledFunctionName, Entry.EncodingPrecise));
+            const func_id_set &IFCC = lookupTargets(TargetSignature, Entry.EncodingNormal);
+            const func_id_set &IFCCSafe = lookupTargets(ShortTargetSignature, Entry.EncodingShort);
 
-                int NumberOfParams = Info.Params;
-                if (NumberOfParams >= 7)
-                    NumberOfParams = 7;
+            writeTargets(Out, "vTrust", vTrust.count(), vTrust);
+            writeTargets(Out, "IFCC", IFCC.count(), IFCC);
+            writeTargets(Out, "IFCCSafe", IFCCSafe.count(), IFCCSafe);
 
-                Out << ", TypeArmor(" << Info.NumberOfParamMatches << "):";
-                for (int j = 0; j <= NumberOfParams; ++j) {
-                    for (const SDBuildCHA::func_name_t &Target : NumberOfParametersList[j]){
-                        auto FunctionName = Target;
-                        FunctionName = StringRef(FunctionName);
-                        Out << ",\"" << FunctionName << "\"";
-                    }
-                }
+            int NumberOfParams = Params;
+            if (NumberOfParams >= 7)
+                NumberOfParams = 7;
 
-                Out << "\n";
-                i++;
-            }
+            writeTargets(Out, "TypeArmor", NumberOfParamMatches, NumberOfParametersUpTo[NumberOfParams]);
 
-            if (i > 50) {
-                break;
-            }
+            Out << "\n";
+            i++;
         }
         Out.close();
 
     }
 
+    /** ", Name(Count):" followed by the quoted targets */
+    void writeTargets(raw_ostream &Out, StringRef Name, int64_t Count, const func_id_set &Targets) {
+        Out << ", " << Name << "(" << Count << "):";
+        writeTargetNames(Out, Targets);
+    }
+
+    /** by name, the ids are in the order the functions were first seen */
+    void writeTargetNames(raw_ostream &Out, const func_id_set &Targets) {
+        std::vector<StringRef> Names;
+        for (unsigned Id : Targets) {
+            Names.push_back(FunctionNames[Id]);
+        }
+        std::sort(Names.begin(), Names.end());
+        for (StringRef Target : Names) {
+            Out << ",\"" << Target << "\"";
+        }
+    }
+
+    /** dense id of a function name, assigned on first use */
+    unsigned getFunctionId(StringRef Name) {
+        auto Res = FunctionIds.insert(std::make_pair(Name, (unsigned) FunctionNames.size()));
+        if (Res.second) {
+            FunctionNames.push_back(Name);
+        }
+        return Res.first->second;
+    }
+
     void writeHeader(raw_ostream &Out, bool writeFullHeader, bool writeDetails = true) {
         std::stringstream ShortHeader, ShortDetails, FullHeader, FullDetails;
 
@@ -1157,7 +1379,7 @@ private:
     };
 
     bool isVirtualFunction(const Function &F) {
-        return AllVFunctions.find(F.getName()) != AllVFunctions.end() || F.getName().startswith("_ZTh");
+        return AllVFunctions.test(getFunctionId(F.getName())) || F.getName().startswith("_ZTh");
     }
 
     bool isBlackListed(const Function &F) {
@@ -1,6 +1,8 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/SafeDispatch.h"
 #include "llvm/Transforms/IPO/SafeDispatchCHA.h"
+#include "llvm/Transforms/IPO/SafeDispatchCHACache.h"
+#include "llvm/Transforms/IPO/SafeDispatchClassInfoMD.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/InstIterator.h"
@@ -15,6 +17,7 @@
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/CallSite.h"
+#include "llvm/Support/ErrorHandling.h"
 
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
 #include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
@@ -45,8 +48,8 @@ char SDBuildCHA::ID = 0;
 
 INITIALIZE_PASS(SDBuildCHA, "sdcha", "Build CHA pass for SafeDispatch", false, false)
 
-ModulePass* llvm::createSDBuildCHAPass() {
-  return new SDBuildCHA();
+ModulePass* llvm::createSDBuildCHAPass(SDCHACache *cache) {
+  return new SDBuildCHA(cache);
 }
 
 /**
@@ -54,35 +57,140 @@ ModulePass* llvm::createSDBuildCHAPass() {
  * the beginning of the vtable
  */
 unsigned SDBuildCHA::getVTableOrder(const vtbl_name_t& vtbl, uint64_t ind) {
-  assert(rangeMap.find(vtbl) != rangeMap.end());
+  assert(getNumAddrPts(vtbl) > 0);
 
-  std::vector<range_t>& ranges = rangeMap[vtbl];
-  for (int i = 0; i < ranges.size(); i++) {
-    if (ranges[i].first <= ind && ranges[i].second >= ind) //Paul: if first is less than ind and second is greather than ind
+  for (uint64_t i = 0; i < getNumAddrPts(vtbl); i++) {
+    const range_t &range = getRange(vtbl, i);
+    if (range.first <= ind && range.second >= ind) //Paul: if first is less than ind and second is greather than ind
       return i;
   }
 
-  sd_print("Index %d is not in any range for %s\n", ind, vtbl.c_str());
+  sd_print("Index %lu is not in any range for %s\n", ind, vtbl.c_str());
   assert(false && "Index not in range");
 }
 
-//Paul: this runs recursivelly until all nodes where visited 
-// it is called once from the preorder function from underneath 
-void SDBuildCHA::preorderHelper(std::vector<SDBuildCHA::vtbl_t>& nodes, 
-                                   const SDBuildCHA::vtbl_t& root, 
-                                              vtbl_set_t &visited) {
-  //Paul: while not each node was visited 
-  if (visited.find(root) != visited.end())
-    return;//in case all nodes were visited than stop the recursion 
-
-  nodes.push_back(root);// ad the node to the preorder traversal 
-  visited.insert(root);//now it is visited 
-
-  // Paul: if the node is found, this means before
-  // reaching the end of the set the node has to be found 
-  if (cloudMap.find(root) != cloudMap.end()) { 
-    for (const SDBuildCHA::vtbl_t& n : cloudMap[root]) {
-      preorderHelper(nodes, n, visited); //Paul: recursive call 
+//Paul: this runs until all nodes reachable from root were visited.
+// The explicit stack visits the nodes in exactly the order of the old
+// recursive helper: children are pushed in reverse and the visited check
+// happens when a node is popped.
+void SDBuildCHA::preorderIDs(node_id_t root, std::vector<node_id_t> &nodes) {
+  std::vector<bool> visited(graph.numNodes(), false);
+  std::vector<node_id_t> stack(1, root);
+
+  while (!stack.empty()) {
+    node_id_t n = stack.back();
+    stack.pop_back();
+
+    if (visited[n])
+      continue;
+
+    nodes.push_back(n);// ad the node to the preorder traversal 
+    visited[n] = true;//now it is visited 
+
+    ArrayRef<node_id_t> children = graph.children(n);
+    for (auto it = children.rbegin(); it != children.rend(); it++)
+      stack.push_back(*it);
+  }
+}
+
+void SDBuildCHA::buildPreorderIndex() {
+  unsigned numNodes = graph.numNodes();
+
+  classPreorder.assign(graph.numClasses(), std::vector<node_id_t>());
+  nodePreEnter.assign(numNodes, SDClassGraph::InvalidID);
+  nodePreExit.assign(numNodes, SDClassGraph::InvalidID);
+  nodeExactSubtree.assign(numNodes, false);
+  nodeDescendantCount.assign(numNodes, 0);
+  nodeFirstDefined.assign(numNodes, SDClassGraph::InvalidID);
+
+  for (auto rootName : roots) {
+    class_id_t rootID = graph.lookupClass(rootName);
+    std::vector<node_id_t> &pre = classPreorder[rootID];
+
+    // same traversal as preorderIDs(), but remember the DFS tree parent
+    std::vector<bool> visited(numNodes, false);
+    std::vector<node_id_t> treeParent;
+    std::vector<std::pair<node_id_t, node_id_t>> stack;
+    stack.push_back(std::make_pair(getNode(vtbl_t(rootName, 0)), SDClassGraph::InvalidID));
+
+    while (!stack.empty()) {
+      std::pair<node_id_t, node_id_t> top = stack.back();
+      stack.pop_back();
+
+      if (visited[top.first])
+        continue;
+      visited[top.first] = true;
+
+      pre.push_back(top.first);
+      treeParent.push_back(top.second);
+
+      ArrayRef<node_id_t> children = graph.children(top.first);
+      for (auto it = children.rbegin(); it != children.rend(); it++)
+        stack.push_back(std::make_pair(*it, top.first));
+    }
+
+    // the first root that reaches a node owns it
+    for (node_id_t n : pre) {
+      if (nodeAncestor[n] == SDClassGraph::InvalidID)
+        nodeAncestor[n] = rootID;
+    }
+
+    for (uint32_t i = 0; i < pre.size(); i++) {
+      if (nodeAncestor[pre[i]] == rootID) {
+        nodePreEnter[pre[i]] = i;
+        nodePreExit[pre[i]] = i + 1;
+      }
+    }
+
+    // An edge leaving [enter,exit) can only point to a node entered earlier,
+    // so the interval is exact iff no edge out of the DFS subtree points
+    // before enter. Nodes owned by another cloud count as "before".
+    std::vector<int64_t> minTarget(pre.size());
+    for (uint32_t i = 0; i < pre.size(); i++) {
+      minTarget[i] = i;
+      for (node_id_t c : graph.children(pre[i])) {
+        int64_t target = nodeAncestor[c] == rootID ? (int64_t) nodePreEnter[c] : -1;
+        minTarget[i] = std::min(minTarget[i], target);
+      }
+    }
+
+    for (uint32_t i = pre.size() - 1; i > 0; i--) {
+      node_id_t parent = treeParent[i];
+      if (nodeAncestor[pre[i]] != rootID || nodeAncestor[parent] != rootID)
+        continue;
+      uint32_t parentInd = nodePreEnter[parent];
+      nodePreExit[parent] = std::max(nodePreExit[parent], nodePreExit[pre[i]]);
+      minTarget[parentInd] = std::min(minTarget[parentInd], minTarget[i]);
+    }
+
+    // nextDefined[i] is the first position >= i holding a defined vtable
+    std::vector<uint32_t> nextDefined(pre.size() + 1, pre.size());
+    for (uint32_t i = pre.size(); i > 0; i--)
+      nextDefined[i - 1] = isUndefinedClass(graph.classOf(pre[i - 1])) ? nextDefined[i] : i - 1;
+
+    for (uint32_t i = 0; i < pre.size(); i++) {
+      node_id_t n = pre[i];
+      if (nodeAncestor[n] != rootID)
+        continue;
+
+      nodeExactSubtree[n] = minTarget[i] >= (int64_t) i;
+
+      if (nodeExactSubtree[n]) {
+        nodeDescendantCount[n] = nodePreExit[n] - i;
+        uint32_t first = nextDefined[i + 1];
+        if (first < nodePreExit[n])
+          nodeFirstDefined[n] = pre[first];
+      } else {
+        std::vector<node_id_t> desc;
+        preorderIDs(n, desc);
+        nodeDescendantCount[n] = desc.size();
+        for (node_id_t c : desc) {
+          if (c != n && !isUndefinedClass(graph.classOf(c))) {
+            nodeFirstDefined[n] = c;
+            break;
+          }
+        }
+      }
     }
   }
 }
@@ -92,12 +200,103 @@ std::vector<SDBuildCHA::vtbl_t> SDBuildCHA::preorder(const vtbl_t& root) {
   //vector of pairs (std::pair<vtbl_name_t, uint64_t> )
   order_t nodes;
 
-  //set of pairs (std::pair<vtbl_name_t, uint64_t>)
-  vtbl_set_t visited;
-  preorderHelper(nodes, root, visited);
+  node_id_t rootID = graph.lookupNode(root);
+  if (rootID == SDClassGraph::InvalidID) {
+    nodes.push_back(root);
+    return nodes;
+  }
+
+  // exact sub-trees are a slice of the memoized preorder of their cloud
+  if (isIndexed(rootID) && nodeExactSubtree[rootID]) {
+    const std::vector<node_id_t> &pre = classPreorder[nodeAncestor[rootID]];
+    nodes.reserve(nodePreExit[rootID] - nodePreEnter[rootID]);
+    for (uint32_t i = nodePreEnter[rootID]; i < nodePreExit[rootID]; i++)
+      nodes.push_back(graph.key(pre[i]));
+    return nodes;
+  }
+
+  std::vector<node_id_t> ids;
+  preorderIDs(rootID, ids);
+
+  nodes.reserve(ids.size());
+  for (node_id_t n : ids)
+    nodes.push_back(graph.key(n));
   return nodes;
 }
 
+uint64_t SDBuildCHA::getSubtreeSize(const vtbl_t& vtbl) {
+  node_id_t n = graph.lookupNode(vtbl);
+  if (n == SDClassGraph::InvalidID)
+    return 1;
+  if (isIndexed(n))
+    return nodeDescendantCount[n];
+  return preorder(vtbl).size();
+}
+
+bool SDBuildCHA::isInSubtree(const vtbl_t& root, const vtbl_t& vtbl) {
+  node_id_t r = graph.lookupNode(root);
+  node_id_t n = graph.lookupNode(vtbl);
+  if (r == SDClassGraph::InvalidID || n == SDClassGraph::InvalidID)
+    return root == vtbl;
+
+  if (isIndexed(r) && nodeExactSubtree[r]) {
+    return nodeAncestor[n] == nodeAncestor[r] &&
+           nodePreEnter[r] <= nodePreEnter[n] && nodePreEnter[n] < nodePreExit[r];
+  }
+  return isAncestor(r, n);
+}
+
+unsigned SDBuildCHA::orderSiblingsByWeight(const std::map<vtbl_t, uint64_t>& weights) {
+  unsigned numNodes = graph.numNodes();
+  std::vector<uint64_t> weight(numNodes, 0);
+  for (auto& it : weights) {
+    node_id_t n = graph.lookupNode(it.first);
+    if (n != SDClassGraph::InvalidID)
+      weight[n] = it.second;
+  }
+
+  // sub-tree weights, children before parents (reverse preorder of each cloud)
+  std::vector<uint64_t> subtreeWeight(weight);
+  std::vector<bool> summed(numNodes, false);
+  for (auto& rootName : roots) {
+    const std::vector<node_id_t> &pre = classPreorder[graph.lookupClass(rootName)];
+    for (auto it = pre.rbegin(); it != pre.rend(); it++) {
+      if (summed[*it] || !nodeExactSubtree[*it])
+        continue;
+      summed[*it] = true;
+      for (node_id_t c : graph.children(*it))
+        subtreeWeight[*it] += subtreeWeight[c];
+    }
+  }
+
+  unsigned reordered = 0;
+  for (node_id_t n = 0; n < numNodes; n++) {
+    MutableArrayRef<node_id_t> children = graph.mutableChildren(n);
+    if (children.size() < 2)
+      continue;
+
+    bool movable = true;
+    for (node_id_t c : children)
+      movable = movable && graph.parents(c).size() == 1 && isIndexed(c) && nodeExactSubtree[c];
+    if (!movable)
+      continue;
+
+    std::vector<node_id_t> old(children.begin(), children.end());
+    std::stable_sort(children.begin(), children.end(), [&](node_id_t a, node_id_t b) {
+      return subtreeWeight[a] > subtreeWeight[b];
+    });
+    if (!std::equal(old.begin(), old.end(), children.begin()))
+      reordered++;
+  }
+
+  if (reordered) {
+    // renumber the clouds in the new order
+    nodeAncestor.assign(numNodes, SDClassGraph::InvalidID);
+    buildPreorderIndex();
+  }
+  return reordered;
+}
+
 static inline uint64_t sd_getNumberFromMDTuple(const MDOperand& op) {
   Metadata* md = op.get();
   assert(md);
@@ -121,7 +320,7 @@ void SDBuildCHA::verifyClouds(Module &M) {
   //Paul: iterate throug all roots 
   for (auto rootName : roots) {
     vtbl_t root(rootName, 0);
-    assert(cloudMap.count(root)); //Paul: check that the cloud map for each of the roots is not empty  
+    assert(knowsAbout(root)); //Paul: check that the cloud map for each of the roots is not empty  
   }
 }
 
@@ -153,7 +352,7 @@ SDBuildCHA::findLeastCommonAncestor(const SDBuildCHA::vtbl_set_t &vtbls, SDBuild
   // heuristic. The actual problem to solve is the "lowest"
   // node in the CHA that intercepts all paths leading up to the root.
   // The current implementation just finds the topmost common ancestor.
-  vtbl_t candidate(ancestorMap[*vtbls.begin()], 0);
+  vtbl_t candidate(getAncestor(*vtbls.begin()), 0);
   
   do {
     vtbl_t nextCandidate;
@@ -161,13 +360,13 @@ SDBuildCHA::findLeastCommonAncestor(const SDBuildCHA::vtbl_set_t &vtbls, SDBuild
 
     // Count the number of children of the current candidate
     // that are also common ancestors
-    for (auto child : cloudMap[candidate]) {
+    for (auto child = children_begin(candidate); child != children_end(candidate); child++) {
       int nDescendents = 0;
       for (auto it : ancestorsMap)
-        if (it.second.find(child) != it.second.end()) nDescendents++;
+        if (it.second.find(*child) != it.second.end()) nDescendents++;
 
       if (nDescendents == vtbls.size()) {
-        nextCandidate = child;
+        nextCandidate = *child;
         nChildrenCommonAncestors++;
       }
     }
@@ -190,17 +389,45 @@ SDBuildCHA::findLeastCommonAncestor(const SDBuildCHA::vtbl_set_t &vtbls, SDBuild
   return candidate;
 }
 
+SDBuildCHA::node_id_t SDBuildCHA::internNode(const vtbl_t& vtbl) {
+  node_id_t n = graph.internNode(vtbl.first, vtbl.second);
+
+  if (graph.numNodes() > nodeAddrPt.size()) {
+    nodeAddrPt.resize(graph.numNodes(), 0);
+    nodeRange.resize(graph.numNodes(), range_t(0, 0));
+    nodeAncestor.resize(graph.numNodes(), SDClassGraph::InvalidID);
+    nodeLayoutClass.resize(graph.numNodes(), SDClassGraph::InvalidID);
+    nodeCloudSize.resize(graph.numNodes(), 0);
+    nodeFunctions.resize(graph.numNodes());
+  }
+
+  if (graph.numClasses() > classNumSubVTables.size()) {
+    classNumSubVTables.resize(graph.numClasses(), 0);
+    classUndefined.resize(graph.numClasses(), false);
+    classIsRoot.resize(graph.numClasses(), false);
+    classOldVTable.resize(graph.numClasses(), nullptr);
+  }
+
+  return n;
+}
+
 /*Paul: this is the main method in this class. This method builds the:
-cloudMap
-rangeMap
-parentsMap
+class graph (children and parents of every (vtbl,ind) node)
+per node ranges, address points, ancestors and layout classes
 roots
-addrPtMap
 */
 void SDBuildCHA::buildClouds(Module &M) {
   // this set is used for checking if a parent class is defined or not
   std::set<vtbl_t> build_undefinedVtables;
 
+  // records of modules that were extracted before the modules got linked
+  // (see SDCHACache) come first, then the metadata left in the module
+  std::vector<std::vector<nmd_t>> infoVecs;
+  if (cache) {
+    sd_print("\nGOT %d CACHED CLASS RECORDS\n", cache->records().size());
+    infoVecs.push_back(cache->records());
+  }
+
   for(auto itr = M.getNamedMDList().begin(); itr != M.getNamedMDList().end(); itr++) {
     
     //Paul: get all metadata of this module
@@ -217,11 +444,20 @@ void SDBuildCHA::buildClouds(Module &M) {
     // and puts it into this vector, this metadata was previously added 
     // inside SafeDispatchVtblMD.h, in: sd_insertVtableMD() function
     // this function is called for each generated v table, during code generation  
-    std::vector<nmd_t> infoVec = extractMetadata(md);
+    infoVecs.push_back(extractMetadata(md));
+  }
 
+  for (const std::vector<nmd_t>& infoVec : infoVecs) {
     //nmd_t is the main top root node type, now iterate through the info vector   
     for (const nmd_t& info : infoVec) {
-     
+      internNode(vtbl_t(info.className, 0));
+      class_id_t classID = graph.lookupClass(info.className);
+
+      if (classNumSubVTables[classID] != 0) {
+        sd_print("class %s was already recorded, skipping\n", info.className.c_str());
+        continue;
+      }
+
       // record the old vtable array
       /* Paul:
       this GlobalVariable holds the metadata for each module.
@@ -240,9 +476,11 @@ void SDBuildCHA::buildClouds(Module &M) {
         ConstantArray* vtable = dyn_cast<ConstantArray>(oldVtable->getInitializer());
         assert(vtable);
         oldVTables[info.className] = vtable;
+        classOldVTable[classID] = vtable;
       } else {
-        undefinedVTables.insert(info.className);
+        classUndefined[classID] = true;
       }
+      classNumSubVTables[classID] = info.subVTables.size();
       
       //Paul: iterate trough the sub v tables of the metadata vector
       // and build the roots, parents, addres pointer and the range maps
@@ -250,6 +488,7 @@ void SDBuildCHA::buildClouds(Module &M) {
       for(unsigned ind = 0; ind < info.subVTables.size(); ind++) {
         const nmd_sub_t* subInfo = & info.subVTables[ind];
         vtbl_t name(info.className, ind);
+        node_id_t nameID = internNode(name);
         
         sd_print("SubVtable: %d Order: %d clossest Parents count: %d ",
           ind, 
@@ -263,7 +502,7 @@ void SDBuildCHA::buildClouds(Module &M) {
         for (auto &entry : subInfo->functions) {
           sd_print("subInfo functions (%s @ %d),", entry.functionName.c_str(), entry.offsetInVTable);
         }
-        vTableFunctionMap[name] = subInfo->functions;
+        nodeFunctions[nameID] = subInfo->functions;
 
         sd_print("subInfo start-end [%d-%d] AddrPt: %d\n",
           subInfo->start,
@@ -276,47 +515,37 @@ void SDBuildCHA::buildClouds(Module &M) {
           build_undefinedVtables.erase(name);
         }
 
-        if (cloudMap.find(name) == cloudMap.end()){
-          //sd_print("Inserting vtable: %s, order: %d in cloudMap\n", name.first.c_str(), name.second);
-          //Paul: here the cloudMap is filled for the first time 
-          cloudMap[name] = std::set<vtbl_t>(); //empty set
-        }
-
-        vtbl_set_t parents;
-        
         //Paul: interate now through each subinfo and get the parents
         for (auto it : subInfo->parents) {
           if (it.first != "") {
             vtbl_t &parent = it;
-            parents.insert(parent); // parent is a pair of <vtbl_name_t, uint64_t> 
 
             // if the parent class is not defined yet, add it to the
             // undefined vtable set
-            if (cloudMap.find(parent) == cloudMap.end()) {
+            class_id_t parentClass = graph.lookupClass(parent.first);
+            if (parentClass == SDClassGraph::InvalidID ||
+                classNumSubVTables[parentClass] <= parent.second) {
               //sd_print("Inserting %s, %d in cloudMap - undefined parent\n", parent.first.c_str(), parent.second);
-              cloudMap[parent] = std::set<vtbl_t>();
               build_undefinedVtables.insert(parent);
             }
 
             // add the current class to the parent's children set
             sd_print("root: %s in cloudMap insert vtable: %s, \n",  parent.first.c_str(), name.first.c_str());
-            cloudMap[parent].insert(name);
+            graph.addEdge(internNode(parent), nameID);
           } else {
             assert(ind == 0); // make sure secondary vtables have a direct parent
             
             // add the class to the root set
             roots.insert(info.className);
+            classIsRoot[classID] = true;
           }
         }
-        
-        // Paul: record the parents for each class 
-        parentMap[info.className].push_back(parents); //parents set 
 
         // record the original address points for each class 
-        addrPtMap[info.className].push_back(subInfo->addressPoint);
+        nodeAddrPt[nameID] = subInfo->addressPoint;
 
         // record the sub-vtable ends for each class
-        rangeMap[info.className].push_back(range_t(subInfo->start, subInfo->end));
+        nodeRange[nameID] = range_t(subInfo->start, subInfo->end);
       }
     }
   }
@@ -330,28 +559,25 @@ void SDBuildCHA::buildClouds(Module &M) {
   
   //Paul: assertion to check that the are no undefined v tables
   assert(build_undefinedVtables.size() == 0);
+
+  //Paul: freeze the children/parents lists
+  graph.finalize();
   
   //Paul: build the ancestor map for each of the child nodes of a root node
-  for (auto rootName : roots) {
-    vtbl_t root(rootName, 0);
-    for (auto child : preorder(root)) {
-      if (ancestorMap.find(child) == ancestorMap.end()) {
-        ancestorMap[child] = rootName;
-      }
-    }
-  }
+  //and number every cloud in preorder
+  buildPreorderIndex();
 
   //Paul: print the parent map for each of the classes 
-  for (auto it : parentMap) {
-    const vtbl_name_t &className = it.first;
-    const std::vector<vtbl_set_t> &parentSetV = it.second;
+  for (class_id_t c = 0; c < graph.numClasses(); c++) {
+    if (classNumSubVTables[c] == 0)
+      continue;
 
-    std::cerr << "(class name: " << className << ", parents: [";
+    std::cerr << "(class name: " << graph.className(c) << ", parents: [";
 
-    for (int ind = 0; ind < parentSetV.size(); ind++) {
+    for (uint32_t ind = 0; ind < classNumSubVTables[c]; ind++) {
       std::cerr << "index: "<< ind <<"{";
-      for (auto ptIt : parentSetV[ind])
-        std::cerr << "<" << ptIt.first << "," << ptIt.second << ">,";
+      for (node_id_t pt : graph.parents(graph.classNodeIDs(c)[ind]))
+        std::cerr << "<" << graph.key(pt).first << "," << graph.key(pt).second << ">,";
       std::cerr << "},";
     }
 
@@ -359,28 +585,26 @@ void SDBuildCHA::buildClouds(Module &M) {
   }
   
   //Paul: Check that all possible parents are in the same layout cloud
-  for (auto it : parentMap) {
-    const vtbl_name_t &className = it.first;
-    const std::vector<vtbl_set_t> &parentSetV = it.second;
-
-    for (int ind = 0; ind < parentSetV.size(); ind++) {
-      vtbl_name_t layoutClass = "none";
+  for (class_id_t c = 0; c < graph.numClasses(); c++) {
+    for (uint32_t ind = 0; ind < classNumSubVTables[c]; ind++) {
+      node_id_t node = graph.classNodeIDs(c)[ind];
+      class_id_t layoutClass = SDClassGraph::InvalidID;
 
       // Check that all possible parents are in the same layout cloud
-      for (auto ptIt : parentSetV[ind]) {
-        if (layoutClass != "none") {
-          assert(layoutClass == ancestorMap[ptIt] &&
+      for (node_id_t pt : graph.parents(node)) {
+        if (layoutClass != SDClassGraph::InvalidID) {
+          assert(layoutClass == nodeAncestor[pt] &&
             "All parents of a primitive vtable should have the same root layout.");
         } else
-          layoutClass = ancestorMap[ptIt];//set the layout class 
+          layoutClass = nodeAncestor[pt];//set the layout class 
       }
 
       // No parents - then our "layout class" is ourselves.
-      if (layoutClass == "none")
-        layoutClass = className;
+      if (layoutClass == SDClassGraph::InvalidID)
+        layoutClass = c;
 
       // record the class name of the sub-object
-      subObjNameMap[className].push_back(layoutClass);
+      nodeLayoutClass[node] = layoutClass;
     }
   }
 }
@@ -407,8 +631,8 @@ void SDBuildCHA::topoSortHelper(vtbl_name_t node, std::deque<vtbl_name_t> &order
   assert(tempMarked.find(node) == tempMarked.end() && "CHA is cyclic!?");
   tempMarked.insert(node);
 
-  for (auto &child : cloudMap[vtbl_t(node, 0)]) {
-    topoSortHelper(child.first, ordered, visited, tempMarked);
+  for (node_id_t child : graph.children(getNode(vtbl_t(node, 0)))) {
+    topoSortHelper(graph.key(child).first, ordered, visited, tempMarked);
   }
   visited.insert(node);
   ordered.push_front(node);
@@ -420,15 +644,16 @@ void SDBuildCHA::buildFunctionInfo() {
 
   std::vector<FunctionEntry> functionImpls;
   for (auto &className : topologicalOrder) {
-    int ind = 0;
-    for (auto &function : vTableFunctionMap[vtbl_t(className, 0)]) {
+    size_t ind = 0;
+    for (auto &function : nodeFunctions[getNode(vtbl_t(className, 0))]) {
       if (functionImplMap.find(function.functionName) == functionImplMap.end()) {
         sdLog::log() << "new impl: " << function << "\n";
         std::vector<FunctionEntry> entriesForFunction;
 
         int directOverride = 0;
-        for (auto & parent : parentMap[className][0]) {
-          if (ind < vTableFunctionMap[parent].size()) {
+        for (node_id_t parentID : graph.parents(getNode(vtbl_t(className, 0)))) {
+          const vtbl_t &parent = graph.key(parentID);
+          if (ind < nodeFunctions[parentID].size()) {
             sdLog::log() << "\t is direct override of" << parent.first << ", " << parent.second << "@" << ind << "\n";
             directOverride++;
           }
@@ -437,8 +662,8 @@ void SDBuildCHA::buildFunctionInfo() {
         entriesForFunction.push_back(function);
 
         int indirectOverride = 0;
-        for (int64_t i = 1; i < subObjNameMap[className].size(); i++) {
-          for (auto &overrideFunc : vTableFunctionMap[vtbl_t(className, i)]) {
+        for (uint64_t i = 1; i < getNumAddrPts(className); i++) {
+          for (auto &overrideFunc : nodeFunctions[getNode(vtbl_t(className, i))]) {
             if (function.functionName == overrideFunc.functionName) {
               sdLog::log() << "\t is indirect override: " << overrideFunc << "\n";
               entriesForFunction.push_back(overrideFunc);
@@ -515,9 +740,9 @@ SDBuildCHA::range_t SDBuildCHA::buildFunctionInfoForFunction(FunctionEntry &func
   functionIDMap[function] = currentID++;
 
   // recurse for children
-  for (auto &child : cloudMap[function.vTable]) {
+  for (node_id_t child : graph.children(getNode(function.vTable))) {
     FunctionEntry *childFunction = nullptr;
-    for (auto &entry : vTableFunctionMap[child]) {
+    for (auto &entry : nodeFunctions[child]) {
       if (entry.offsetInVTable == function.offsetInVTable) {
         childFunction = &entry;
       }
@@ -562,6 +787,85 @@ static llvm::GlobalVariable* sd_mdnodeToGV(Metadata* vtblMd) {
   return vtblGV;
 }
 
+/**
+ * Decode a compact {blob, {vtbl gv md...}} class info operand, see
+ * SafeDispatchClassInfoMD.h. Returns false if the operand is in the old format.
+ * A malformed compact operand is a fatal error.
+ */
+static bool sd_decodeCompactClassInfo(MDNode* node, SDBuildCHA::nmd_t& info) {
+  if (node->getNumOperands() != 2)
+    return false;
+
+  MDString* blobMD = dyn_cast_or_null<MDString>(node->getOperand(0).get());
+  StringRef magic(SD_MD_CLASSINFO_MAGIC);
+  if (!blobMD || !blobMD->getString().startswith(magic))
+    return false;
+
+  MDNode* gvs = dyn_cast_or_null<MDNode>(node->getOperand(1).get());
+  if (!gvs)
+    report_fatal_error("malformed SafeDispatch class info: missing vtable list");
+
+  sd_classinfo_reader_t R(blobMD->getString().drop_front(magic.size()));
+
+  // vtable names, fixed up with the (possibly renamed) global variable
+  std::vector<SDBuildCHA::vtbl_name_t> vtbls(R.readCount());
+  if (R.failed || vtbls.empty() || vtbls.size() != gvs->getNumOperands())
+    report_fatal_error("malformed SafeDispatch class info: bad vtable count");
+
+  for (unsigned i = 0; i < vtbls.size(); i++) {
+    vtbls[i] = R.readString();
+    if (GlobalVariable* gv = sd_mdnodeToGV(gvs->getOperand(i).get()))
+      vtbls[i] = gv->getName();
+  }
+
+  std::vector<std::string> functions(R.readCount());
+  for (unsigned i = 0; i < functions.size() && !R.failed; i++)
+    functions[i] = R.readString();
+
+  info.className = vtbls[0];
+
+  uint64_t numSubVTables = R.readCount();
+  for (uint64_t i = 0; i < numSubVTables && !R.failed; i++) {
+    SDBuildCHA::nmd_sub_t subInfo;
+    subInfo.order        = R.readULEB();
+    subInfo.start        = R.readULEB();
+    subInfo.end          = subInfo.start + R.readULEB();
+    subInfo.addressPoint = subInfo.start + R.readULEB();
+
+    uint64_t numParents = R.readCount();
+    for (uint64_t j = 0; j < numParents && !R.failed; j++) {
+      uint64_t nameInd = R.readULEB();
+      uint64_t order = R.readULEB();
+      if (nameInd >= vtbls.size())
+        R.failed = true;
+      else
+        subInfo.parents.insert(SDBuildCHA::vtbl_t(vtbls[nameInd], order));
+    }
+
+    uint64_t numFunctions = R.readCount();
+    for (uint64_t j = 0; j < numFunctions && !R.failed; j++) {
+      uint64_t nameInd = R.readULEB();
+      uint64_t offset = R.readULEB();
+      if (nameInd >= functions.size())
+        R.failed = true;
+      else
+        subInfo.functions.push_back(SDBuildCHA::FunctionEntry(functions[nameInd],
+            SDBuildCHA::vtbl_t(info.className, subInfo.order), offset));
+    }
+
+    bool currRangeCheck = (subInfo.start <= subInfo.addressPoint && subInfo.addressPoint <= subInfo.end);
+    bool prevVtblCheck = (i == 0 || (--info.subVTables.end())->end < subInfo.start);
+    if (!currRangeCheck || !prevVtblCheck)
+      R.failed = true;
+
+    info.subVTables.push_back(subInfo);
+  }
+
+  if (R.failed || !R.buf.empty())
+    report_fatal_error("malformed SafeDispatch class info for " + info.className);
+  return true;
+}
+
 /* Paul:
 this method extracts the metadata for each module.
 This is used in the buildClouds method from above.
@@ -577,6 +881,14 @@ std::vector<SDBuildCHA::nmd_t> SDBuildCHA::extractMetadata(NamedMDNode* md) {
   do {
     SDBuildCHA::nmd_t info;
 
+    // compact format: the whole class is a single operand
+    if (sd_decodeCompactClassInfo(md->getOperand(op), info)) {
+      op++;
+      if (classes.insert(info.className).second)
+        infoVec.push_back(info);
+      continue;
+    }
+
     MDString* infoMDstr = dyn_cast_or_null<MDString>(md->getOperand(op++)->getOperand(0));
     assert(infoMDstr);
     info.className = infoMDstr->getString().str();
@@ -672,24 +984,25 @@ std::vector<SDBuildCHA::nmd_t> SDBuildCHA::extractMetadata(NamedMDNode* md) {
 
 //returns the number of children in that sub cloud 
 int64_t SDBuildCHA::getCloudSize(const SDBuildCHA::vtbl_name_t& vtbl) {
-  vtbl_t v(vtbl, 0);
-  return cloudSizeMap[v];//returns the cloud size for a certain v table 
+  node_id_t n = graph.lookupNode(vtbl, 0);
+  return n == SDClassGraph::InvalidID ? 0 : nodeCloudSize[n];//returns the cloud size for a certain v table 
 }
 
 //calculate number of children for a single root node 
-uint32_t SDBuildCHA::calculateChildrenCounts(const SDBuildCHA::vtbl_t& root){
-  uint32_t count = isDefined(root) ? 1 : 0;
-  if (cloudMap.find(root) != cloudMap.end()) { // Paul: check if cloud is not empty
-    for (const SDBuildCHA::vtbl_t& n : cloudMap[root]) { //Paul: the cloud map has several root nodes
-      //Paul: the number of children is determined for each root node
-      //sd_print("list each vtable %s for a given root: %s \n", n.first.c_str(), root.first.c_str());
-      count += calculateChildrenCounts(n);
-    }
+// the count only depends on the sub-tree, so shared sub-trees (diamonds, roots
+// reaching the same nodes) are computed once and reused
+uint32_t SDBuildCHA::calculateChildrenCounts(node_id_t root){
+  if (nodeCloudSize[root] != 0)
+    return nodeCloudSize[root];
+
+  uint32_t count = isUndefinedClass(graph.classOf(root)) ? 0 : 1;
+  for (node_id_t n : graph.children(root)) { //Paul: the cloud map has several root nodes
+    //Paul: the number of children is determined for each root node
+    count += calculateChildrenCounts(n);
   }
 
-  //sd_print("Root: %s count: %d \n", root.first.c_str(), count);
-  //assert(cloudSizeMap.find(root) == cloudSizeMap.end());
-  cloudSizeMap[root] = count;
+  //sd_print("Root: %s count: %d \n", graph.key(root).first.c_str(), count);
+  nodeCloudSize[root] = count;
 
   return count;
 }
@@ -697,13 +1010,28 @@ uint32_t SDBuildCHA::calculateChildrenCounts(const SDBuildCHA::vtbl_t& root){
 /* Paul:
 after the CHA analysis the results will be cleared */
 void SDBuildCHA::clearAnalysisResults() {
-  cloudMap.clear();
+  graph.clear();
   roots.clear();
-  addrPtMap.clear();
-  rangeMap.clear();
-  ancestorMap.clear();
   oldVTables.clear();
-  cloudSizeMap.clear();
+
+  nodeAddrPt.clear();
+  nodeRange.clear();
+  nodeAncestor.clear();
+  nodeLayoutClass.clear();
+  nodeCloudSize.clear();
+  nodeFunctions.clear();
+
+  classPreorder.clear();
+  nodePreEnter.clear();
+  nodePreExit.clear();
+  nodeExactSubtree.clear();
+  nodeDescendantCount.clear();
+  nodeFirstDefined.clear();
+
+  classNumSubVTables.clear();
+  classUndefined.clear();
+  classIsRoot.clear();
+  classOldVTable.clear();
 
   sd_print("Cleared SDBuildCHA analysis results ... \n");
 }
@@ -756,7 +1084,8 @@ void SDBuildCHA::printClouds(const std::string &suffix) {
       classes.pop_front();
       
       //iterate through all children of this root 
-      for (const vtbl_t& child : cloudMap[vtbl]) {
+      for (auto childIt = children_begin(vtbl); childIt != children_end(vtbl); childIt++) {
+        const vtbl_t& child = *childIt;
         fprintf(file, "\t \"(%s,%lu)\" -> \"(%s,%lu)\";\n",
                           vtbl.first.data(), vtbl.second,
                           child.first.data(), child.second);
@@ -777,6 +1106,12 @@ void SDBuildCHA::printClouds(const std::string &suffix) {
 
 SDBuildCHA::vtbl_t SDBuildCHA::getFirstDefinedChild(const vtbl_t &vtbl) {
   assert(isUndefined(vtbl));
+  node_id_t n = graph.lookupNode(vtbl);
+
+  if (n != SDClassGraph::InvalidID && isIndexed(n) &&
+      nodeFirstDefined[n] != SDClassGraph::InvalidID)
+    return graph.key(nodeFirstDefined[n]);
+
   order_t const &order = preorder(vtbl);
 
   for (const vtbl_t& c : order) {
@@ -795,6 +1130,13 @@ SDBuildCHA::vtbl_t SDBuildCHA::getFirstDefinedChild(const vtbl_t &vtbl) {
 
 bool SDBuildCHA::hasFirstDefinedChild(const vtbl_t &vtbl) {
   //assert(isUndefined(vtbl));
+  node_id_t n = graph.lookupNode(vtbl);
+  if (n == SDClassGraph::InvalidID)
+    return false;
+
+  if (isIndexed(n))
+    return nodeFirstDefined[n] != SDClassGraph::InvalidID;
+
   order_t const &order = preorder(vtbl);
 
   for (const vtbl_t& c : order) {
@@ -806,21 +1148,24 @@ bool SDBuildCHA::hasFirstDefinedChild(const vtbl_t &vtbl) {
 }
 
 bool SDBuildCHA::knowsAbout(const vtbl_t &vtbl) {
-  return cloudMap.find(vtbl) != cloudMap.end();
+  return graph.lookupNode(vtbl) != SDClassGraph::InvalidID;
 }
 
 bool SDBuildCHA::isAncestor(const vtbl_t &base, const vtbl_t &derived) {
   if (derived == base)
     return true;
 
-  const vtbl_set_t &pts = parentMap[derived.first][derived.second];
-  /*
-  std::cerr << "parents of " << derived.first << "," << derived.second << ":";
-  for (auto pt : pts)
-    std::cerr << pt.first << "," << pt.second << ";";
-  std::cerr << "\n";
-  */
-  for (auto pt : pts) {
+  node_id_t baseID = graph.lookupNode(base);
+  if (baseID == SDClassGraph::InvalidID)
+    return false;
+  return isAncestor(baseID, getNode(derived));
+}
+
+bool SDBuildCHA::isAncestor(node_id_t base, node_id_t derived) {
+  if (derived == base)
+    return true;
+
+  for (node_id_t pt : graph.parents(derived)) {
     if (isAncestor(base, pt))
       return true;
   }
@@ -833,10 +1178,10 @@ to build a tool which detects not allowed casts*/
 int64_t SDBuildCHA::getSubVTableIndex(const vtbl_name_t& derived, const vtbl_name_t &base) {
   
   int res = -1;
-  for (int64_t ind = 0; ind < subObjNameMap[derived].size(); ind++) {
+  for (uint64_t ind = 0; ind < getNumAddrPts(derived); ind++) {
 
     //check if base is an acestor of one of the derived classes 
-    if (isAncestor(vtbl_t(base, 0), vtbl_t(derived, ind))) {
+    if (isInSubtree(vtbl_t(base, 0), vtbl_t(derived, ind))) {
       if (res != -1) {
         std::cerr << "Ambiguity: not a unique path for upcast " << derived << " to " << base << "\n";
         return -1;
@@ -0,0 +1,264 @@
+#include "llvm/Transforms/IPO/SafeDispatchCHACache.h"
+#include "llvm/Transforms/IPO/SafeDispatchMD.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+// bump this whenever nmd_t or the file layout changes
+#define SD_CHA_CACHE_MAGIC "SDCHA\x01"
+
+typedef support::endian::Writer<support::little> sd_writer_t;
+
+static void sd_writeString(sd_writer_t &W, StringRef str) {
+  W.write<uint32_t>(str.size());
+  W.OS << str;
+}
+
+namespace {
+  /// Bounds checked reader for the cache entries
+  struct SDCacheReader {
+    const char *cur;
+    const char *end;
+    bool failed;
+
+    SDCacheReader(StringRef buf) : cur(buf.begin()), end(buf.end()), failed(false) {}
+
+    uint64_t readInt(unsigned size) {
+      if (failed || (size_t)(end - cur) < size) {
+        failed = true;
+        return 0;
+      }
+      uint64_t val = 0;
+      for (unsigned i = 0; i < size; i++)
+        val |= ((uint64_t)(unsigned char) cur[i]) << (8 * i);
+      cur += size;
+      return val;
+    }
+
+    uint32_t read32() { return readInt(4); }
+    uint64_t read64() { return readInt(8); }
+
+    std::string readString() {
+      uint32_t size = read32();
+      if (failed || (size_t)(end - cur) < size) {
+        failed = true;
+        return "";
+      }
+      std::string str(cur, size);
+      cur += size;
+      return str;
+    }
+  };
+}
+
+/**
+ * Does the metadata tree reference a global variable with local linkage?
+ */
+static bool sd_refersToLocalGV(const MDNode *node, SmallPtrSetImpl<const MDNode*> &visited) {
+  if (!visited.insert(node).second)
+    return false;
+
+  for (const MDOperand &op : node->operands()) {
+    Metadata *md = op.get();
+    if (!md)
+      continue;
+
+    if (ConstantAsMetadata *cam = dyn_cast<ConstantAsMetadata>(md)) {
+      GlobalValue *gv = dyn_cast<GlobalValue>(cam->getValue()->stripPointerCasts());
+      if (gv && gv->hasLocalLinkage())
+        return true;
+    } else if (MDNode *sub = dyn_cast<MDNode>(md)) {
+      if (sd_refersToLocalGV(sub, visited))
+        return true;
+    }
+  }
+  return false;
+}
+
+std::string SDCHACache::entryPath(StringRef bitcode) const {
+  MD5 hash;
+  hash.update(SD_CHA_CACHE_MAGIC);
+  hash.update(bitcode);
+
+  MD5::MD5Result result;
+  hash.final(result);
+
+  SmallString<32> hex;
+  MD5::stringifyResult(result, hex);
+
+  SmallString<128> path(cacheDir);
+  sys::path::append(path, hex.str() + ".sdcha");
+  return path.str();
+}
+
+void SDCHACache::takeModuleRecords(Module &M, StringRef bitcode) {
+  std::string path = entryPath(bitcode);
+  records_t records;
+  std::vector<std::string> mdNames;
+
+  if (load(path, records, mdNames)) {
+    hits++;
+  } else {
+    misses++;
+    records.clear();
+    mdNames.clear();
+
+    for (NamedMDNode &md : M.getNamedMDList()) {
+      if (!md.getName().startswith(SD_MD_CLASSINFO))
+        continue;
+
+      SmallPtrSet<const MDNode*, 16> visited;
+      bool local = false;
+      for (const MDNode *op : md.operands())
+        local = local || sd_refersToLocalGV(op, visited);
+      if (local)
+        continue;
+
+      records_t mdRecords = SDBuildCHA::extractMetadata(&md);
+      records.insert(records.end(), mdRecords.begin(), mdRecords.end());
+      mdNames.push_back(md.getName().str());
+    }
+
+    store(path, records, mdNames);
+  }
+
+  for (const std::string &name : mdNames) {
+    if (NamedMDNode *md = M.getNamedMetadata(name))
+      md->eraseFromParent();
+  }
+
+  Records.insert(Records.end(), records.begin(), records.end());
+}
+
+bool SDCHACache::load(const std::string &path, records_t &records,
+                      std::vector<std::string> &mdNames) const {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> bufOrErr = MemoryBuffer::getFile(path);
+  if (!bufOrErr)
+    return false;
+
+  StringRef buf = (*bufOrErr)->getBuffer();
+  StringRef magic(SD_CHA_CACHE_MAGIC);
+  if (!buf.startswith(magic))
+    return false;
+
+  SDCacheReader R(buf.drop_front(magic.size()));
+
+  uint32_t numNames = R.read32();
+  for (uint32_t i = 0; i < numNames && !R.failed; i++)
+    mdNames.push_back(R.readString());
+
+  uint32_t numRecords = R.read32();
+  for (uint32_t i = 0; i < numRecords && !R.failed; i++) {
+    SDBuildCHA::nmd_t info;
+    info.className = R.readString();
+
+    uint32_t numSub = R.read32();
+    for (uint32_t j = 0; j < numSub && !R.failed; j++) {
+      SDBuildCHA::nmd_sub_t sub;
+      sub.order        = R.read64();
+      sub.parentName   = R.readString();
+      sub.parentOrder  = R.read64();
+      sub.start        = R.read64();
+      sub.end          = R.read64();
+      sub.addressPoint = R.read64();
+
+      uint32_t numParents = R.read32();
+      for (uint32_t k = 0; k < numParents && !R.failed; k++) {
+        std::string name = R.readString();
+        sub.parents.insert(SDBuildCHA::vtbl_t(name, R.read64()));
+      }
+
+      uint32_t numFunctions = R.read32();
+      for (uint32_t k = 0; k < numFunctions && !R.failed; k++) {
+        std::string funcName = R.readString();
+        std::string vtblName = R.readString();
+        uint64_t vtblOrder = R.read64();
+        sub.functions.push_back(SDBuildCHA::FunctionEntry(
+            funcName, SDBuildCHA::vtbl_t(vtblName, vtblOrder), R.read64()));
+      }
+      info.subVTables.push_back(sub);
+    }
+    records.push_back(info);
+  }
+
+  if (R.failed || R.cur != R.end) {
+    sdLog::warn() << "Ignoring corrupt CHA cache entry " << path << "\n";
+    return false;
+  }
+  return true;
+}
+
+void SDCHACache::store(const std::string &path, const records_t &records,
+                       const std::vector<std::string> &mdNames) const {
+  if (sys::fs::create_directories(cacheDir))
+    return;
+
+  // write a private file first and rename it, so concurrent links never
+  // see a partially written entry
+  SmallString<128> tmpPath;
+  int fd;
+  if (sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, tmpPath))
+    return;
+
+  {
+    raw_fd_ostream OS(fd, true);
+    sd_writer_t W(OS);
+
+    OS << SD_CHA_CACHE_MAGIC;
+
+    W.write<uint32_t>(mdNames.size());
+    for (const std::string &name : mdNames)
+      sd_writeString(W, name);
+
+    W.write<uint32_t>(records.size());
+    for (const SDBuildCHA::nmd_t &info : records) {
+      sd_writeString(W, info.className);
+
+      W.write<uint32_t>(info.subVTables.size());
+      for (const SDBuildCHA::nmd_sub_t &sub : info.subVTables) {
+        W.write<uint64_t>(sub.order);
+        sd_writeString(W, sub.parentName);
+        W.write<uint64_t>(sub.parentOrder);
+        W.write<uint64_t>(sub.start);
+        W.write<uint64_t>(sub.end);
+        W.write<uint64_t>(sub.addressPoint);
+
+        W.write<uint32_t>(sub.parents.size());
+        for (const SDBuildCHA::vtbl_t &parent : sub.parents) {
+          sd_writeString(W, parent.first);
+          W.write<uint64_t>(parent.second);
+        }
+
+        W.write<uint32_t>(sub.functions.size());
+        for (const SDBuildCHA::FunctionEntry &entry : sub.functions) {
+          sd_writeString(W, entry.functionName);
+          sd_writeString(W, entry.vTable.first);
+          W.write<uint64_t>(entry.vTable.second);
+          W.write<uint64_t>(entry.offsetInVTable);
+        }
+      }
+    }
+
+    if (OS.has_error()) {
+      OS.clear_error();
+      sys::fs::remove(tmpPath);
+      return;
+    }
+  }
+
+  if (sys::fs::rename(tmpPath, path))
+    sys::fs::remove(tmpPath);
+}
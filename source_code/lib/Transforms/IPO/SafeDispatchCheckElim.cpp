@@ -0,0 +1,368 @@
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+  /**
+   * A vptr check emitted by SDUpdateIndices::handleSDGetCheckedVtbl: the
+   * sd_subst_check_* calls of all the ranges, or'ed into the condition of a
+   * single branch to the success block or to the trap block of the function.
+   */
+  struct sd_check_chain_t {
+    BasicBlock* head;               // block holding the checks and the branch
+    BasicBlock* success;            // reached only if the vptr is valid
+    BasicBlock* fail;               // the trap block
+    Value* vptr;                    // checked vptr, casts stripped
+    std::vector<CallInst*> calls;   // the checks in chain order
+    std::vector<std::vector<Value*>> ranges; // sorted (start, width, ...) of each check
+    bool redundant;
+  };
+
+  /**
+   * Removes vptr checks that are implied by an earlier check, runs between
+   * SDUpdateIndices and SDSubstModule while the checks are still intrinsics.
+   *
+   * 1. Checks of a vptr loaded right after a store of a constant vptr (an
+   *    inlined constructor) check the constant, SDSubstModule folds them.
+   * 2. Loop invariant checks that run on every trip through a loop are
+   *    hoisted into the preheader.
+   * 3. Checks dominated by the success block of an identical check of the
+   *    same vptr are removed.
+   */
+  struct SDCheckElim : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    SDCheckElim() : ModulePass(ID) {
+      sdLog::stream() << "Initializing SDCheckElim pass\n";
+      initializeSDCheckElimPass(*PassRegistry::getPassRegistry());
+    }
+
+    bool runOnModule(Module &M) override {
+      sdLog::stream() << "Started SDCheckElim pass ...\n";
+
+      std::map<Function*, std::vector<CallInst*>> checks;
+      collectChecks(M, Intrinsic::sd_subst_check_range, checks);
+      collectChecks(M, Intrinsic::sd_subst_check_bitmap, checks);
+
+      for (auto& it : checks)
+        runOnFunction(*it.first, it.second);
+
+      sdLog::stream() << "SDCheckElim: folded " << numFolded
+                      << ", hoisted " << numHoisted
+                      << ", removed " << numRemoved << " vptr checks\n";
+      sdLog::stream() << "Finished SDCheckElim pass ...\n";
+      return numFolded > 0 || numHoisted > 0 || numRemoved > 0;
+    }
+
+  private:
+    unsigned numFolded = 0;
+    unsigned numHoisted = 0;
+    unsigned numRemoved = 0;
+
+    void collectChecks(Module& M, Intrinsic::ID id,
+                       std::map<Function*, std::vector<CallInst*>>& checks);
+    void runOnFunction(Function& F, const std::vector<CallInst*>& calls);
+    void buildChains(const std::vector<CallInst*>& calls,
+                     std::vector<sd_check_chain_t>& chains);
+    void initChain(sd_check_chain_t& chain);
+    void canonicalizeLoads(Function& F, std::map<Value*, Value*>& canonical);
+    bool foldConstructedVptr(sd_check_chain_t& chain);
+    bool hoistOutOfLoop(Function& F, LoopInfo& LI, DominatorTree& DT,
+                        sd_check_chain_t& chain, sd_check_chain_t& hoisted);
+  };
+} // namespace
+
+char SDCheckElim::ID = 0;
+
+INITIALIZE_PASS(SDCheckElim, "sdCheckElim", "Remove redundant SafeDispatch vptr checks", false, false)
+
+ModulePass* llvm::createSDCheckElimPass() {
+  return new SDCheckElim();
+}
+
+/**
+ * Returns the branch the check decides through a tree of ors, or NULL if it
+ * isn't part of a chain
+ */
+static BranchInst* sd_getCheckBranch(Value* V) {
+  while (V->hasOneUse()) {
+    User* U = *V->user_begin();
+    if (BranchInst* BI = dyn_cast<BranchInst>(U))
+      return (BI->isConditional() && BI->getCondition() == V) ? BI : NULL;
+
+    BinaryOperator* BO = dyn_cast<BinaryOperator>(U);
+    if (!BO || BO->getOpcode() != Instruction::Or)
+      return NULL;
+    V = BO;
+  }
+  return NULL;
+}
+
+void SDCheckElim::collectChecks(Module& M, Intrinsic::ID id,
+                                std::map<Function*, std::vector<CallInst*>>& checks) {
+  Function* checkF = M.getFunction(Intrinsic::getName(id));
+  if (!checkF)
+    return;
+
+  for (const Use &U : checkF->uses()) {
+    CallInst* CI = cast<CallInst>(U.getUser());
+    if (sd_getCheckBranch(CI))
+      checks[CI->getParent()->getParent()].push_back(CI);
+  }
+}
+
+void SDCheckElim::buildChains(const std::vector<CallInst*>& calls,
+                              std::vector<sd_check_chain_t>& chains) {
+  std::vector<BranchInst*> branches;
+  std::map<BranchInst*, std::vector<CallInst*>> checksOf;
+
+  // the checks of one vptr all feed the same branch
+  for (CallInst* CI : calls) {
+    BranchInst* BI = sd_getCheckBranch(CI);
+    if (!checksOf.count(BI))
+      branches.push_back(BI);
+    checksOf[BI].push_back(CI);
+  }
+
+  for (BranchInst* BI : branches) {
+    sd_check_chain_t chain;
+    chain.head = BI->getParent();
+    chain.success = BI->getSuccessor(0);
+    chain.fail = BI->getSuccessor(1);
+    chain.calls = checksOf[BI];
+    initChain(chain);
+    chains.push_back(chain);
+  }
+}
+
+void SDCheckElim::initChain(sd_check_chain_t& chain) {
+  chain.vptr = chain.calls[0]->getArgOperand(0)->stripPointerCasts();
+  chain.redundant = false;
+  chain.ranges.clear();
+
+  for (CallInst* CI : chain.calls) {
+    std::vector<Value*> range;
+    for (unsigned i = 1; i < CI->getNumArgOperands(); i++)
+      range.push_back(CI->getArgOperand(i));
+    range.push_back(CI->getCalledFunction());
+    chain.ranges.push_back(range);
+  }
+  std::sort(chain.ranges.begin(), chain.ranges.end());
+}
+
+/**
+ * Map every vptr load to the first load of the same address in its block
+ * that isn't separated from it by a write to memory.
+ */
+void SDCheckElim::canonicalizeLoads(Function& F, std::map<Value*, Value*>& canonical) {
+  for (BasicBlock& BB : F) {
+    std::map<Value*, LoadInst*> available;
+    for (Instruction& I : BB) {
+      if (LoadInst* LI = dyn_cast<LoadInst>(&I)) {
+        if (LI->isVolatile())
+          continue;
+        Value* addr = LI->getPointerOperand()->stripPointerCasts();
+        auto res = available.insert(std::make_pair(addr, LI));
+        canonical[LI] = res.first->second;
+      } else if (I.mayWriteToMemory()) {
+        available.clear();
+      }
+    }
+  }
+}
+
+/**
+ * If the vptr was loaded right after a constant vptr was stored to the same
+ * address (an inlined constructor), check the constant instead.
+ */
+bool SDCheckElim::foldConstructedVptr(sd_check_chain_t& chain) {
+  LoadInst* LI = dyn_cast<LoadInst>(chain.vptr);
+  if (!LI || LI->isVolatile())
+    return false;
+
+  Value* addr = LI->getPointerOperand()->stripPointerCasts();
+  BasicBlock::iterator it(LI);
+  BasicBlock* BB = LI->getParent();
+
+  while (it != BB->begin()) {
+    --it;
+    if (StoreInst* SI = dyn_cast<StoreInst>(&*it)) {
+      if (SI->getPointerOperand()->stripPointerCasts() != addr)
+        return false;
+
+      Constant* vptr = dyn_cast<Constant>(SI->getValueOperand());
+      if (!vptr || SI->isVolatile())
+        return false;
+
+      Type* Int8PtrTy = chain.calls[0]->getArgOperand(0)->getType();
+      Constant* castVptr = ConstantExpr::getPointerCast(vptr, Int8PtrTy);
+      for (CallInst* CI : chain.calls)
+        CI->setArgOperand(0, castVptr);
+      chain.vptr = vptr->stripPointerCasts();
+      return true;
+    }
+    if (it->mayWriteToMemory())
+      return false;
+  }
+  return false;
+}
+
+/**
+ * Hoist a check of a loop invariant vptr into the loop preheader. The check
+ * has to run before every exit of the loop, so the only difference is
+ * that an invalid vptr traps a bit earlier.
+ */
+bool SDCheckElim::hoistOutOfLoop(Function& F, LoopInfo& LI, DominatorTree& DT,
+                                 sd_check_chain_t& chain, sd_check_chain_t& hoisted) {
+  Loop* L = LI.getLoopFor(chain.head);
+  if (!L || !L->isLoopInvariant(chain.vptr))
+    return false;
+
+  BasicBlock* preheader = L->getLoopPreheader();
+  if (!preheader)
+    return false;
+
+  SmallVector<BasicBlock*, 4> exiting;
+  L->getExitingBlocks(exiting);
+  if (exiting.empty())
+    return false;
+  for (BasicBlock* BB : exiting)
+    if (!DT.dominates(chain.head, BB))
+      return false;
+
+  LLVMContext& C = F.getContext();
+
+  // the new block joins the loops of the preheader
+  BasicBlock* success = SplitBlock(preheader, preheader->getTerminator(), &DT, &LI);
+  success->setName("sd.vptr_check.hoisted");
+  Instruction* oldTerminator = preheader->getTerminator();
+  IRBuilder<> builder(oldTerminator);
+
+  Value* castVptr = builder.CreatePointerCast(chain.vptr, chain.calls[0]->getArgOperand(0)->getType());
+
+  hoisted.calls.clear();
+  Value* valid = NULL;
+  for (CallInst* CI : chain.calls) {
+    std::vector<Value*> args;
+    args.push_back(castVptr);
+    for (unsigned i = 1; i < CI->getNumArgOperands(); i++)
+      args.push_back(CI->getArgOperand(i));
+
+    CallInst* check = builder.CreateCall(CI->getCalledFunction(), args);
+    hoisted.calls.push_back(check);
+    valid = valid ? builder.CreateOr(valid, check) : check;
+  }
+
+  // the trap block of the chain is shared by the whole function, report the
+  // hoisted check like the original one
+  Value* oldVptr = chain.calls[0]->getArgOperand(0);
+  for (Instruction& I : *chain.fail) {
+    PHINode* PN = dyn_cast<PHINode>(&I);
+    if (!PN)
+      break;
+    Value* incoming = PN->getIncomingValueForBlock(chain.head);
+    PN->addIncoming(incoming == oldVptr ? castVptr : incoming, preheader);
+  }
+
+  BranchInst* BI = builder.CreateCondBr(valid, success, chain.fail);
+  MDBuilder MDB(C);
+  BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(
+                                        std::numeric_limits<uint32_t>::max(),
+                                        std::numeric_limits<uint32_t>::min()));
+  oldTerminator->eraseFromParent();
+
+  hoisted.head = preheader;
+  hoisted.success = success;
+  hoisted.fail = chain.fail;
+  initChain(hoisted);
+  return true;
+}
+
+void SDCheckElim::runOnFunction(Function& F, const std::vector<CallInst*>& calls) {
+  std::vector<sd_check_chain_t> chains;
+  buildChains(calls, chains);
+
+  for (sd_check_chain_t& chain : chains)
+    if (foldConstructedVptr(chain))
+      numFolded++;
+
+  // hoisting splits the preheaders, so recompute the dominators afterwards
+  {
+    DominatorTree DT;
+    DT.recalculate(F);
+    LoopInfo LI;
+    LI.Analyze(DT);
+
+    std::set<std::pair<Loop*, std::pair<Value*, std::vector<std::vector<Value*>>>>> done;
+    std::vector<sd_check_chain_t> hoistedChains;
+
+    for (sd_check_chain_t& chain : chains) {
+      if (isa<Constant>(chain.vptr))
+        continue;
+
+      Loop* L = LI.getLoopFor(chain.head);
+      if (!L || !done.insert(std::make_pair(L, std::make_pair(chain.vptr, chain.ranges))).second)
+        continue;
+
+      sd_check_chain_t hoisted;
+      if (hoistOutOfLoop(F, LI, DT, chain, hoisted)) {
+        hoistedChains.push_back(hoisted);
+        numHoisted++;
+        // the preheader branches to the trap block now, SplitBlock only kept
+        // LI up to date
+        DT.recalculate(F);
+      }
+    }
+    chains.insert(chains.begin(), hoistedChains.begin(), hoistedChains.end());
+  }
+
+  DominatorTree DT;
+  DT.recalculate(F);
+  std::map<Value*, Value*> canonical;
+  canonicalizeLoads(F, canonical);
+
+  // group the chains by (vptr, ranges), then drop the ones dominated by the
+  // success block of another chain of the same group
+  std::map<std::pair<Value*, std::vector<std::vector<Value*>>>, std::vector<sd_check_chain_t*>> groups;
+  for (sd_check_chain_t& chain : chains) {
+    Value* vptr = canonical.count(chain.vptr) ? canonical[chain.vptr] : chain.vptr;
+    groups[std::make_pair(vptr, chain.ranges)].push_back(&chain);
+  }
+
+  LLVMContext& C = F.getContext();
+  for (auto& group : groups) {
+    std::vector<sd_check_chain_t*>& members = group.second;
+    for (sd_check_chain_t* chain : members) {
+      for (sd_check_chain_t* other : members) {
+        if (other == chain || other->redundant ||
+            !DT.dominates(other->success, chain->head))
+          continue;
+
+        chain->redundant = true;
+        for (CallInst* CI : chain->calls) {
+          CI->replaceAllUsesWith(ConstantInt::getTrue(C));
+          CI->eraseFromParent();
+        }
+        numRemoved++;
+        break;
+      }
+    }
+  }
+}
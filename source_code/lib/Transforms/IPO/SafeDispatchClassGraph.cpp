@@ -0,0 +1,83 @@
+#include "llvm/Transforms/IPO/SafeDispatchClassGraph.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+// std::vector::resize takes it by reference
+const uint32_t SDClassGraph::InvalidID;
+
+SDClassGraph::class_id_t SDClassGraph::internClass(StringRef name) {
+  auto res = classIDs.insert(std::make_pair(name, (class_id_t) classNames.size()));
+  if (res.second) {
+    classNames.push_back(name.str());
+    classNodes.push_back(std::vector<node_id_t>());
+  }
+  return res.first->second;
+}
+
+SDClassGraph::node_id_t SDClassGraph::internNode(StringRef name, uint64_t ind) {
+  assert(!finalized && "graph is already frozen");
+  class_id_t c = internClass(name);
+
+  std::vector<node_id_t> &nodes = classNodes[c];
+  if (ind >= nodes.size())
+    nodes.resize(ind + 1, InvalidID);
+
+  if (nodes[ind] == InvalidID) {
+    nodes[ind] = keys.size();
+    keys.push_back(vtbl_t(classNames[c], ind));
+    nodeClass.push_back(c);
+  }
+  return nodes[ind];
+}
+
+void SDClassGraph::buildCSR(bool byParent, std::vector<uint32_t> &offsets,
+                            std::vector<node_id_t> &index) const {
+  offsets.assign(numNodes() + 1, 0);
+  index.resize(edges.size());
+
+  for (auto &e : edges)
+    offsets[(byParent ? e.first : e.second) + 1]++;
+
+  for (unsigned n = 0; n < numNodes(); n++)
+    offsets[n + 1] += offsets[n];
+
+  std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+  for (auto &e : edges)
+    index[fill[byParent ? e.first : e.second]++] = byParent ? e.second : e.first;
+
+  // keep the (vtbl, ind) order of the old std::set based maps
+  for (unsigned n = 0; n < numNodes(); n++) {
+    std::sort(index.begin() + offsets[n], index.begin() + offsets[n + 1],
+              [this](node_id_t a, node_id_t b) { return keys[a] < keys[b]; });
+  }
+}
+
+void SDClassGraph::finalize() {
+  assert(!finalized && "graph is already frozen");
+
+  std::sort(edges.begin(), edges.end());
+  edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+  buildCSR(true, childOffsets, childIndex);
+  buildCSR(false, parentOffsets, parentIndex);
+
+  edges.clear();
+  edges.shrink_to_fit();
+  finalized = true;
+}
+
+void SDClassGraph::clear() {
+  classIDs.clear();
+  classNames.clear();
+  classNodes.clear();
+  keys.clear();
+  nodeClass.clear();
+  edges.clear();
+  childOffsets.clear();
+  childIndex.clear();
+  parentOffsets.clear();
+  parentIndex.clear();
+  finalized = false;
+}
@@ -18,6 +18,7 @@ namespace {
 
       handleSDGetVtblIndex(&M);
       handleSDGetCheckedVtbl(&M);
+      handleSDGetCheckedVtbls(&M);
       handleRemainingSDGetVcallIndex(&M);
       sdLog::stream() << "Finished SDCleanup pass ...\n";
       return true;
@@ -26,6 +27,7 @@ namespace {
   private:
     void handleSDGetVtblIndex(Module* M);
     void handleSDGetCheckedVtbl(Module* M);
+    void handleSDGetCheckedVtbls(Module* M);
     void handleRemainingSDGetVcallIndex(Module* M);
   };
 } // namespace
@@ -68,6 +70,25 @@ void SDCleanup::handleSDGetCheckedVtbl(Module* M) {
   sdLog::stream() << "Replaced " << counter << " sd.get.checked.vptr intrinsics.\n";
 }
 
+void SDCleanup::handleSDGetCheckedVtbls(Module* M) {
+  // overloaded, one declaration per vector type
+  std::vector<CallInst*> calls;
+  for (Function &F : *M) {
+    if (F.getIntrinsicID() != Intrinsic::sd_get_checked_vptrs)
+      continue;
+    for (const Use &U : F.uses())
+      calls.push_back(cast<CallInst>(U.getUser()));
+  }
+
+  for (CallInst* CI : calls) {
+    CI->replaceAllUsesWith(CI->getArgOperand(0));
+    CI->eraseFromParent();
+  }
+
+  if (!calls.empty())
+    sdLog::stream() << "Replaced " << calls.size() << " sd.get.checked.vptrs intrinsics.\n";
+}
+
 void SDCleanup::handleRemainingSDGetVcallIndex(Module* M) {
   Function *sd_vcall_indexF = M->getFunction(Intrinsic::getName(Intrinsic::sd_get_vcall_index));
 
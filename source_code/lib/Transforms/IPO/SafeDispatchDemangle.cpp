@@ -0,0 +1,83 @@
+#include "llvm/Transforms/IPO/SafeDispatchDemangle.h"
+
+#include "llvm/Demangle/Demangle.h"
+
+#include <cstring>
+#include <string>
+#include <utility>
+
+using namespace llvm;
+
+/**
+ * ns::A::foo(int) -> ns::A. The base name is the last name component in
+ * front of the parameter list or template arguments; a return type in front
+ * of the name (function templates) is dropped.
+ */
+static StringRef sd_splitQualifier(StringRef full, StringRef baseName) {
+  std::string sep = "::" + baseName.str();
+  for (size_t pos = full.find(sep); pos != StringRef::npos; pos = full.find(sep, pos + 1)) {
+    size_t end = pos + sep.size();
+    if (end != full.size() && full[end] != '(' && full[end] != '<' && full[end] != ' ')
+      continue;
+
+    StringRef qualifier = full.substr(0, pos);
+    int depth = 0;
+    for (size_t i = 0; i < qualifier.size(); i++) {
+      char c = qualifier[i];
+      if (c == '<' || c == '(')
+        depth++;
+      else if ((c == '>' || c == ')') && depth > 0)
+        depth--;
+      else if (c == ' ' && depth == 0)
+        return qualifier.substr(i + 1);
+    }
+    return qualifier;
+  }
+  return StringRef();
+}
+
+StringRef SDDemangleCache::intern(StringRef str) {
+  if (str.empty())
+    return StringRef();
+  char *mem = strings.Allocate<char>(str.size());
+  memcpy(mem, str.data(), str.size());
+  return StringRef(mem, str.size());
+}
+
+const SDDemangleCache::entry_t &SDDemangleCache::lookup(StringRef mangled) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto itr = entries.find(mangled);
+    if (itr != entries.end())
+      return itr->second;
+  }
+
+  // demangle without holding the lock, another thread may get the same name
+  // in the meantime, the first result is kept (itaniumDemanglePair only sets
+  // status on failure)
+  int status = 0;
+  std::pair<std::string, std::string> demangledPair;
+  if (mangled.startswith("_"))
+    demangledPair = itaniumDemanglePair(mangled, status);
+
+  std::lock_guard<std::mutex> guard(lock);
+  auto res = entries.insert(std::make_pair(mangled, entry_t()));
+  entry_t &entry = res.first->second;
+  if (!res.second)
+    return entry;
+
+  misses++;
+  if (status == 0 && demangledPair.second != "") {
+    entry.demangled = true;
+    entry.full = intern(demangledPair.first);
+    entry.baseName = intern(demangledPair.second);
+    entry.qualifier = sd_splitQualifier(entry.full, entry.baseName);
+  } else {
+    // StringMap entries do not move, so the key can be handed out
+    entry.demangled = false;
+    entry.full = res.first->getKey();
+    entry.baseName = res.first->getKey();
+    entry.qualifier = StringRef();
+  }
+  return entry;
+}
@@ -14,6 +14,10 @@
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/CallSite.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/ProfileData/SampleProfReader.h"
 
 #include "llvm/Transforms/IPO/SafeDispatchLayoutBuilder.h"
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
@@ -21,12 +25,17 @@
 
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/IPO/SafeDispatchMD.h"
+#include "llvm/Transforms/IPO/SafeDispatchTools.h"
 
 #include <list>
 #include <vector>
 #include <set>
 #include <map>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 #include <llvm/Transforms/IPO/SafeDispatchLogStream.h>
 
 // you have to modify the following 4 files for each additional LLVM pass
@@ -43,6 +52,31 @@ using namespace llvm;
 #define NEW_VTHUNK_NAME(fun,parent) ("_SVT" + parent + fun->getName().str())
 #define GEP_OPCODE      29
 
+static cl::opt<unsigned> SDLayoutThreads("sd-layout-threads",
+    cl::desc("Number of threads computing the SafeDispatch cloud layouts "
+             "(0 = one per core)"),
+    cl::init(1));
+
+static cl::opt<std::string> SDLayoutProfile("sd-layout-profile",
+    cl::desc("Instrumentation or sample profile used to put the hot vtables "
+             "of a cloud next to each other"),
+    cl::init(""));
+
+static cl::opt<bool> SDEmitRangeTable("sd-range-table",
+    cl::desc("Export the vptr ranges of the module for the cross-DSO checks "
+             "of libdlcfi"),
+    cl::init(true));
+
+static cl::opt<bool> SDLayoutMinPadding("sd-layout-min-padding",
+    cl::desc("Pick the alignment of each ordered cloud that minimizes padding "
+             "plus range checks instead of the one of its largest vtable"),
+    cl::init(false));
+
+static cl::opt<unsigned> SDLayoutRangeCost("sd-layout-range-cost",
+    cl::desc("Bytes of padding one additional range check is worth "
+             "(used by -sd-layout-min-padding)"),
+    cl::init(64));
+
 char SDLayoutBuilder::ID = 0;
 
 INITIALIZE_PASS_BEGIN(SDLayoutBuilder, "sdovt", "Oredered VTable Layout Builder for SafeDispatch", false, false)
@@ -415,7 +449,8 @@ The ordering can be shut down and it is not dependent of
 the interleaving operation. It orders each v table
 one by one.
 */
-void SDLayoutBuilder::orderCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
+void SDLayoutBuilder::orderCloud(const SDLayoutBuilder::vtbl_name_t& vtbl, cloud_layout_t& layout,
+                                 raw_ostream& log) {
   sd_print("Started ordering for vtable: %s ...\n", vtbl.c_str());
 
   /*Paul:
@@ -449,40 +484,117 @@ void SDLayoutBuilder::orderCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
 
   assert((max & (max-1)) == 0 && "max is not a power of 2");
 
-  alignmentMap[vtbl] = max * WORD_WIDTH;
+  std::vector<int64_t> slots;
+  padOrderedCloud(pre, max, orderedVtbl, slots, log);
+  layout.baseSize = layout.paddedSize = orderedVtbl.size();
+  layout.baseNumMemRanges = layout.numMemRanges = countOrderedMemRanges(pre, slots, layout.ranges);
+
+  // A single large vtable forces its alignment on the whole cloud. A
+  // smaller stride lets it span several slots instead, at the price of
+  // splitting the ranges that cover it, so try every smaller power of 2.
+  if (SDLayoutMinPadding) {
+    uint64_t bestCost = layout.paddedSize * WORD_WIDTH + SDLayoutRangeCost * layout.numMemRanges;
+
+    for (uint64_t stride = max / 2; stride >= 1; stride /= 2) {
+      interleaving_vec_t candidate;
+      padOrderedCloud(pre, stride, candidate, slots, log);
+      uint64_t numMemRanges = countOrderedMemRanges(pre, slots, layout.ranges);
+      uint64_t cost = candidate.size() * WORD_WIDTH + SDLayoutRangeCost * numMemRanges;
+
+      if (cost < bestCost) {
+        bestCost = cost;
+        max = stride;
+        orderedVtbl.swap(candidate);
+        layout.paddedSize = orderedVtbl.size();
+        layout.numMemRanges = numMemRanges;
+      }
+    }
+
+    sd_print("Cloud %s: stride %lu, %lu -> %lu entries, %lu -> %lu ranges\n", vtbl.c_str(), max,
+             layout.baseSize, layout.paddedSize, layout.baseNumMemRanges, layout.numMemRanges);
+  }
 
-  //sd_print("ALIGNMENT: %s, %u\n", vtbl.data(), max*WORD_WIDTH);
+  layout.alignment = max * WORD_WIDTH;
 
-  for(const vtbl_t child : pre) {
+  // store the new ordered vtable
+  layout.interleaving = interleaving_list_t(orderedVtbl.begin(), orderedVtbl.end());
+  
+  sd_print("Finishing ordering for vtable: %s ...\n", vtbl.c_str());
+}
+
+/*Paul:
+put the vtables of the cloud one after the other in preorder and insert
+dummy entries so that every address point lands on a stride boundary*/
+void SDLayoutBuilder::padOrderedCloud(const order_t& pre, uint64_t stride,
+                                      interleaving_vec_t& ordered, std::vector<int64_t>& slots,
+                                      raw_ostream& log) {
+  ordered.clear();
+  slots.assign(pre.size(), -1);
+
+  for (uint64_t i = 0; i < pre.size(); i++) {
+    const vtbl_t &child = pre[i];
     if(cha->isUndefined(child.first))
       continue;
 
     const range_t &r = cha->getRange(child);
     uint64_t size = r.second - r.first + 1;
     uint64_t addrpt = cha->addrPt(child) - r.first;
-    uint64_t padEntries = orderedVtbl.size() + addrpt;
-    uint64_t padSize = (padEntries % max == 0) ? 0 : max - (padEntries % max);
+    uint64_t padEntries = ordered.size() + addrpt;
+    uint64_t padSize = (padEntries % stride == 0) ? 0 : stride - (padEntries % stride);
 
-    for(unsigned i=0; i<padSize; i++) {
-      if (orderedVtbl.size() % max == 0 && orderedVtbl.size() != 0) {
-        std::cerr << "dummy entry is " << max << " aligned in cloud " << vtbl << std::endl;
-      }
-      orderedVtbl.push_back(interleaving_t(dummyVtable,0));
+    for(unsigned j=0; j<padSize; j++) {
+      if (ordered.size() % stride == 0 && ordered.size() != 0)
+        log << "dummy entry is " << stride << " aligned\n";
+      ordered.push_back(interleaving_t(dummyVtable,0));
     }
 
-    for(unsigned i=0; i<size; i++) {
-      orderedVtbl.push_back(interleaving_t(child, r.first + i));
+    slots[i] = (ordered.size() + addrpt) / stride;
+
+    for(unsigned j=0; j<size; j++) {
+      ordered.push_back(interleaving_t(child, r.first + j));
     }
   }
+}
 
-  // store the new ordered vtable
-  interleavingMap[vtbl] = interleaving_list_t(orderedVtbl.begin(), orderedVtbl.end());
-  
-  sd_print("Finishing ordering for vtable: %s ...\n", vtbl.c_str());
+/*Paul:
+count the memory ranges calculateMemRanges() will emit for this layout: one
+per run of defined vtables sitting in consecutive slots*/
+uint64_t SDLayoutBuilder::countOrderedMemRanges(const order_t& pre, const std::vector<int64_t>& slots,
+                                                const range_map_t& ranges) {
+  uint64_t n = pre.size();
+
+  // breaks[i]: number of defined vtables in [0,i) that do not directly follow
+  // the previous defined one, nextDefined[i]: first defined vtable at or after i
+  std::vector<uint64_t> breaks(n + 1, 0);
+  std::vector<uint64_t> nextDefined(n + 1, n);
+  int64_t prevSlot = -1;
+
+  for (uint64_t i = 0; i < n; i++) {
+    bool brk = slots[i] != -1 && prevSlot != -1 && slots[i] != prevSlot + 1;
+    breaks[i + 1] = breaks[i] + (brk ? 1 : 0);
+    if (slots[i] != -1)
+      prevSlot = slots[i];
+  }
+  for (uint64_t i = n; i-- > 0;)
+    nextDefined[i] = slots[i] != -1 ? i : nextDefined[i + 1];
+
+  uint64_t count = 0;
+  for (const vtbl_t &node : pre) {
+    auto it = ranges.find(node);
+    if (it == ranges.end())
+      continue;
+
+    for (const range_t &range : it->second) {
+      uint64_t first = nextDefined[range.first];
+      if (first < range.second)
+        count += 1 + breaks[range.second] - breaks[first + 1];
+    }
+  }
+  return count;
 }
 
 //check if v table lies in class or v table path inheritance
-bool checkVTablePath(SDLayoutBuilder::vtbl_name_t& vtbl){
+bool checkVTablePath(const SDLayoutBuilder::vtbl_name_t& vtbl){
   //TODO, for now return true 
   
   return true;
@@ -492,7 +604,7 @@ bool checkVTablePath(SDLayoutBuilder::vtbl_name_t& vtbl){
 // we need to check inside the interleaving
 // method for each vtbl if it lies in the class
 // or v table inheritance path
-void SDLayoutBuilder::interleaveCloudNew(SDLayoutBuilder::vtbl_name_t& vtbl) {
+void SDLayoutBuilder::interleaveCloudNew(const SDLayoutBuilder::vtbl_name_t& vtbl, cloud_layout_t& layout) {
   
   // skyp v tables that do not belong
   // to the class or vtbl path of inheritance
@@ -561,14 +673,14 @@ void SDLayoutBuilder::interleaveCloudNew(SDLayoutBuilder::vtbl_name_t& vtbl) {
         uint64_t childEnd    = childRange.second;
         uint64_t childAddrPt = cha->addrPt(*child);
 
-        uint64_t parentPreAddrPt = parentAddrPt - parentStart + prePadMap[parent];
-        uint64_t childPreAddrPt  = childAddrPt  - childStart  + prePadMap[*child];
+        uint64_t parentPreAddrPt = parentAddrPt - parentStart + layout.prePad[parent];
+        uint64_t childPreAddrPt  = childAddrPt  - childStart  + layout.prePad[*child];
 
         //Paul: the prepad value for the child is eath the 
         //difference between parent (prepad address point) and of the child (prepad address point) 
         // or the old value contained in the child 
-        prePadMap[*child] = (parentPreAddrPt > childPreAddrPt ?
-                             parentPreAddrPt - childPreAddrPt : prePadMap[*child]);
+        layout.prePad[*child] = (parentPreAddrPt > childPreAddrPt ?
+                                 parentPreAddrPt - childPreAddrPt : layout.prePad[*child]);
     }
     sd_print("Parent %d name: %s has %d children ...\n", numParent, parent.first.c_str(), numChildrenPerParent);
   }
@@ -576,17 +688,17 @@ void SDLayoutBuilder::interleaveCloudNew(SDLayoutBuilder::vtbl_name_t& vtbl) {
   sd_print("Total number of parents %d...\n", numParent);
 
   // initialize the cloud's interleaving list
-  interleavingMap[vtbl] = interleaving_list_t();
+  layout.interleaving = interleaving_list_t();
 
   // fill the negative part of the interleaving map 
-  fillVtablePart(interleavingMap[vtbl], preorderNodeSet, false); //Paul: one time with false, negative part
+  fillVtablePart(layout.interleaving, preorderNodeSet, false, layout.prePad); //Paul: one time with false, negative part
   
   // fill the positive part of the interleaving map 
-  fillVtablePart(positive_list_Part, preorderNodeSet, true);     //Paul: one time with true , positive part
+  fillVtablePart(positive_list_Part, preorderNodeSet, true, layout.prePad);   //Paul: one time with true , positive part
 
   // append the positive part to the negative part in the interleaving map 
-  interleavingMap[vtbl].insert(interleavingMap[vtbl].end(), positive_list_Part.begin(), positive_list_Part.end());
-  alignmentMap[vtbl] = WORD_WIDTH;
+  layout.interleaving.insert(layout.interleaving.end(), positive_list_Part.begin(), positive_list_Part.end());
+  layout.alignment = WORD_WIDTH;
   
   sd_print("Finishing Interleaving for v table %s...\n", vtbl.c_str());
 }
@@ -597,7 +709,7 @@ this function is used to interleave the cloud.
 The interleaving can be shut down and it is not dependent of
 the ordering operation from above
 */
-void SDLayoutBuilder::interleaveCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
+void SDLayoutBuilder::interleaveCloud(const SDLayoutBuilder::vtbl_name_t& vtbl, cloud_layout_t& layout) {
   sd_print("Started Interleaving for v table %s...\n", vtbl.c_str());
   
   /*Paul:
@@ -660,14 +772,14 @@ void SDLayoutBuilder::interleaveCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
         uint64_t childEnd    = childRange.second;
         uint64_t childAddrPt = cha->addrPt(*child);
 
-        uint64_t parentPreAddrPt = parentAddrPt - parentStart + prePadMap[parent];
-        uint64_t childPreAddrPt  = childAddrPt  - childStart  + prePadMap[*child];
+        uint64_t parentPreAddrPt = parentAddrPt - parentStart + layout.prePad[parent];
+        uint64_t childPreAddrPt  = childAddrPt  - childStart  + layout.prePad[*child];
 
         //Paul: the prepad value for the child is eath the 
         //difference between parent (prepad address point) and of the child (prepad address point) 
         // or the old value contained in the child 
-        prePadMap[*child] = (parentPreAddrPt > childPreAddrPt ?
-                             parentPreAddrPt - childPreAddrPt : prePadMap[*child]);
+        layout.prePad[*child] = (parentPreAddrPt > childPreAddrPt ?
+                                 parentPreAddrPt - childPreAddrPt : layout.prePad[*child]);
     }
     sd_print("Parent %d has %d children ...\n", numParent, numChildrenPerParent);
   }
@@ -675,17 +787,17 @@ void SDLayoutBuilder::interleaveCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
   sd_print("Total number of parents %d...\n", numParent);
 
   // initialize the cloud's interleaving list
-  interleavingMap[vtbl] = interleaving_list_t();
+  layout.interleaving = interleaving_list_t();
 
   // fill the negative part of the interleaving map 
-  fillVtablePart(interleavingMap[vtbl], preorderNodeSet, false); //Paul: one time with false, negative part
+  fillVtablePart(layout.interleaving, preorderNodeSet, false, layout.prePad); //Paul: one time with false, negative part
   
   // fill the positive part of the interleaving map 
-  fillVtablePart(positive_list_Part, preorderNodeSet, true);     //Paul: one time with true , positive part
+  fillVtablePart(positive_list_Part, preorderNodeSet, true, layout.prePad);   //Paul: one time with true , positive part
 
   // append the positive part to the negative part in the interleaving map 
-  interleavingMap[vtbl].insert(interleavingMap[vtbl].end(), positive_list_Part.begin(), positive_list_Part.end());
-  alignmentMap[vtbl] = WORD_WIDTH;
+  layout.interleaving.insert(layout.interleaving.end(), positive_list_Part.begin(), positive_list_Part.end());
+  layout.alignment = WORD_WIDTH;
   
   sd_print("Finishing Interleaving for v table %s...\n", vtbl.c_str());
 }
@@ -694,22 +806,20 @@ void SDLayoutBuilder::interleaveCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
 calculate the new layout indices. The new indices are just counting 
 how many v tables are contained in the interleavingMap per each v table 
 */
-void SDLayoutBuilder::calculateNewLayoutInds(SDLayoutBuilder::vtbl_name_t& vtbl){
+void SDLayoutBuilder::calculateNewLayoutInds(const SDLayoutBuilder::vtbl_name_t& vtbl, cloud_layout_t& layout){
   
-  //assert map is not empty 
-  assert(interleavingMap.count(vtbl));
-  sd_print("v table: %s has in the interleaving map: %d v tables \n", 
-  vtbl.c_str(), interleavingMap.count(vtbl));
+  sd_print("v table: %s has in the interleaving map: %d elements \n", 
+  vtbl.c_str(), layout.interleaving.size());
 
   uint64_t currentIndex = 0;
  
   //Paul: the interleaving map was computed in the ordering or interleaving algoritm 
-  for (const interleaving_t& ivtbl : interleavingMap[vtbl]) {
+  for (const interleaving_t& ivtbl : layout.interleaving) {
     
     sd_print("NewLayoutInds for vtable (%s, %d)\n", ivtbl.first.first.c_str(), ivtbl.first.second);
     if(ivtbl.first != dummyVtable) {//Paul: do not count dummy v tables
       // record the new index of the vtable element coming from the current vtable
-      newLayoutInds[ivtbl.first].push_back(currentIndex++);
+      layout.newLayoutInds[ivtbl.first].push_back(currentIndex++);
     } else {
       currentIndex++;
     }
@@ -720,7 +830,8 @@ void SDLayoutBuilder::calculateNewLayoutInds(SDLayoutBuilder::vtbl_name_t& vtbl)
 this is a helper function for the v pointer range calculator 
 Here the v pointer ranges get coalesced 
 */
-void SDLayoutBuilder::calculateVPtrRangesHelper(const SDLayoutBuilder::vtbl_t& vtbl, std::map<vtbl_t, uint64_t> &indMap){
+void SDLayoutBuilder::calculateVPtrRangesHelper(const SDLayoutBuilder::vtbl_t& vtbl, std::map<vtbl_t, uint64_t> &indMap,
+                                                range_map_t& rangeMap, raw_ostream& log){
   // Already computed
   if (rangeMap.find(vtbl) != rangeMap.end())
     return;
@@ -728,7 +839,7 @@ void SDLayoutBuilder::calculateVPtrRangesHelper(const SDLayoutBuilder::vtbl_t& v
   //iterate trough all children of this v table and do recursive call 
   for (auto childIt = cha->children_begin(vtbl); childIt != cha->children_end(vtbl); childIt++) {
     const vtbl_t &child = *childIt;
-    calculateVPtrRangesHelper(child, indMap);
+    calculateVPtrRangesHelper(child, indMap, rangeMap, log);
   }
   
   //declare a range vector 
@@ -771,44 +882,41 @@ void SDLayoutBuilder::calculateVPtrRangesHelper(const SDLayoutBuilder::vtbl_t& v
     coalesced_ranges.push_back(range_t(start,end));
   
   //print the ranges 
-  sdLog::log() << "Range for: {" << vtbl.first << "," << vtbl.second << "} From ranges [";
+  log << "Range for: {" << vtbl.first << "," << vtbl.second << "} From ranges [";
   for (auto it : ranges)
-    sdLog::log() << "(" << it.first << "," << it.second << "),";
+    log << "(" << it.first << "," << it.second << "),";
 
-  sdLog::log() << "] coalesced [";
+  log << "] coalesced [";
   for (auto it : coalesced_ranges)
-    sdLog::log() << "(" << it.first << "," << it.second << "),";
+    log << "(" << it.first << "," << it.second << "),";
 
-  sdLog::log() << "]\n";
+  log << "]\n";
   
   rangeMap[vtbl] = coalesced_ranges;
 }
 
 /*Paul:
 final step of the Layout builder analysis is to check that ranges are disjoint*/
-void SDLayoutBuilder::verifyVPtrRanges(SDLayoutBuilder::vtbl_name_t& vtbl){
+void SDLayoutBuilder::verifyVPtrRanges(const SDLayoutBuilder::vtbl_name_t& vtbl, range_map_t& rangeMap){
   SDLayoutBuilder::vtbl_t root(vtbl, 0);
   
   //get the nodes in preordering for this top root node 
   order_t pre = cha->preorder(root);
   std::map<vtbl_t, uint64_t> indMap;
-  std::map<vtbl_t, order_t> descendantsMap;
 
   for (uint64_t i = 0; i < pre.size(); i++) {
     //set the indexes 
     indMap[pre[i]] = i;
-
-    //set the descendents map, this are the descendant nodes in prorder 
-    descendantsMap[pre[i]] = cha->preorder(pre[i]); //each element is an order_t == std::vector<vtbl_t>
   }
   
-  //iterate through the descendens map and check that ranges are dijoint 
-  for (auto descendantVector : descendantsMap) {
+  //iterate through the nodes and check that ranges are dijoint 
+  for (const vtbl_t& node : pre) {
+    const std::vector<range_t>& ranges = rangeMap[node];
     uint64_t totalRange = 0;
     int64_t lastEnd = -1;
 
     // Check that ranges are disjoint, they do not overlap at all
-    for (auto range : rangeMap[descendantVector.first]) {
+    for (auto range : ranges) {
       //sum ranges up
       totalRange += range.second - range.first;
 
@@ -818,13 +926,22 @@ void SDLayoutBuilder::verifyVPtrRanges(SDLayoutBuilder::vtbl_name_t& vtbl){
     }
 
     // Sum of ranges length equals the total number of descendants
-    assert(totalRange == descendantVector.second.size());
+    assert(totalRange == cha->getSubtreeSize(node));
 
     // check that each descendent is in one of the ranges.
-    for (auto descendantElement : descendantVector.second) {
+    if (cha->hasExactSubtree(node) && cha->getAncestor(node) == vtbl) {
+      // the descendants are the [first, first + size) slice of pre, so
+      // disjoint ranges of the same total size must lie inside of it
+      uint64_t first = cha->getPreorderIndex(node);
+      for (auto range : ranges)
+        assert(first <= range.first && range.second <= first + totalRange);
+      continue;
+    }
+
+    for (auto descendantElement : cha->preorder(node)) {
       uint64_t index = indMap[descendantElement];
       bool found = false;
-      for (auto range : rangeMap[descendantVector.first]) {
+      for (auto range : ranges) {
         //check that index is between range.first and range.second  
         if (range.first <= index && index < range.second) {
           found = true;
@@ -851,7 +968,8 @@ const std::vector<SDLayoutBuilder::mem_range_t>& SDLayoutBuilder::getMemRange(co
 /*Paul:
 calculate the v pointer ranges which will be used to constrain each
 v call site*/
-void SDLayoutBuilder::calculateVPtrRanges(Module& M, SDLayoutBuilder::vtbl_name_t& vtbl){
+void SDLayoutBuilder::calculateVPtrRanges(const SDLayoutBuilder::vtbl_name_t& vtbl, range_map_t& ranges,
+                                          raw_ostream& log){
   SDLayoutBuilder::vtbl_t root(vtbl, 0); // Paul: declare a v table with name vtbl and index 0
 
   //Paul: nodes in preorder for one each root node one by one
@@ -860,7 +978,7 @@ void SDLayoutBuilder::calculateVPtrRanges(Module& M, SDLayoutBuilder::vtbl_name_
   //print preorder nodes of one root node 
   sd_print("\ncalculateVPtrRanges: Preorder nodes of root %s are: \n", vtbl.c_str());
   for (uint64_t i= 0; i < preorderV.size(); i++)
-    sdLog::log() << "first: " << preorderV[i].first << ", second: " << preorderV[i].second << "\n";
+    log << "first: " << preorderV[i].first << ", second: " << preorderV[i].second << "\n";
 
   std::map<vtbl_t, uint64_t> indMap;
 
@@ -869,7 +987,22 @@ void SDLayoutBuilder::calculateVPtrRanges(Module& M, SDLayoutBuilder::vtbl_name_
       indMap[preorderV[i]] = i;
   
   //coalesce ranges, mix them together 
-  calculateVPtrRangesHelper(root, indMap);
+  calculateVPtrRangesHelper(root, indMap, ranges, log);
+}
+
+/*Paul:
+turn the preorder ranges of the cloud into (start address, width) pairs*/
+void SDLayoutBuilder::calculateMemRanges(Module& M, SDLayoutBuilder::vtbl_name_t& vtbl){
+  order_t preorderV = cha->preorder(vtbl_t(vtbl, 0)); 
+
+  // the checks step through the cloud alignment by alignment, so a vtable that
+  // spans several slots (see -sd-layout-min-padding) ends a memory range
+  assert(alignmentMap.count(vtbl));
+  uint64_t stride = std::max<uint64_t>(alignmentMap[vtbl] / WORD_WIDTH, 1);
+  auto slotOf = [&](const vtbl_t& v) {
+    unsigned addrPt = cha->addrPt(v) - cha->getRange(v).first;
+    return newLayoutInds[v][addrPt] / stride;
+  };
  
   //Paul: iterate through all the nodes for this root 
   //and print the ranges 
@@ -909,7 +1042,22 @@ void SDLayoutBuilder::calculateVPtrRanges(Module& M, SDLayoutBuilder::vtbl_name_
     
       // Paul: for each node a memory range will be added to the map and 
       // and a definition count will be icremented and added. Add to the memRangeMap. 
-      memRangeMap[preorderV[i]].push_back(mem_range_t(newVtblAddressConst(M, preorderV[start]), def_count));
+      // Runs of vtables in consecutive slots each get their own memory range.
+      uint64_t runStart = start, runCount = 0, lastSlot = 0;
+      for (uint64_t j = start; j < end; j++) {
+        if (cha->isUndefined(preorderV[j]))
+          continue;
+
+        uint64_t slot = slotOf(preorderV[j]);
+        if (runCount && slot != lastSlot + 1) {
+          memRangeMap[preorderV[i]].push_back(mem_range_t(newVtblAddressConst(M, preorderV[runStart]), runCount));
+          runStart = j;
+          runCount = 0;
+        }
+        lastSlot = slot;
+        runCount++;
+      }
+      memRangeMap[preorderV[i]].push_back(mem_range_t(newVtblAddressConst(M, preorderV[runStart]), runCount));
     }
     sdLog::log() << "\n";
   }
@@ -940,10 +1088,10 @@ void SDLayoutBuilder::createNewVTable(Module& M, SDLayoutBuilder::vtbl_name_t& v
 
   //iterate throught the interleaving list for the given v table 
   for (const interleaving_t& ivtbl : newVtbl) {
-    const range_t &vrange = cha->getRange(ivtbl.first);
-
-    //if v table is undefined or is a dummy table or vtable second < vrange first 
-    if (cha->isUndefined(ivtbl.first.first) || ivtbl.first == dummyVtable || ivtbl.second < vrange.first) {
+    //if v table is undefined or is a dummy table or vtable second < vrange first
+    //(the dummy padding vtable has no range, so test it first)
+    if (cha->isUndefined(ivtbl.first.first) || ivtbl.first == dummyVtable ||
+        ivtbl.second < cha->getRange(ivtbl.first).first) {
 
       //add a new null value into new V table elements 
       newVtableElems.push_back(Constant::getNullValue(IntegerType::getInt8PtrTy(Context)));
@@ -1129,7 +1277,8 @@ static bool sd_isGE(int64_t lhs, int64_t rhs) { return lhs >= rhs; }
 //after the interleaving was performed 
 void SDLayoutBuilder::fillVtablePart(SDLayoutBuilder::interleaving_list_t& vtblPartList, 
                                               const SDLayoutBuilder::order_t& nodesInPreorder, 
-                                                                    bool positivePartOn_Off) {
+                                                                    bool positivePartOn_Off,
+                                                         SDLayoutBuilder::pad_map_t& prePad) {
   std::map<vtbl_t, int64_t> posMap;     // current position
   std::map<vtbl_t, int64_t> lastPosMap; // last possible position
  
@@ -1139,7 +1288,7 @@ void SDLayoutBuilder::fillVtablePart(SDLayoutBuilder::interleaving_list_t& vtblP
     uint64_t addrPt = cha->addrPt(n);  // get the address point of the vtable
     const range_t &r = cha->getRange(n); // get the range (start & end address) of that particular v table 
     posMap[n]     = positivePartOn_Off ? addrPt : (addrPt - 1); // position map = addrPt or addrPt - 1
-    lastPosMap[n] = positivePartOn_Off ? r.second : (r.first - prePadMap[n]); //set last position map 
+    lastPosMap[n] = positivePartOn_Off ? r.second : (r.first - prePad[n]); //set last position map 
   }
 
   interleaving_list_t current; // interleaving of one element
@@ -1394,6 +1543,69 @@ Constant* SDLayoutBuilder::newVtblAddressConst(Module& M, const vtbl_t& vtbl) {
   return gvOffInt;
 }
 
+/**
+ * Read the execution count of every function from an indexed instrumentation
+ * profile (entry counts) or, failing that, from a sample profile (head samples
+ * plus the indirect call targets recorded in the callers).
+ */
+static bool sd_readFunctionCounts(Module &M, StringRef path, StringMap<uint64_t> &counts) {
+  auto instrOrErr = InstrProfReader::create(path);
+  if (instrOrErr) {
+    for (const InstrProfRecord &record : **instrOrErr) {
+      if (!record.Counts.empty())
+        counts[record.Name] += record.Counts[0];
+    }
+    return !(*instrOrErr)->hasError();
+  }
+
+  auto sampleOrErr = sampleprof::SampleProfileReader::create(path, M.getContext());
+  if (!sampleOrErr || (*sampleOrErr)->read())
+    return false;
+
+  for (auto &it : (*sampleOrErr)->getProfiles()) {
+    const sampleprof::FunctionSamples &samples = it.second;
+    counts[it.first()] += samples.getHeadSamples();
+    for (auto &body : samples.getBodySamples()) {
+      for (auto &target : body.second.getCallTargets())
+        counts[target.first()] += target.second;
+    }
+  }
+  return true;
+}
+
+/*Paul:
+put the hot children of every vtable first (-sd-layout-profile), so the hot
+vtables of a cloud end up next to each other in the new layout*/
+void SDLayoutBuilder::applyProfileOrder(Module &M) {
+  if (SDLayoutProfile.empty())
+    return;
+
+  StringMap<uint64_t> counts;
+  if (!sd_readFunctionCounts(M, SDLayoutProfile, counts)) {
+    sdLog::warn() << "Could not read the layout profile " << SDLayoutProfile << "\n";
+    return;
+  }
+
+  // a vtable is as hot as the functions it points to
+  std::map<vtbl_t, uint64_t> weights;
+  for (auto rootIt = cha->roots_begin(); rootIt != cha->roots_end(); rootIt++) {
+    for (const vtbl_t &vtbl : cha->preorder(vtbl_t(*rootIt, 0))) {
+      uint64_t weight = 0;
+      for (const SDBuildCHA::FunctionEntry &entry : cha->getFunctionEntries(vtbl)) {
+        auto countIt = counts.find(entry.functionName);
+        if (countIt != counts.end())
+          weight += countIt->second;
+      }
+      if (weight)
+        weights[vtbl] = weight;
+    }
+  }
+
+  unsigned reordered = cha->orderSiblingsByWeight(weights);
+  sd_print("Profile %s: %u hot vtables, reordered children of %u vtables\n",
+           SDLayoutProfile.c_str(), (unsigned) weights.size(), reordered);
+}
+
 /** Paul: 
     This is the main function of this pass. 
     After the clouds have been generated the info
@@ -1405,34 +1617,53 @@ Constant* SDLayoutBuilder::newVtblAddressConst(Module& M, const vtbl_t& vtbl) {
 void SDLayoutBuilder::buildNewLayouts(Module &M) {
 
   sd_print("CHA cloud map has %d root nodes \n", cha->getNumberOfRoots());
-  
-  //1: we iterate through all roots contained in the cloud, order or interleave them 
-  for (auto itr = cha->roots_begin(); itr != cha->roots_end(); itr++) {
-   
-    vtbl_name_t vtbl = *itr;         // get the v table name as string
- 
-    //Paul: interleave or order for each v table separatelly 
-    if (interleave){
-      //interleaveCloud(vtbl);         // interleave the cloud or
 
-      //our interleaving method 
-      interleaveCloudNew(vtbl);         // interleave the cloud or
-
-    }else{
-      orderCloud(vtbl);              // order the cloud
+  std::vector<vtbl_name_t> rootNames(cha->roots_begin(), cha->roots_end());
+  std::vector<cloud_layout_t> layouts(rootNames.size());
+
+  //1: we iterate through all roots contained in the cloud, order or interleave them,
+  //calculate the new layout indices and the v pointer ranges. This only reads the
+  //CHA results, so the clouds can be handled by several threads at once.
+  unsigned numThreads = SDLayoutThreads;
+  if (numThreads == 0)
+    numThreads = std::thread::hardware_concurrency();
+  if (!llvm_is_multithreaded())
+    numThreads = 1;
+  numThreads = std::min<unsigned>(numThreads, rootNames.size());
+
+  if (numThreads <= 1) {
+    for (unsigned i = 0; i < rootNames.size(); i++)
+      computeCloudLayout(rootNames[i], layouts[i]);
+  } else {
+    sd_print("computing %d cloud layouts with %d threads\n", rootNames.size(), numThreads);
+
+    std::atomic<unsigned> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < numThreads; t++) {
+      workers.push_back(std::thread([&]() {
+        for (unsigned i = next++; i < rootNames.size(); i = next++)
+          computeCloudLayout(rootNames[i], layouts[i]);
+      }));
     }
-    
-    // Paul: we can create a new algorithm which is a combination of the interleaving and ordering algorithms
-    // The algorithm should remove the disadvantages of both of these algorithms and it should carefully 
-    // filter out v tables which are not the v table ancestor path 
+    for (auto &worker : workers)
+      worker.join();
+  }
 
+  // merge the per cloud results in the order of the roots
+  uint64_t baseSize = 0, paddedSize = 0, baseNumMemRanges = 0, numMemRanges = 0;
+  for (unsigned i = 0; i < rootNames.size(); i++) {
+    baseSize += layouts[i].baseSize;
+    paddedSize += layouts[i].paddedSize;
+    baseNumMemRanges += layouts[i].baseNumMemRanges;
+    numMemRanges += layouts[i].numMemRanges;
+    commitCloudLayout(rootNames[i], layouts[i]);
+  }
 
-    //Paul: calculate the new layout indices
-    // the new indices will be used when inserting the new v table layouts inside the metadata.
-    // Inside this method the interleavedMap obtained in the interleaveCloud or 
-    // orderCloud will be used to compute the new index of the v table. 
-    // This is just a simple counting and ssigning an index number to the new elements.
-    calculateNewLayoutInds(vtbl);    // calculate the new indices from the interleaved vtable
+  if (SDLayoutMinPadding && !interleave) {
+    int64_t savedBytes = (int64_t)(baseSize - paddedSize) * WORD_WIDTH;
+    sdLog::stream() << "Ordered vtables: " << paddedSize * WORD_WIDTH << " bytes (saved "
+                    << savedBytes << "), " << numMemRanges << " range checks ("
+                    << (int64_t)(numMemRanges - baseNumMemRanges) << " more)\n";
   }
   
   //2: we iterate through all roots contained in the cloud and replace 
@@ -1455,20 +1686,255 @@ void SDLayoutBuilder::buildNewLayouts(Module &M) {
   }
 
   // 3: we iterate through all roots contained in the cloud and 
-  // calculate v pointer ranges and than verify the v pointer ranges
+  // turn the v pointer ranges into memory ranges inside the new vtables
   for (auto itr = cha->roots_begin(); itr != cha->roots_end(); itr++) {
     vtbl_name_t vtbl = *itr;  // get the v table name as string
-    
-    //calculate the v ptr ranges, these will added into the checks.
-    //this ranges have to be the most restrictive as posible and precise.
-    //There is at the moment no better way as considering the object base class 
-    //and the base class of the function which the object is calling, see SW paper.
-    calculateVPtrRanges(M, vtbl);  
-
-    //Check that the ranges of the descendants are disjoint:
-    //1.This means they do not overlap at all.
-    //2.Check that each descendent is in one of the ranges. 
-    verifyVPtrRanges(vtbl);         
+    calculateMemRanges(M, vtbl);  
+  }
+
+  // 4: with interleaving the RTTI of a vtable is no longer at -1, tell
+  // __ivtbl_dynamic_cast where it is
+  if (interleave)
+    emitAddressPointTable(M);
+
+  // 5: export the memory ranges for the checks of other modules
+  if (SDEmitRangeTable)
+    emitRangeTable(M);
+}
+
+/*
+create the internal function name, which passes table to the libdlcfi
+function hookName if the program has libdlcfi*/
+static Function* sd_createRangeTableHook(Module& M, const char* name, const char* hookName,
+                                         GlobalVariable* table) {
+  LLVMContext& C = M.getContext();
+  Type *Int8PtrTy = Type::getInt8PtrTy(C);
+  FunctionType *hookT = FunctionType::get(Type::getVoidTy(C), Int8PtrTy, false);
+
+  Constant* hookF = M.getFunction(hookName);
+  if (!hookF)
+    hookF = Function::Create(hookT, GlobalValue::ExternalWeakLinkage, hookName, &M);
+  else if (hookF->getType() != hookT->getPointerTo())
+    hookF = ConstantExpr::getBitCast(hookF, hookT->getPointerTo());
+
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+                                 GlobalValue::InternalLinkage, name, &M);
+  BasicBlock* entry = BasicBlock::Create(C, "entry", F);
+  BasicBlock* call = BasicBlock::Create(C, "call", F);
+  BasicBlock* done = BasicBlock::Create(C, "done", F);
+
+  IRBuilder<> builder(entry);
+  builder.CreateCondBr(builder.CreateIsNotNull(hookF), call, done);
+
+  builder.SetInsertPoint(call);
+  builder.CreateCall(hookF, ConstantExpr::getBitCast(table, Int8PtrTy));
+  builder.CreateBr(done);
+
+  builder.SetInsertPoint(done);
+  builder.CreateRetVoid();
+  return F;
+}
+
+/*Paul:
+one entry per memory range of every class, sorted by class name hash so
+libdlcfi can binary search the table in place. The starts are stored
+relative to their entry, so the table needs no dynamic relocations.*/
+void SDLayoutBuilder::emitRangeTable(Module& M) {
+  struct range_entry_t {
+    uint64_t hash;
+    Constant *start;
+    uint64_t width;
+    uint64_t alignment;
+
+    bool operator<(const range_entry_t &other) const { return hash < other.hash; }
+  };
+
+  std::vector<range_entry_t> ranges;
+  std::set<vtbl_name_t> seen;
+
+  for (auto itr = cha->roots_begin(); itr != cha->roots_end(); itr++) {
+    for (const vtbl_t& vnode : cha->preorder(vtbl_t(*itr, 0))) {
+      // call sites check against the primary vtable of their class
+      if (vnode.second != 0 || !hasMemRange(vnode) || !seen.insert(vnode.first).second)
+        continue;
+
+      assert(alignmentMap.count(cha->getAncestor(vnode)));
+      for (const mem_range_t& memRange : memRangeMap[vnode]) {
+        range_entry_t entry = { sd_getClassNameHash(vnode.first), memRange.first, memRange.second,
+                                alignmentMap[cha->getAncestor(vnode)] };
+        ranges.push_back(entry);
+      }
+    }
+  }
+
+  std::stable_sort(ranges.begin(), ranges.end());
+
+  LLVMContext& C = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(C);
+  StructType *entryTy = StructType::get(Int64Ty, Int64Ty, Int64Ty, Int64Ty, nullptr);
+  ArrayType *entriesTy = ArrayType::get(entryTy, ranges.size());
+  StructType *tableTy = StructType::get(Int64Ty, Int64Ty, entriesTy, nullptr);
+
+  // libdlcfi gets the table from the constructor below, not from the dynamic
+  // symbol table, so it does not depend on how the module is linked
+  GlobalVariable *table = new GlobalVariable(M, tableTy, true, GlobalValue::InternalLinkage,
+                                             nullptr, SD_RANGE_TABLE_NAME);
+  table->setSection(SD_RANGE_TABLE_SECTION);
+  table->setAlignment(WORD_WIDTH);
+
+  Constant *zero = ConstantInt::get(Type::getInt32Ty(C), 0);
+  Constant *two = ConstantInt::get(Type::getInt32Ty(C), 2);
+  std::vector<Constant*> entries;
+
+  for (uint64_t i = 0; i < ranges.size(); i++) {
+    Constant *idx[] = { zero, two, ConstantInt::get(Type::getInt32Ty(C), i) };
+    Constant *entryAddr = ConstantExpr::getPtrToInt(
+        ConstantExpr::getInBoundsGetElementPtr(tableTy, table, idx), Int64Ty);
+
+    Constant *fields[] = {
+      ConstantInt::get(Int64Ty, ranges[i].hash),
+      ConstantExpr::getSub(ConstantExpr::getZExtOrBitCast(ranges[i].start, Int64Ty), entryAddr),
+      ConstantInt::get(Int64Ty, ranges[i].width),
+      ConstantInt::get(Int64Ty, ranges[i].alignment)
+    };
+    entries.push_back(ConstantStruct::get(entryTy, fields));
   }
+
+  Constant *tableFields[] = {
+    ConstantInt::get(Int64Ty, SD_RANGE_TABLE_MAGIC),
+    ConstantInt::get(Int64Ty, ranges.size()),
+    ConstantArray::get(entriesTy, entries)
+  };
+  table->setInitializer(ConstantStruct::get(tableTy, tableFields));
+
+  // register the table when the module is loaded and drop it when unloaded
+  appendToGlobalCtors(M, sd_createRangeTableHook(M, "_SD_RANGE_TABLE_register",
+                                                 SD_RANGE_TABLE_REGISTER_FUNC_NAME, table), 101);
+  appendToGlobalDtors(M, sd_createRangeTableHook(M, "_SD_RANGE_TABLE_unregister",
+                                                 SD_RANGE_TABLE_UNREGISTER_FUNC_NAME, table), 101);
+
+  sd_print("Range table: %lu ranges of %lu classes\n", ranges.size(), seen.size());
 }
 
+/*Paul:
+the table is only needed if the module uses the dynamic cast replacement*/
+void SDLayoutBuilder::emitAddressPointTable(Module& M) {
+  if (!M.getFunction(SD_DYNCAST_FUNC_NAME))
+    return;
+
+  LLVMContext& C = M.getContext();
+  Type *IntPtrTy = M.getDataLayout().getIntPtrType(C);
+  Type *Int8PtrTy = Type::getInt8PtrTy(C);
+  StructType *entryTy = StructType::get(IntPtrTy, IntPtrTy, IntPtrTy, nullptr);
+  std::vector<Constant*> entries;
+
+  for (auto itr = cha->roots_begin(); itr != cha->roots_end(); itr++) {
+    for (const vtbl_t& vnode : cha->preorder(vtbl_t(*itr, 0))) {
+      if (!cha->isDefined(vnode) || cha->addrPt(vnode) - cha->getRange(vnode).first < 2)
+        continue;
+
+      Constant *fields[] = {
+        newVtblAddressConst(M, vnode),
+        ConstantInt::get(IntPtrTy, translateVtblInd(vnode, -1, true) * WORD_WIDTH),
+        ConstantInt::get(IntPtrTy, translateVtblInd(vnode, -2, true) * WORD_WIDTH)
+      };
+      entries.push_back(ConstantStruct::get(entryTy, fields));
+    }
+  }
+
+  if (entries.empty())
+    return;
+
+  ArrayType *tableTy = ArrayType::get(entryTy, entries.size());
+  GlobalVariable *table = new GlobalVariable(M, tableTy, true, GlobalVariable::InternalLinkage,
+                                             ConstantArray::get(tableTy, entries), "_SD_APINFO");
+
+  // register the table when the module is loaded and drop it when unloaded
+  Type *argTs[] = { Int8PtrTy, IntPtrTy };
+  FunctionType *registerTy = FunctionType::get(Type::getVoidTy(C), argTs, false);
+  FunctionType *ctorTy = FunctionType::get(Type::getVoidTy(C), false);
+  Value *args[] = { ConstantExpr::getBitCast(table, Int8PtrTy),
+                    ConstantInt::get(IntPtrTy, entries.size()) };
+
+  Function *ctor = Function::Create(ctorTy, GlobalValue::InternalLinkage, "_SD_APINFO_register", &M);
+  IRBuilder<> builder(BasicBlock::Create(C, "", ctor));
+  builder.CreateCall(M.getOrInsertFunction(SD_APINFO_REGISTER_FUNC_NAME, registerTy), args);
+  builder.CreateRetVoid();
+  appendToGlobalCtors(M, ctor, 101);
+
+  Function *dtor = Function::Create(ctorTy, GlobalValue::InternalLinkage, "_SD_APINFO_unregister", &M);
+  builder.SetInsertPoint(BasicBlock::Create(C, "", dtor));
+  builder.CreateCall(M.getOrInsertFunction(SD_APINFO_UNREGISTER_FUNC_NAME, registerTy), args);
+  builder.CreateRetVoid();
+  appendToGlobalDtors(M, dtor, 101);
+
+  sd_print("Address point table: %lu entries\n", entries.size());
+}
+
+/*Paul:
+everything that is computed per cloud before the new vtables are emitted*/
+void SDLayoutBuilder::computeCloudLayout(const vtbl_name_t& vtbl, cloud_layout_t& layout) {
+  // this may run on a -sd-layout-threads worker, so nothing below may write
+  // to the shared sdLog streams. The log of the cloud is kept in layout.log
+  // and written out by commitCloudLayout.
+#ifdef SD_STREAM_DEBUG
+  raw_string_ostream log(layout.log);
+#else
+  raw_null_ostream log;
+#endif
+
+  //calculate the v ptr ranges, these will added into the checks. They only
+  //depend on the preorder, so they are known before ordering (which uses them).
+  //this ranges have to be the most restrictive as posible and precise.
+  //There is at the moment no better way as considering the object base class 
+  //and the base class of the function which the object is calling, see SW paper.
+  calculateVPtrRanges(vtbl, layout.ranges, log);
+
+  //Check that the ranges of the descendants are disjoint:
+  //1.This means they do not overlap at all.
+  //2.Check that each descendent is in one of the ranges. 
+  verifyVPtrRanges(vtbl, layout.ranges);
+
+  //Paul: interleave or order for each v table separatelly 
+  if (interleave){
+    //interleaveCloud(vtbl, layout);         // interleave the cloud or
+
+    //our interleaving method 
+    interleaveCloudNew(vtbl, layout);         // interleave the cloud or
+
+  }else{
+    orderCloud(vtbl, layout, log);         // order the cloud
+  }
+  
+  // Paul: we can create a new algorithm which is a combination of the interleaving and ordering algorithms
+  // The algorithm should remove the disadvantages of both of these algorithms and it should carefully 
+  // filter out v tables which are not the v table ancestor path 
+
+
+  //Paul: calculate the new layout indices
+  // the new indices will be used when inserting the new v table layouts inside the metadata.
+  // Inside this method the interleavedMap obtained in the interleaveCloud or 
+  // orderCloud will be used to compute the new index of the v table. 
+  // This is just a simple counting and ssigning an index number to the new elements.
+  calculateNewLayoutInds(vtbl, layout);    // calculate the new indices from the interleaved vtable
+}
+
+void SDLayoutBuilder::commitCloudLayout(const vtbl_name_t& vtbl, cloud_layout_t& layout) {
+  // the log lines of the cloud, in the order computeCloudLayout wrote them
+  StringRef rest = layout.log;
+  while (!rest.empty()) {
+    std::pair<StringRef, StringRef> line = rest.split('\n');
+    sdLog::log() << line.first << "\n";
+    rest = line.second;
+  }
+
+  interleavingMap[vtbl].swap(layout.interleaving);
+  alignmentMap[vtbl] = layout.alignment;
+
+  for (auto &it : layout.newLayoutInds)
+    newLayoutInds[it.first].swap(it.second);
+  for (auto &it : layout.ranges)
+    rangeMap[it.first].swap(it.second);
+  for (auto &it : layout.prePad)
+    prePadMap[it.first] = it.second;
+}
@@ -1,6 +1,7 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/SafeDispatch.h"
 #include "llvm/Transforms/IPO/SafeDispatchLayoutBuilder.h"
+#include "llvm/Transforms/IPO/SafeDispatchMD.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/InstIterator.h"
@@ -16,6 +17,7 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/CommandLine.h"
 
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
@@ -41,6 +43,15 @@
 
 using namespace llvm;
 
+static cl::opt<unsigned> SDBitmapThreshold("sd-bitmap-threshold",
+    cl::desc("Check call sites with more than this many vptr ranges "
+             "against a bitmap instead of one range check per range"),
+    cl::init(4));
+
+static cl::opt<unsigned> SDBitmapMaxBits("sd-bitmap-max-bits",
+    cl::desc("Largest bitmap (in vtables) emitted for a single call site"),
+    cl::init(1 << 16));
+
 namespace {
   /**
    * Pass for updating the annotated instructions with the new indices
@@ -67,6 +78,7 @@ namespace {
 
       //Paul: second get the results from the class hierarchy analysis pass
       cha = &getAnalysis<SDBuildCHA>();
+      numCheckedCallSites = 0;
 
       sd_print("\n P4. Started running the 4th pass (Update indices) ...\n");
 
@@ -82,10 +94,16 @@ namespace {
       //Intrinsic::sd_get_checked_vptr ->  Intrinsic::sd_subst_check_range             
       handleSDGetCheckedVtbl(&M);            
 
+      //same for a vector of vptrs, with a single branch for all of them
+      //Intrinsic::sd_get_checked_vptrs -> Intrinsic::sd_subst_check_range_v
+      handleSDGetCheckedVtbls(&M);
+
       //Paul: this are for the additional v pointer which are not checked based on ranges 
       //Intrinsic::sd_get_vcall_index -> null (there is no substitution function used here)
       handleRemainingSDGetVcallIndex(&M);    
 
+      sd_print("P4. %lu checked call sites\n", numCheckedCallSites);
+      trapBlocks.clear();
       layoutBuilder->removeOldLayouts(M);    //Paul: remove old layouts
       layoutBuilder->clearAnalysisResults(); //Paul: clear all data structures holding analysis data
 
@@ -104,12 +122,54 @@ namespace {
   private:
     SDLayoutBuilder* layoutBuilder;
     SDBuildCHA* cha;
+
+    // bitmaps emitted so far, shared by all the call sites of a vtable
+    std::map<SDLayoutBuilder::vtbl_t, GlobalVariable*> bitmapMap;
+
+    // the block all the failed checks of a function branch to, with the
+    // (call site id, class hash, vptr) phis of the report
+    struct trap_block_t {
+      BasicBlock* BB;
+      PHINode* callSiteId;
+      PHINode* classHash;
+      PHINode* vptr;
+    };
+    std::map<Function*, trap_block_t> trapBlocks;
+
+    // ids of the checked call sites, in the order they were lowered
+    uint64_t numCheckedCallSites;
     
     // metadata ids
     void handleSDGetVtblIndex(Module* M);
     void handleSDCheckVtbl(Module* M);
     void handleSDGetCheckedVtbl(Module* M);
+    void handleSDGetCheckedVtbls(Module* M);
+
+    SDLayoutBuilder::vtbl_t getCheckedVtbl(llvm::CallInst* CI);
+
+    /**
+     * The single sd.check.fail block of F at the end of the function. It
+     * only calls SD_CHECK_FAIL_FUNC_NAME, so the checks add a never taken
+     * branch to the hot code and almost nothing to the size of F.
+     */
+    trap_block_t& getTrapBlock(Function* F);
+
+    /**
+     * End the block of builder with a branch to SuccessBB if valid (always
+     * fail if valid is NULL) and to the trap block of F otherwise
+     */
+    void emitCheckBranch(IRBuilder<>& builder, llvm::Value* valid, BasicBlock* SuccessBB,
+                         const SDLayoutBuilder::vtbl_t& vtbl, llvm::Value* castVptr);
     void handleRemainingSDGetVcallIndex(Module* M);
+
+    /**
+     * Emit a single sd_subst_check_bitmap call covering all the ranges of
+     * the vtable, or return NULL when the bitmap would be too large.
+     */
+    llvm::Value* emitBitmapCheck(Module* M, IRBuilder<>& builder,
+                                 const SDLayoutBuilder::vtbl_t& vtbl,
+                                 const std::vector<SDLayoutBuilder::mem_range_t>& ranges,
+                                 llvm::Value* castVptr, uint64_t alignment);
   };
 }
 
@@ -413,6 +473,246 @@ void SDUpdateIndices::handleSDCheckVtbl(Module* M) {
   }
 }
 
+/**
+ * Split a range start (see SDLayoutBuilder::newVtblAddressConst) into the new
+ * root vtable and the byte offset into it.
+ */
+static void sd_splitRangeStart(llvm::Constant* start, llvm::GlobalVariable*& gv, uint64_t& off) {
+  llvm::ConstantExpr* CE = cast<llvm::ConstantExpr>(start);
+  off = 0;
+
+  // the add gets folded away for the very first vtable of a cloud
+  if (CE->getOpcode() == Instruction::Add) {
+    off = cast<llvm::ConstantInt>(CE->getOperand(1))->getZExtValue();
+    CE = cast<llvm::ConstantExpr>(CE->getOperand(0));
+  }
+
+  assert(CE->getOpcode() == Instruction::PtrToInt);
+  gv = cast<llvm::GlobalVariable>(CE->getOperand(0));
+}
+
+llvm::Value* SDUpdateIndices::emitBitmapCheck(Module* M, IRBuilder<>& builder,
+                                              const SDLayoutBuilder::vtbl_t& vtbl,
+                                              const std::vector<SDLayoutBuilder::mem_range_t>& ranges,
+                                              llvm::Value* castVptr, uint64_t alignment) {
+  const DataLayout &DL = M->getDataLayout();
+  llvm::LLVMContext& C = M->getContext();
+  Type *IntPtrTy = DL.getIntPtrType(C, 0);
+  assert(alignment && (alignment & (alignment - 1)) == 0);
+
+  llvm::GlobalVariable* root = NULL;
+  uint64_t first = std::numeric_limits<uint64_t>::max();
+  uint64_t last = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> offsets; // (byte offset, #vtables)
+
+  for (auto& range : ranges) {
+    llvm::GlobalVariable* gv;
+    uint64_t off;
+    sd_splitRangeStart(range.first, gv, off);
+    assert((root == NULL || root == gv) && "ranges of a vtable span clouds");
+    root = gv;
+
+    first = std::min(first, off);
+    last = std::max(last, off + (range.second - 1) * alignment);
+    offsets.push_back(std::make_pair(off, range.second));
+  }
+
+  uint64_t numBits = (last - first) / alignment + 1;
+  if (numBits > SDBitmapMaxBits)
+    return NULL;
+
+  llvm::GlobalVariable*& bitmap = bitmapMap[vtbl];
+  if (!bitmap) {
+    std::vector<uint8_t> bytes((numBits + 7) / 8, 0);
+    for (auto& off : offsets) {
+      assert((off.first - first) % alignment == 0);
+      for (uint64_t i = 0; i < off.second; i++) {
+        uint64_t bit = (off.first - first) / alignment + i;
+        bytes[bit / 8] |= 1 << (bit % 8);
+      }
+    }
+
+    llvm::Constant* init = llvm::ConstantDataArray::get(C, bytes);
+    bitmap = new llvm::GlobalVariable(*M, init->getType(), true,
+                                      GlobalValue::PrivateLinkage, init,
+                                      "_SD_BITMAP_" + vtbl.first + "_" + std::to_string(vtbl.second));
+    bitmap->setUnnamedAddr(true);
+  }
+
+  llvm::Constant* start = ConstantExpr::getAdd(ConstantExpr::getPtrToInt(root, IntPtrTy),
+                                               llvm::ConstantInt::get(IntPtrTy, first));
+  llvm::Value *Args[] = {
+    castVptr,
+    start,
+    llvm::ConstantInt::get(IntPtrTy, numBits),
+    llvm::ConstantInt::get(IntPtrTy, alignment),
+    ConstantExpr::getPointerCast(bitmap, IntegerType::getInt8PtrTy(C))
+  };
+
+  sd_print("For vTable: {%s , %d } emitting a bitmap check over %d vtables\n",
+           vtbl.first.c_str(), vtbl.second, numBits);
+
+  return builder.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::sd_subst_check_bitmap), Args);
+}
+
+/*Paul:
+the one failure report of the module: call the hook if something defines
+it, then trap. Kept out of line and cold, so the callers only pay for the
+branch and the call.*/
+static Function* sd_getCheckFailFunction(Module* M) {
+  if (Function* failF = M->getFunction(SD_CHECK_FAIL_FUNC_NAME))
+    return failF;
+
+  LLVMContext& C = M->getContext();
+  Type* Int64Ty = Type::getInt64Ty(C);
+  Type* Int8PtrTy = Type::getInt8PtrTy(C);
+  Type* argTs[] = { Int64Ty, Int64Ty, Int8PtrTy };
+  FunctionType* failT = FunctionType::get(Type::getVoidTy(C), argTs, false);
+
+  Function* failF = Function::Create(failT, GlobalValue::InternalLinkage, SD_CHECK_FAIL_FUNC_NAME, M);
+  failF->addFnAttr(Attribute::NoInline);
+  failF->addFnAttr(Attribute::Cold);
+  failF->addFnAttr(Attribute::NoReturn);
+  failF->addFnAttr(Attribute::NoUnwind);
+  failF->setSection(".text.unlikely");
+
+  // the module may already declare (or, with LTO, define) the hook, only add
+  // the weak declaration if it does not
+  Constant* hookF = M->getFunction(SD_CHECK_FAILED_HOOK_NAME);
+  if (!hookF)
+    hookF = Function::Create(failT, GlobalValue::ExternalWeakLinkage, SD_CHECK_FAILED_HOOK_NAME, M);
+  else if (hookF->getType() != failT->getPointerTo())
+    hookF = ConstantExpr::getBitCast(hookF, failT->getPointerTo());
+
+  BasicBlock* entry = BasicBlock::Create(C, "entry", failF);
+  BasicBlock* report = BasicBlock::Create(C, "report", failF);
+  BasicBlock* trap = BasicBlock::Create(C, "trap", failF);
+
+  IRBuilder<> builder(entry);
+  builder.CreateCondBr(builder.CreateIsNotNull(hookF), report, trap);
+
+  builder.SetInsertPoint(report);
+  std::vector<Value*> args;
+  for (Argument& arg : failF->args())
+    args.push_back(&arg);
+  builder.CreateCall(hookF, args);
+  builder.CreateBr(trap);
+
+  builder.SetInsertPoint(trap);
+  builder.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::trap));
+  builder.CreateUnreachable();
+  return failF;
+}
+
+SDUpdateIndices::trap_block_t& SDUpdateIndices::getTrapBlock(Function* F) {
+  auto it = trapBlocks.find(F);
+  if (it != trapBlocks.end())
+    return it->second;
+
+  LLVMContext& C = F->getContext();
+  trap_block_t& trapBB = trapBlocks[F];
+  trapBB.BB = BasicBlock::Create(C, "sd.check.fail", F);
+
+  IRBuilder<> builder(trapBB.BB);
+  trapBB.callSiteId = builder.CreatePHI(Type::getInt64Ty(C), 2, "sd.callsite");
+  trapBB.classHash  = builder.CreatePHI(Type::getInt64Ty(C), 2, "sd.class");
+  trapBB.vptr       = builder.CreatePHI(Type::getInt8PtrTy(C), 2, "sd.vptr");
+
+  llvm::Value* args[] = { trapBB.callSiteId, trapBB.classHash, trapBB.vptr };
+  CallInst* report = builder.CreateCall(sd_getCheckFailFunction(F->getParent()), args);
+  report->setDoesNotReturn();
+  report->setDoesNotThrow();
+  builder.CreateUnreachable();
+  return trapBB;
+}
+
+void SDUpdateIndices::emitCheckBranch(IRBuilder<>& builder, llvm::Value* valid, BasicBlock* SuccessBB,
+                                      const SDLayoutBuilder::vtbl_t& vtbl, llvm::Value* castVptr) {
+  BasicBlock* BB = builder.GetInsertBlock();
+  trap_block_t& trapBB = getTrapBlock(BB->getParent());
+  LLVMContext& C = BB->getContext();
+
+  uint64_t id = numCheckedCallSites++;
+  sd_print("Check %lu: %s in %s\n", id, vtbl.first.c_str(), BB->getParent()->getName().str().c_str());
+
+  trapBB.callSiteId->addIncoming(ConstantInt::get(Type::getInt64Ty(C), id), BB);
+  trapBB.classHash->addIncoming(ConstantInt::get(Type::getInt64Ty(C), sd_getClassNameHash(vtbl.first)), BB);
+  trapBB.vptr->addIncoming(castVptr, BB);
+
+  if (!valid) {
+    builder.CreateBr(trapBB.BB);
+    return;
+  }
+
+  llvm::BranchInst *BI = builder.CreateCondBr(valid, SuccessBB, trapBB.BB);
+  llvm::MDBuilder MDB(C);
+  // set the branch weights
+  BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(
+                                        std::numeric_limits<uint32_t>::max(),
+                                        std::numeric_limits<uint32_t>::min()));
+}
+
+/*Paul:
+the vtable a sd_get_checked_vptr(s) call site is checked against: the
+static class of the call from argument 1, or the sub-vtable of the more
+precise class from argument 2 if the CHA knows about it*/
+SDLayoutBuilder::vtbl_t SDUpdateIndices::getCheckedVtbl(llvm::CallInst* CI) {
+  //Paul: get second operand
+  llvm::MetadataAsValue* arg2 = dyn_cast<MetadataAsValue>(CI->getArgOperand(1));
+  assert(arg2);//assert not null
+
+  //Paul: get the metadata of the second param
+  MDNode* mdNode = dyn_cast<MDNode>(arg2->getMetadata());
+  assert(mdNode);//assert not null
+  
+  //Paul: get the third parameter
+  llvm::MetadataAsValue* arg3 = dyn_cast<MetadataAsValue>(CI->getArgOperand(2));
+  assert(arg3);//assert not null
+
+  //Paul: get the metadata of the third param 
+  MDNode* mdNode1 = dyn_cast<MDNode>(arg3->getMetadata());
+  assert(mdNode1);//assert not null
+
+  // second one is the tuple that contains the class name and the corresponding global var.
+  // note that the global variable isn't always emitted
+  //get the class name class name from argument 1
+  std::string className = sd_getClassNameFromMD(mdNode, 0);       
+
+  //get a more precise class name from argument 2
+  std::string preciseClassName = sd_getClassNameFromMD(mdNode1,0);
+  SDLayoutBuilder::vtbl_t vtbl(className, 0);
+
+  sd_print("\n C3: Callsite for classname: %s cha->knowsAbout(vtbl.first: %s, vtbl.second: %d) = bool: %d)\n",
+                                                                        className.c_str(),
+                                                                        vtbl.first.c_str(), 
+                                                                        vtbl.second, 
+                                                                        cha->knowsAbout(vtbl));
+
+  //Paul: check if the class hierarchy analysis knows about the v table 
+  if (cha->knowsAbout(vtbl)) {
+    if (preciseClassName != className) {
+      sd_print("C3: More precise class name (base class) = %s\n", preciseClassName.c_str());
+      int64_t ind = cha->getSubVTableIndex(preciseClassName, className);
+      SDLayoutBuilder::vtbl_name_t n = preciseClassName;
+
+      if (ind == -1) {
+        //className is the derive and the preciseClassName is the base class 
+        ind = cha->getSubVTableIndex(className, preciseClassName);
+        n = className;
+      }
+
+      if (ind != -1) {
+        vtbl = SDLayoutBuilder::vtbl_t(n, ind);
+      }
+      sd_print("Index = %d \n", ind);
+    } else{
+      sd_print("There is no base class for this call site \n");
+    }
+  }
+  sd_print("\n"); //just add a gap in the printings 
+  return vtbl;
+}
+
 //Paul: add the range checks, success, failed path, the trap and replace the terminator 
 //add checked v table pointer, add subst range and the trap if failed
 //it uses:  
@@ -440,65 +740,10 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
     llvm::Value* vptr = CI->getArgOperand(0);
     assert(vptr);//assert not null
  
-    //Paul: get second operand
-    llvm::MetadataAsValue* arg2 = dyn_cast<MetadataAsValue>(CI->getArgOperand(1));
-    assert(arg2);//assert not null
-
-    //Paul: get the metadata of the second param
-    MDNode* mdNode = dyn_cast<MDNode>(arg2->getMetadata());
-    assert(mdNode);//assert not null
-    
-    //Paul: get the third parameter
-    llvm::MetadataAsValue* arg3 = dyn_cast<MetadataAsValue>(CI->getArgOperand(2));
-    assert(arg3);//assert not null
-
-    //Paul: get the metadata of the third param 
-    MDNode* mdNode1 = dyn_cast<MDNode>(arg3->getMetadata());
-    assert(mdNode1);//assert not null
-
-    // second one is the tuple that contains the class name and the corresponding global var.
-    // note that the global variable isn't always emitted
-    //get the class name class name from argument 1
-    std::string className = sd_getClassNameFromMD(mdNode, 0);       
-
-    //get a more precise class name from argument 2
-    std::string preciseClassName = sd_getClassNameFromMD(mdNode1,0);
-    SDLayoutBuilder::vtbl_t vtbl(className, 0);
-    llvm::Constant *start;
-    int64_t rangeWidth;
-
-    sd_print("\n C3: Callsite for classname: %s cha->knowsAbout(vtbl.first: %s, vtbl.second: %d) = bool: %d)\n",
-                                                                          className.c_str(),
-                                                                          vtbl.first.c_str(), 
-                                                                          vtbl.second, 
-                                                                          cha->knowsAbout(vtbl));
-  
-    //Paul: check if the class hierarchy analysis knows about the v table 
-    if (cha->knowsAbout(vtbl)) {
-      if (preciseClassName != className) {
-        sd_print("C3: More precise class name (base class) = %s\n", preciseClassName.c_str());
-        int64_t ind = cha->getSubVTableIndex(preciseClassName, className);
-        SDLayoutBuilder::vtbl_name_t n = preciseClassName;
-
-        if (ind == -1) {
-          //className is the derive and the preciseClassName is the base class 
-          ind = cha->getSubVTableIndex(className, preciseClassName);
-          n = className;
-        }
-
-        if (ind != -1) {
-          vtbl = SDLayoutBuilder::vtbl_t(n, ind);
-        }
-        sd_print("Index = %d \n", ind);
-      } else{
-        sd_print("There is no base class for this call site \n");
-      }
-    }
-    sd_print("\n"); //just add a gap in the printings 
+    SDLayoutBuilder::vtbl_t vtbl = getCheckedVtbl(CI);
 
     LLVMContext& C = CI->getContext();                    //Paul: get call inst. context 
     llvm::BasicBlock *BB = CI->getParent();               //Paul: get the parent 
-    llvm::Function *F = BB->getParent();                  //Paul: get the parent of the previous BB 
     llvm::Type *Int8PtrTy = IntegerType::getInt8PtrTy(C); //Paul: convert the context to  
 
     //Paul: split the success BB
@@ -524,8 +769,6 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
       //determine the alignment value 
       llvm::Constant* alignment = llvm::ConstantInt::get(IntPtrTy, layoutBuilder->alignmentMap[root]);
       
-      int i = 0;
-
       //notice a v table can have multiple ranges 
       std::vector<SDLayoutBuilder::mem_range_t> ranges(layoutBuilder->getMemRange(vtbl));
       std::sort(ranges.begin(), ranges.end(), range_less_than_key()); //Paul: sort the elements in the range 
@@ -543,6 +786,17 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
                                        vtbl.second, 
                                        ranges.size(), 
                                        sum);
+
+      //the checks of all the ranges are or'ed, one branch decides
+      llvm::Value* valid = NULL;
+
+      //many (fragmented) ranges: a single bitmap lookup instead of one range check per range
+      if (ranges.size() > SDBitmapThreshold) {
+        valid = emitBitmapCheck(M, builder, vtbl, ranges, castVptr,
+                                layoutBuilder->alignmentMap[root]);
+        if (valid)
+          ranges.clear();
+      }
   
       //Paul: iterate throught the ranges for one v table at a time 
       for (auto rangeIt : ranges) {
@@ -552,67 +806,104 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
    
         //Paul: create the fast path success, this Intrinsic::sd_subst_check_range function
         // was previously added during code generation 
-        //create a call to named fast path success 
-        llvm::Value* fastPathSuccess = builder.CreateCall(Intrinsic::getDeclaration(M,
+        llvm::Value* inRange = builder.CreateCall(Intrinsic::getDeclaration(M,
                                                      Intrinsic::sd_subst_check_range),
                                                                                 Args);
+        valid = valid ? builder.CreateOr(valid, inRange) : inRange;
+      }
 
-        char blockName[256];
-        
-        //give a name to the failed block and attach an increment value to it, i
-        snprintf(blockName, sizeof(blockName), "sd.fastcheck.fail.%d", i);
+      assert(valid);
 
-        //Paul: create the fast path check failed block 
-        //F is the parent block of the current instructon block making the call to Intrinsic::sd_get_checked_vptr
-        llvm::BasicBlock *fastCheckFailed = llvm::BasicBlock::Create(F->getContext(), blockName, F);
-        
-        //Paul: create the the conditional branch and add fast path success Call, success BB and fast check failed BB
-        llvm::BranchInst *BI = builder.CreateCondBr(fastPathSuccess, SuccessBB, fastCheckFailed);
-        llvm::MDBuilder MDB(BI->getContext());
-
-        //Paul: set the branch weights 
-        BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(
-                                              std::numeric_limits<uint32_t>::max(),
-                                              std::numeric_limits<uint32_t>::min()));
-
-        //Paul: set the insertion point 
-        builder.SetInsertPoint(fastCheckFailed); //Paul: builder set the insertion point
-        i++;
-      }
+      //Paul: create the the conditional branch to the success BB or the trap of F
+      emitCheckBranch(builder, valid, SuccessBB, vtbl, castVptr);
+    } else {
+      //no valid vtable, always fail
+      emitCheckBranch(builder, NULL, SuccessBB, vtbl, castVptr);
     }
 
-    /*
-    llvm::BasicBlock *checkFailed = llvm::BasicBlock::Create(F->getContext(), "sd.check.fail", F);
-    llvm::Type* argTs[] = { Int8PtrTy, Int8PtrTy };
-    llvm::FunctionType *vptr_safeT = llvm::FunctionType::get(llvm::Type::getInt1Ty(C), argTs, false);
-    llvm::Constant *vptr_safeF = M->getOrInsertFunction("_Z9vptr_safePKvPKc", vptr_safeT);
-    llvm::Value* slowPathSuccess = builder.CreateCall2(
-                vptr_safeF,
-                castVptr,
-                builder.CreateGlobalStringPtr(className));
-                // TODO: Add dynamic class name to _vptr_safe as well
-
-    BranchInst *BI = builder.CreateCondBr(slowPathSuccess, SuccessBB, checkFailed);
-    llvm::MDBuilder MDB(BI->getContext());
-    BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(
-      std::numeric_limits<uint32_t>::max(),
-      std::numeric_limits<uint32_t>::min()));
-
-    builder.SetInsertPoint(checkFailed);
-    */
-    // Insert Check Failure
-    builder.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::trap)); //Paul: insert the check failure trap 
-   
-    //Paul: this is an IRBuilder object delclared before the previous for loop
-    //create unrechable code here. 
-    builder.CreateUnreachable();
-
     oldTerminator->eraseFromParent();//Paul: remove old terminator
     CI->replaceAllUsesWith(vptr);//Paul: replace all uses with the new v pointer
     CI->eraseFromParent();
   } //end of all uses for loop.
 }
 
+/*Paul:
+the vector version of handleSDGetCheckedVtbl. The lane masks of all the
+ranges are or'ed and a single branch tests that every lane is valid, so a
+vectorized loop pays one compare-branch per vector instead of one per
+object. There is no bitmap variant, every range gets its own vector check.*/
+void SDUpdateIndices::handleSDGetCheckedVtbls(Module* M) {
+  const DataLayout &DL = M->getDataLayout();
+  llvm::LLVMContext& C = M->getContext();
+  Type *IntPtrTy = DL.getIntPtrType(C, 0);
+
+  // the intrinsic is overloaded, there is one declaration per vector type
+  std::vector<llvm::CallInst*> calls;
+  for (Function &F : *M) {
+    if (F.getIntrinsicID() != Intrinsic::sd_get_checked_vptrs)
+      continue;
+    for (const Use &U : F.uses())
+      calls.push_back(cast<CallInst>(U.getUser()));
+  }
+
+  for (llvm::CallInst* CI : calls) {
+    llvm::Value* vptrs = CI->getArgOperand(0);
+    VectorType *vptrsTy = cast<VectorType>(vptrs->getType());
+    unsigned numLanes = vptrsTy->getNumElements();
+
+    SDLayoutBuilder::vtbl_t vtbl = getCheckedVtbl(CI);
+
+    llvm::BasicBlock *BB = CI->getParent();
+    VectorType *Int8PtrVecTy = VectorType::get(IntegerType::getInt8PtrTy(C), numLanes);
+    VectorType *MaskTy = VectorType::get(Type::getInt1Ty(C), numLanes);
+
+    llvm::BasicBlock *SuccessBB = BB->splitBasicBlock(CI, "sd.vptr_check.success");
+    llvm::Instruction *oldTerminator = BB->getTerminator();
+    IRBuilder<> builder(oldTerminator);
+
+    llvm::Value *castVptrs = builder.CreateBitCast(vptrs, Int8PtrVecTy);
+
+    if (layoutBuilder->hasMemRange(vtbl)) {
+      assert(cha->hasAncestor(vtbl));
+      SDLayoutBuilder::vtbl_name_t root = cha->getAncestor(vtbl);
+      assert(layoutBuilder->alignmentMap.count(root));
+      llvm::Constant* alignment = llvm::ConstantInt::get(IntPtrTy, layoutBuilder->alignmentMap[root]);
+
+      std::vector<SDLayoutBuilder::mem_range_t> ranges(layoutBuilder->getMemRange(vtbl));
+      std::sort(ranges.begin(), ranges.end(), range_less_than_key());
+
+      llvm::Type *Tys[] = { MaskTy, Int8PtrVecTy };
+      llvm::Function *checkRangeF = Intrinsic::getDeclaration(M, Intrinsic::sd_subst_check_range_v, Tys);
+
+      llvm::Value *valid = NULL;
+      for (auto rangeIt : ranges) {
+        llvm::Value *width = llvm::ConstantInt::get(IntPtrTy, rangeIt.second);
+        llvm::Value *Args[] = {castVptrs, rangeIt.first, width, alignment};
+        llvm::Value *inRange = builder.CreateCall(checkRangeF, Args);
+        valid = valid ? builder.CreateOr(valid, inRange) : inRange;
+      }
+
+      sd_print("For vTable: {%s , %d } emitting: %d vector range check(s) of %u lanes\n",
+               vtbl.first.c_str(), vtbl.second, ranges.size(), numLanes);
+
+      // all lanes valid <=> the mask is all ones
+      llvm::Value *mask = builder.CreateBitCast(valid, IntegerType::get(C, numLanes));
+      llvm::Value *allValid = builder.CreateICmpEQ(mask, llvm::Constant::getAllOnesValue(mask->getType()));
+
+      // report the first invalid lane
+      llvm::Function *cttzF = Intrinsic::getDeclaration(M, Intrinsic::cttz, mask->getType());
+      llvm::Value *lane = builder.CreateCall2(cttzF, builder.CreateNot(mask), builder.getTrue());
+      emitCheckBranch(builder, allValid, SuccessBB, vtbl, builder.CreateExtractElement(castVptrs, lane));
+    } else {
+      emitCheckBranch(builder, NULL, SuccessBB, vtbl, builder.CreateExtractElement(castVptrs, builder.getInt32(0)));
+    }
+
+    oldTerminator->eraseFromParent();
+    CI->replaceAllUsesWith(vptrs);
+    CI->eraseFromParent();
+  }
+}
+
 //Paul: read the v call index and add replace all uses with this new value 
 //it uses: 
 // Intrinsic::sd_get_vcall_index -> null 
@@ -672,6 +963,9 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
       //Paul: count the number of constant pointers
       int64_t constPtr = 0;
 
+      //count number of bitmap checks substituted
+      int64_t bitmapSubst = 0;
+
       //Paul: cum up the width of a range such that
       // we can compute an average value for each inserted check
       uint64_t sumWidth = 0.0;
@@ -776,8 +1070,10 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
             //create diff rotation 
             llvm::Value *diffRor = builder.CreateOr(diffShr, diffShl);
             
-            //create comparison, diffRor <= width 
-            llvm::Value *inRange = builder.CreateICmpULE(diffRor, width); //Paul: create a comparison expr.
+            //create comparison, diffRor < width. The run is width slots long, with
+            //-sd-layout-min-padding the slot after it may be inside a multi slot
+            //vtable, so it must not pass (same bound as the bitmap and range table)
+            llvm::Value *inRange = builder.CreateICmpULT(diffRor, width); //Paul: create a comparison expr.
             
             //replace the in range check 
             CI->replaceAllUsesWith(inRange);
@@ -805,6 +1101,96 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
         }
       }
       
+      //lower the bitmap checks emitted for call sites with many ranges:
+      //rotate the offset like the range check, then test one bit of the bitmap
+      Function *sd_subst_bitmapF = M.getFunction(Intrinsic::getName(Intrinsic::sd_subst_check_bitmap));
+      if (sd_subst_bitmapF) {
+        const DataLayout &DL = M.getDataLayout();
+        LLVMContext& C = M.getContext();
+        Type *IntPtrTy = DL.getIntPtrType(C, 0);
+
+        std::vector<llvm::CallInst*> calls;
+        for (const Use &U : sd_subst_bitmapF->uses())
+          calls.push_back(cast<CallInst>(U.getUser()));
+
+        for (llvm::CallInst* CI : calls) {
+          IRBuilder<> builder(CI);
+
+          llvm::Value* vptr            = CI->getArgOperand(0);
+          llvm::Value* start           = CI->getArgOperand(1);
+          llvm::ConstantInt* numBits   = cast<ConstantInt>(CI->getArgOperand(2));
+          llvm::ConstantInt* alignment = cast<ConstantInt>(CI->getArgOperand(3));
+          llvm::Value* bitmap          = CI->getArgOperand(4);
+
+          int alignmentBits = countTrailingZeros(alignment->getZExtValue());
+
+          llvm::Value *vptrInt = builder.CreatePtrToInt(vptr, IntPtrTy);
+          llvm::Value *diff    = builder.CreateSub(vptrInt, start);
+          llvm::Value *diffShr = builder.CreateLShr(diff, alignmentBits);
+          llvm::Value *diffShl = builder.CreateShl(diff, DL.getPointerSizeInBits(0) - alignmentBits);
+          llvm::Value *diffRor = builder.CreateOr(diffShr, diffShl);
+          llvm::Value *inRange = builder.CreateICmpULT(diffRor, numBits);
+
+          //keep the load inside the bitmap without branching on inRange
+          llvm::Value *bitIdx  = builder.CreateSelect(inRange, diffRor, llvm::ConstantInt::get(IntPtrTy, 0));
+          llvm::Value *bytePtr = builder.CreateGEP(bitmap, builder.CreateLShr(bitIdx, 3));
+          llvm::Value *byte    = builder.CreateZExt(builder.CreateLoad(bytePtr), IntPtrTy);
+          llvm::Value *bit     = builder.CreateLShr(byte, builder.CreateAnd(bitIdx, 7));
+          llvm::Value *inSet   = builder.CreateTrunc(bit, Type::getInt1Ty(C));
+
+          CI->replaceAllUsesWith(builder.CreateAnd(inRange, inSet));
+          CI->eraseFromParent();
+
+          bitmapSubst += 1;
+        }
+      }
+
+      //lower the vector range checks of sd_get_checked_vptrs lane by lane with
+      //the same rotate and compare as above
+      int64_t vectorRangeSubst = 0;
+      std::vector<llvm::CallInst*> vectorCalls;
+      for (Function &F : M) {
+        if (F.getIntrinsicID() != Intrinsic::sd_subst_check_range_v)
+          continue;
+        for (const Use &U : F.uses())
+          vectorCalls.push_back(cast<CallInst>(U.getUser()));
+      }
+
+      for (llvm::CallInst* CI : vectorCalls) {
+        const DataLayout &DL = M.getDataLayout();
+        Type *IntPtrTy = DL.getIntPtrType(M.getContext(), 0);
+        IRBuilder<> builder(CI);
+
+        llvm::Value* vptrs           = CI->getArgOperand(0);
+        llvm::Constant* start        = cast<Constant>(CI->getArgOperand(1));
+        llvm::ConstantInt* width     = cast<ConstantInt>(CI->getArgOperand(2));
+        llvm::ConstantInt* alignment = cast<ConstantInt>(CI->getArgOperand(3));
+
+        unsigned numLanes = cast<VectorType>(vptrs->getType())->getNumElements();
+        int alignmentBits = countTrailingZeros(alignment->getZExtValue());
+        int64_t widthInt = width->getSExtValue();
+
+        llvm::Value *vptrInt = builder.CreatePtrToInt(vptrs, VectorType::get(IntPtrTy, numLanes));
+        llvm::Value *startV  = ConstantVector::getSplat(numLanes, start);
+        llvm::Value *inRange;
+
+        if (widthInt > 1) {
+          llvm::Value *diff    = builder.CreateSub(vptrInt, startV);
+          llvm::Value *diffShr = builder.CreateLShr(diff, ConstantInt::get(diff->getType(), alignmentBits));
+          llvm::Value *diffShl = builder.CreateShl(diff, ConstantInt::get(diff->getType(),
+                                                   DL.getPointerSizeInBits(0) - alignmentBits));
+          llvm::Value *diffRor = builder.CreateOr(diffShr, diffShl);
+          inRange = builder.CreateICmpULT(diffRor, ConstantVector::getSplat(numLanes, width));
+        } else {
+          inRange = builder.CreateICmpEQ(vptrInt, startV);
+        }
+
+        CI->replaceAllUsesWith(inRange);
+        CI->eraseFromParent();
+
+        vectorRangeSubst += 1;
+      }
+
       //finished adding all the range checks, now print some statistics.
       //in the interleaving paper the average number of ranges per call site was close to 1 (1,005).
       sd_print("\n P5. Finished running SDSubstModule pass...\n");
@@ -815,10 +1201,13 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
       sd_print(" Total range checks added %d \n", rangeSubst);
       sd_print(" Total eq_checks added %d \n", eqSubst);
       sd_print(" Total const_ptr % d \n", constPtr);
+      sd_print(" Total bitmap checks added %d \n", bitmapSubst);
+      sd_print(" Total vector range checks added %d \n", vectorRangeSubst);
       sd_print(" Average width % lf \n", sumWidth * 1.0 / (rangeSubst + eqSubst + constPtr));
 
       //one of these values has to be > than 0 
-      return indexSubst > 0 || rangeSubst > 0 || eqSubst > 0 || constPtr > 0;
+      return indexSubst > 0 || rangeSubst > 0 || eqSubst > 0 || constPtr > 0 || bitmapSubst > 0 ||
+             vectorRangeSubst > 0;
     }
 
 //Paul: this validates a constant pointer 
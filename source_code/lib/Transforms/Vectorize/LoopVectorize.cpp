@@ -2553,6 +2553,29 @@ static unsigned getVectorIntrinsicCost(CallInst *CI, unsigned VF,
   return TTI.getIntrinsicInstrCost(ID, RetTy, Tys);
 }
 
+// Estimate cost of the vptr checks of VF iterations (sd_get_checked_vptr),
+// which SafeDispatch lowers to a rotate and compare of every lane and one
+// branch.
+static unsigned getCheckedVptrCost(CallInst *CI, unsigned VF,
+                                   const TargetTransformInfo &TTI) {
+  const DataLayout &DL = CI->getModule()->getDataLayout();
+  Type *IntTy = ToVectorTy(DL.getIntPtrType(CI->getType()), VF);
+  // the range start, the shift amounts and the width are the same for every lane
+  TargetTransformInfo::OperandValueKind Uniform =
+      TargetTransformInfo::OK_UniformConstantValue;
+  TargetTransformInfo::OperandValueKind Any =
+      TargetTransformInfo::OK_AnyValue;
+
+  return TTI.getCastInstrCost(Instruction::PtrToInt, IntTy,
+                              ToVectorTy(CI->getType(), VF)) +
+         TTI.getArithmeticInstrCost(Instruction::Sub, IntTy, Any, Uniform) +
+         TTI.getArithmeticInstrCost(Instruction::LShr, IntTy, Any, Uniform) +
+         TTI.getArithmeticInstrCost(Instruction::Shl, IntTy, Any, Uniform) +
+         TTI.getArithmeticInstrCost(Instruction::Or, IntTy) +
+         TTI.getCmpSelInstrCost(Instruction::ICmp, IntTy) +
+         TTI.getCFInstrCost(Instruction::Br);
+}
+
 void InnerLoopVectorizer::vectorizeLoop() {
   //===------------------------------------------------===//
   //
@@ -3144,6 +3167,26 @@ void InnerLoopVectorizer::vectorizeBlockInLoop(BasicBlock *BB, PhiVector *PV) {
       Module *M = BB->getParent()->getParent();
       CallInst *CI = cast<CallInst>(it);
 
+      // The vptr checks of VF iterations become one sd_get_checked_vptrs,
+      // which SafeDispatch lowers to a range check of every lane and a
+      // single branch. The class metadata is the same for every lane.
+      if (getIntrinsicIDForCall(CI, TLI) == Intrinsic::sd_get_checked_vptr) {
+        if (VF == 1) {
+          scalarizeInstruction(it);
+          break;
+        }
+        Function *VectorF = Intrinsic::getDeclaration(
+            M, Intrinsic::sd_get_checked_vptrs, VectorType::get(CI->getType(), VF));
+        VectorParts &Vptrs = getVectorValue(CI->getArgOperand(0));
+        for (unsigned Part = 0; Part < UF; ++Part) {
+          Value *Args[] = {Vptrs[Part], CI->getArgOperand(1), CI->getArgOperand(2),
+                           CI->getArgOperand(3)};
+          Entry[Part] = Builder.CreateCall(VectorF, Args);
+        }
+        propagateMetadata(Entry, it);
+        break;
+      }
+
       StringRef FnName = CI->getCalledFunction()->getName();
       Function *F = CI->getCalledFunction();
       Type *RetTy = ToVectorTy(CI->getType(), VF);
@@ -4643,6 +4686,8 @@ LoopVectorizationCostModel::getInstructionCost(Instruction *I, unsigned VF) {
   case Instruction::Call: {
     bool NeedToScalarize;
     CallInst *CI = cast<CallInst>(I);
+    if (getIntrinsicIDForCall(CI, TLI) == Intrinsic::sd_get_checked_vptr)
+      return getCheckedVptrCost(CI, VF, TTI);
     unsigned CallCost = getVectorCallCost(CI, VF, TTI, TLI, NeedToScalarize);
     if (getIntrinsicIDForCall(CI, TLI))
       return std::min(CallCost, getVectorIntrinsicCost(CI, VF, TTI, TLI));
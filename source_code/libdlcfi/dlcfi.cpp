@@ -1,13 +1,29 @@
+#include <cstddef>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <cassert>
+#include <stdint.h>
 #include <unistd.h>
 #include <dlfcn.h>
 #include <link.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "dlcfi.h"
+
+// build with -DDLCFI_DEBUG (make DEBUG=1) to trace every check
+#ifdef DLCFI_DEBUG
+#define dlcfi_log(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define dlcfi_log(...) do {} while (0)
+#endif
+
+// nameHash is the FNV-1a hash of name (sd_getClassNameHash in the compiler)
 
 typedef struct _RangeMapElement {
   char *name;
+  uint64_t nameHash;
   int64_t start;
   int64_t size;
   int64_t alignment;
@@ -20,6 +36,7 @@ typedef struct _RangeMap {
 
 typedef struct _WhiteListElement {
   char *name;
+  uint64_t nameHash;
   int64_t value;
 } WhiteListElement_t;
 
@@ -28,6 +45,27 @@ typedef struct _WhiteList {
   WhiteListElement_t elements[1];
 } WhiteList_t;
 
+/*
+ * Range table emitted by SDLayoutBuilder (see SafeDispatchMD.h) and handed to
+ * __sd_register_range_table by a constructor of its module. Entries are
+ * sorted by nameHash and a range starts startRel bytes after its entry, so
+ * the table is searched in place.
+ */
+#define SD_RANGE_TABLE_MAGIC 0x3130525444534fULL
+
+typedef struct _RangeTableElement {
+  uint64_t nameHash;
+  int64_t startRel;
+  int64_t width;
+  int64_t alignment;
+} RangeTableElement_t;
+
+typedef struct _RangeTable {
+  uint64_t magic;
+  int64_t nelements;
+  RangeTableElement_t elements[1];
+} RangeTable_t;
+
 RangeMapElement_t *findRange(RangeMap_t *rMap, const char *className) {
   //printf("%lld entries in rMap:\n", (long long) rMap->nelements);
   for (int64_t i = 0; i < rMap->nelements; i++) {
@@ -49,92 +87,808 @@ RangeMapElement_t *findRange(RangeMap_t *rMap, const char *className) {
   return NULL;
 }
 
-bool vptr_safe(const void *vptr, const char *className) {
-  Dl_info inf, inf1;
-  RangeMap_t *rMap = NULL;
-  WhiteList_t *wList = NULL;
-  void *dlH;
+/*
+ * Per object cache of the range map (0x70000035) and whitelist (0x70000036)
+ * tables.
+ *
+ * Every loaded object is resolved once: its mapped address range, its tables
+ * and an index sorted by (class name hash, position in the table), so a
+ * lookup is a binary search over integers. The objects live in an immutable snapshot that vptr_safe reads
+ * without taking a lock. A vptr outside of all the objects of the snapshot
+ * while something was dlopen'ed since it was built, or a dlclose() since it
+ * was built, makes the check build a new snapshot with dl_iterate_phdr. A
+ * vptr outside of all the objects of a current snapshot is in no object.
+ * Old snapshots are freed by the next rebuild that finds no check in flight.
+ */
+typedef struct _DSOIndexEntry {
+  uint64_t hash;
+  int64_t  index;
+} DSOIndexEntry_t;
+
+typedef struct _DSOInfo {
+  uintptr_t mapStart;              // same as dladdr's dli_fbase
+  uintptr_t mapEnd;
+  const char *name;
+  struct _CounterSlot *counters;   // check counters of the object, or NULL
+  RangeMap_t *rMap;
+  WhiteList_t *wList;
+  const RangeTable_t *rTable;      // used when there is no rMap
+  DSOIndexEntry_t *rIndex;         // rMap->nelements entries
+  DSOIndexEntry_t *wIndex;         // wList->nelements entries
+} DSOInfo_t;
+
+typedef struct _DSOSnapshot {
+  uint64_t generation;             // dlcfi_generation it was built at, or DLCFI_STALE
+  bool addsKnown;                  // the libc reports the number of loaded objects
+  unsigned long long adds;         // dlpi_adds it was built at
+  int64_t ndsos;
+  DSOInfo_t *dsos;                 // sorted by mapStart
+  struct _DSOSnapshot *retired;    // older snapshots waiting to be freed
+} DSOSnapshot_t;
+
+static DSOSnapshot_t *dlcfi_snapshot = NULL;
+uint64_t dlcfi_generation = 0;             // see dlcfi.h
+static int64_t dlcfi_readers = 0;          // checks currently using a snapshot
+static int64_t dlcfi_closes = 0;           // dlclose() calls in progress
+static __thread int dlcfi_closing = 0;     // this thread is inside of dlclose(), see there
+static pthread_mutex_t dlcfi_rebuild_lock = PTHREAD_MUTEX_INITIALIZER;
 
-  printf("Checking %p for %s\n", vptr, className);
+// generation of a snapshot built during a dlclose(), see dlcfi_rebuild
+#define DLCFI_STALE UINT64_MAX
+
+static inline void dlcfi_enter();
+static inline void dlcfi_exit();
+static struct _CounterSlot *dlcfi_dsoCounters(const char *name);
+
+/*
+ * Range tables registered by the modules. A table is only marked dead when
+ * its module is unloaded, a rebuild may be reading the list; a module loaded
+ * again at the same address revives its entry.
+ */
+typedef struct _RegisteredTable {
+  const RangeTable_t *table;
+  bool live;
+  struct _RegisteredTable *next;
+} RegisteredTable_t;
+
+static RegisteredTable_t *dlcfi_rangeTables = NULL;
+
+/*
+ * Must match sd_getClassNameHash in llvm/Transforms/IPO/SafeDispatchTools.h
+ */
+static uint64_t dlcfi_hash(const char *str) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (; *str; str++) {
+    h ^= (unsigned char) *str;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static int dlcfi_compareIndexEntries(const void *a, const void *b) {
+  const DSOIndexEntry_t *x = (const DSOIndexEntry_t *) a;
+  const DSOIndexEntry_t *y = (const DSOIndexEntry_t *) b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return x->index < y->index ? -1 : (x->index > y->index ? 1 : 0);
+}
+
+static int dlcfi_compareDSOs(const void *a, const void *b) {
+  const DSOInfo_t *x = (const DSOInfo_t *) a;
+  const DSOInfo_t *y = (const DSOInfo_t *) b;
+  return x->mapStart < y->mapStart ? -1 : (x->mapStart > y->mapStart ? 1 : 0);
+}
+
+/*
+ * Sort the positions of the n elements by their name hash
+ */
+template <typename T>
+static DSOIndexEntry_t *dlcfi_buildIndex(T *elements, int64_t n) {
+  DSOIndexEntry_t *index = (DSOIndexEntry_t *) malloc(sizeof(DSOIndexEntry_t) * (n ? n : 1));
+  assert(index);
+  for (int64_t i = 0; i < n; i++) {
+    index[i].hash = elements[i].nameHash;
+    index[i].index = i;
+  }
+  qsort(index, n, sizeof(DSOIndexEntry_t), dlcfi_compareIndexEntries);
+  return index;
+}
 
-  if (!dladdr(vptr, &inf)) {
-    return false;
+/*
+ * First position of the index with the given hash (n if there is none)
+ */
+static int64_t dlcfi_lowerBound(const DSOIndexEntry_t *index, int64_t n, uint64_t hash) {
+  int64_t lo = 0, hi = n;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (index[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  return lo;
+}
+
+typedef struct _DSOLoadCount {
+  bool known;
+  unsigned long long adds;
+} DSOLoadCount_t;
+
+/*
+ * dlpi_adds is the same for every object, so only the first one is read
+ */
+static void dlcfi_readLoadCount(struct dl_phdr_info *info, size_t size, DSOLoadCount_t *count) {
+  count->known = size >= offsetof(struct dl_phdr_info, dlpi_adds) + sizeof(info->dlpi_adds);
+  if (count->known)
+    count->adds = info->dlpi_adds;
+}
+
+static int dlcfi_collectLoadCount(struct dl_phdr_info *info, size_t size, void *data) {
+  dlcfi_readLoadCount(info, size, (DSOLoadCount_t *) data);
+  return 1;
+}
+
+typedef struct _DSOCollector {
+  DSOInfo_t *dsos;
+  int64_t ndsos;
+  int64_t capacity;
+  DSOLoadCount_t loads;
+  const DSOSnapshot_t *reuse;      // snapshot whose indices are still valid, or NULL
+} DSOCollector_t;
 
-  printf("Pointer lies in library %s loaded at %p", inf.dli_fname, inf.dli_fbase);
-  if (inf.dli_sname) {
-    printf(" in symbol %s at index %p\n", inf.dli_sname, ((intptr_t)vptr - (intptr_t)inf.dli_saddr)/8);
-  } else {
-    printf("\n");
+static const RangeTable_t *dlcfi_findRangeTable(uintptr_t mapStart, uintptr_t mapEnd) {
+  for (RegisteredTable_t *t = __atomic_load_n(&dlcfi_rangeTables, __ATOMIC_ACQUIRE); t; t = t->next) {
+    uintptr_t addr = (uintptr_t) t->table;
+    if (__atomic_load_n(&t->live, __ATOMIC_ACQUIRE) && addr >= mapStart && addr < mapEnd &&
+        t->table->magic == SD_RANGE_TABLE_MAGIC)
+      return t->table;
   }
+  return NULL;
+}
 
-  dlH = dlopen(inf.dli_fname, RTLD_NOLOAD | RTLD_LOCAL | RTLD_LAZY);
+static int dlcfi_collectDSO(struct dl_phdr_info *info, size_t size, void *data) {
+  DSOCollector_t *c = (DSOCollector_t *) data;
+  uintptr_t start = UINTPTR_MAX, end = 0;
+  const ElfW(Dyn) *dyn = NULL;
 
-  /*
-  printf("dlH = %p error=%s\n", dlH, dlerror());
-  */
+  if (c->ndsos == 0)
+    dlcfi_readLoadCount(info, size, &c->loads);
 
-  assert(dlH && "dlH should be not null");
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    if (ph->p_type == PT_LOAD) {
+      uintptr_t segStart = info->dlpi_addr + (ph->p_vaddr & ~(ph->p_align - 1));
+      uintptr_t segEnd = info->dlpi_addr + ph->p_vaddr + ph->p_memsz;
+      if (segStart < start)
+        start = segStart;
+      if (segEnd > end)
+        end = segEnd;
+    } else if (ph->p_type == PT_DYNAMIC) {
+      dyn = (const ElfW(Dyn) *) (info->dlpi_addr + ph->p_vaddr);
+    }
+  }
 
-  struct link_map *map;
+  if (start >= end)
+    return 0;
 
-  dlinfo(dlH, RTLD_DI_LINKMAP, &map);
+  if (c->ndsos == c->capacity) {
+    c->capacity = c->capacity ? 2 * c->capacity : 16;
+    c->dsos = (DSOInfo_t *) realloc(c->dsos, sizeof(DSOInfo_t) * c->capacity);
+    assert(c->dsos);
+  }
 
-//  printf("%s loaded at %p dynamic sec at %p\n", map->l_name, map->l_addr, map->l_ld);
-  Elf64_Dyn *e = map->l_ld;
+  DSOInfo_t *dso = &c->dsos[c->ndsos++];
+  memset(dso, 0, sizeof(DSOInfo_t));
+  dso->mapStart = start;
+  dso->mapEnd = end;
+  dso->name = info->dlpi_name;
+  dso->counters = dlcfi_dsoCounters(info->dlpi_name[0] ? info->dlpi_name : "<main program>");
 
-  while (e->d_tag != DT_NULL) {
-//    printf("Tag: %d val: %p\n", e->d_tag, e->d_un.d_ptr);
-    if (e->d_tag == 0x70000035) {
-      rMap = (RangeMap_t*) (((intptr_t)inf.dli_fbase) + ((intptr_t)e->d_un.d_ptr));
-    } else if (e->d_tag == 0x70000036) {
-      wList = (WhiteList_t*) (((intptr_t)inf.dli_fbase) + ((intptr_t)e->d_un.d_ptr));
+  for (; dyn && dyn->d_tag != DT_NULL; dyn++) {
+    if (dyn->d_tag == 0x70000035) {
+      dso->rMap = (RangeMap_t*) (start + (intptr_t)dyn->d_un.d_ptr);
+    } else if (dyn->d_tag == 0x70000036) {
+      dso->wList = (WhiteList_t*) (start + (intptr_t)dyn->d_un.d_ptr);
     }
-    e++;
-  }
-
-  if (rMap) {
-    RangeMapElement_t *range = findRange(rMap, className);
-    if (range) {
-      int64_t start = range->start;
-      int64_t size = range->size;
-      int64_t alignment = range->alignment;
-
-      if (((int64_t)vptr) >= start && ((int64_t)vptr < (start + size * alignment)) &&
-        ((int64_t)vptr) % alignment == 0) {
-        /*
-        printf("%p is in the range %p-%p for %s\n", (void*)vptr, (void*)start, (void*)(start+size), className);
-        fflush(stdout);
-        */
-        return true;
-      } else {
-        /*
-        printf("%p is not in the range %p-%p for %s\n", (void*)vptr, (void*)start, (void*)(start+size), className);
-        fflush(stdout);
-        */
-        goto fail_l;
+  }
+
+  // nothing was unloaded since the old snapshot, so an object at the same
+  // place is the same object and its indices can be shared
+  if (c->reuse) {
+    for (int64_t i = 0; i < c->reuse->ndsos; i++) {
+      const DSOInfo_t *old = &c->reuse->dsos[i];
+      if (old->mapStart == start && old->rMap == dso->rMap && old->wList == dso->wList) {
+        dso->rIndex = old->rIndex;
+        dso->wIndex = old->wIndex;
+        dso->rTable = old->rTable;
+        return 0;
       }
     }
-  } else {
-    /*
-    printf("Module %s was not compiled by our tool :(\n", inf.dli_fname);
-    */
-    return true;
-  }
-
-fail_l:
-  if (wList) {
-    printf("wList->nelements=%d\n", wList->nelements);
-    for (int64_t i = 0; i < wList->nelements; i++) {
-      printf("Class %s\n", wList->elements[i].name);
-      if (!strcmp(className, wList->elements[i].name)) {
-        if (wList->elements[i].value == (intptr_t)vptr) {
-          // printf("%s found\n", className);
-          return true;
+  }
+
+  if (!dso->rMap)
+    dso->rTable = dlcfi_findRangeTable(start, end);
+
+  if (dso->rMap)
+    dso->rIndex = dlcfi_buildIndex(dso->rMap->elements, dso->rMap->nelements);
+  if (dso->wList)
+    dso->wIndex = dlcfi_buildIndex(dso->wList->elements, dso->wList->nelements);
+  return 0;
+}
+
+static int dlcfi_comparePointers(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t) *(void * const *) a;
+  uintptr_t y = (uintptr_t) *(void * const *) b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+ * Free the retired chain s. Indices are shared between snapshots, so only
+ * the ones live does not use are freed, each of them once.
+ */
+static void dlcfi_freeSnapshots(DSOSnapshot_t *s, const DSOSnapshot_t *live) {
+  int64_t n = 0;
+  for (DSOSnapshot_t *it = s; it; it = it->retired)
+    n += 2 * it->ndsos;
+
+  void **indices = (void **) malloc(sizeof(void *) * (n ? n : 1));
+  assert(indices);
+  n = 0;
+  for (DSOSnapshot_t *it = s; it; it = it->retired) {
+    for (int64_t i = 0; i < it->ndsos; i++) {
+      indices[n++] = it->dsos[i].rIndex;
+      indices[n++] = it->dsos[i].wIndex;
+    }
+  }
+  qsort(indices, n, sizeof(void *), dlcfi_comparePointers);
+
+  for (int64_t i = 0; i < n; i++) {
+    if (!indices[i] || (i > 0 && indices[i] == indices[i - 1]))
+      continue;
+
+    bool shared = false;
+    for (int64_t j = 0; j < live->ndsos && !shared; j++)
+      shared = live->dsos[j].rIndex == indices[i] || live->dsos[j].wIndex == indices[i];
+    if (!shared)
+      free(indices[i]);
+  }
+  free(indices);
+
+  while (s) {
+    DSOSnapshot_t *next = s->retired;
+    free(s->dsos);
+    free(s);
+    s = next;
+  }
+}
+
+/*
+ * Build and publish a new snapshot unless another thread already built one
+ * for the current generation. Returns the snapshot to use; the caller is
+ * counted as one of its readers again before the lock is released, so it
+ * cannot be freed under it.
+ *
+ * An object being dlclose()d may still be in the list of the loader, so a
+ * snapshot built while a dlclose() is in progress is stamped DLCFI_STALE. It
+ * is only used by the check that built it.
+ */
+static const DSOSnapshot_t *dlcfi_rebuild(const DSOSnapshot_t *seen) {
+  pthread_mutex_lock(&dlcfi_rebuild_lock);
+
+  DSOSnapshot_t *old = __atomic_load_n(&dlcfi_snapshot, __ATOMIC_ACQUIRE);
+  uint64_t generation = __atomic_load_n(&dlcfi_generation, __ATOMIC_SEQ_CST);
+  if (old && old != seen && old->generation == generation) {
+    dlcfi_enter();
+    pthread_mutex_unlock(&dlcfi_rebuild_lock);
+    return old;
+  }
+
+  bool closing = __atomic_load_n(&dlcfi_closes, __ATOMIC_SEQ_CST) != 0;
+
+  DSOCollector_t c;
+  memset(&c, 0, sizeof(c));
+  c.reuse = (old && old->generation == generation) ? old : NULL;
+  dl_iterate_phdr(dlcfi_collectDSO, &c);
+  qsort(c.dsos, c.ndsos, sizeof(DSOInfo_t), dlcfi_compareDSOs);
+
+  DSOSnapshot_t *s = (DSOSnapshot_t *) malloc(sizeof(DSOSnapshot_t));
+  assert(s);
+  s->generation = closing ? DLCFI_STALE : generation;
+  s->addsKnown = c.loads.known;
+  s->adds = c.loads.adds;
+  s->ndsos = c.ndsos;
+  s->dsos = c.dsos;
+  s->retired = old;
+
+  __atomic_store_n(&dlcfi_snapshot, s, __ATOMIC_SEQ_CST);
+
+  // a check that started after the store above can only see s
+  if (__atomic_load_n(&dlcfi_readers, __ATOMIC_SEQ_CST) == 0) {
+    dlcfi_freeSnapshots(s->retired, s);
+    s->retired = NULL;
+  }
+
+  dlcfi_enter();
+  pthread_mutex_unlock(&dlcfi_rebuild_lock);
+  return s;
+}
+
+static const DSOInfo_t *dlcfi_findDSO(const DSOSnapshot_t *s, uintptr_t addr) {
+  int64_t lo = 0, hi = s->ndsos;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (s->dsos[mid].mapStart <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0 || addr >= s->dsos[lo - 1].mapEnd)
+    return NULL;
+  return &s->dsos[lo - 1];
+}
+
+/*
+ * Nothing was dlopen'ed since s was built
+ */
+static bool dlcfi_noLoadsSince(const DSOSnapshot_t *s) {
+  DSOLoadCount_t count;
+  count.known = false;
+  dl_iterate_phdr(dlcfi_collectLoadCount, &count);
+  return s->addsKnown && count.known && count.adds == s->adds;
+}
+
+/*
+ * Find the object vptr lies in, refreshing the snapshot if it is stale.
+ * Must be called between dlcfi_enter() and dlcfi_exit().
+ */
+static const DSOInfo_t *dlcfi_lookupDSO(const void *vptr) {
+  const DSOSnapshot_t *s = __atomic_load_n(&dlcfi_snapshot, __ATOMIC_SEQ_CST);
+
+  if (s && s->generation == __atomic_load_n(&dlcfi_generation, __ATOMIC_ACQUIRE)) {
+    const DSOInfo_t *dso = dlcfi_findDSO(s, (uintptr_t) vptr);
+    // a vptr in no object of a current snapshot (e.g. forged on the heap)
+    // does not need a rebuild
+    if (dso || dlcfi_noLoadsSince(s))
+      return dso;
+  }
+
+  // a destructor run by dlclose(): the loader lock keeps every object
+  // (including the one being closed) mapped, so the snapshot from before
+  // the dlclose() is still right. A new one could outlive the object.
+  if (dlcfi_closing)
+    return s ? dlcfi_findDSO(s, (uintptr_t) vptr) : NULL;
+
+  // rebuilding frees the retired snapshots only when no check is in flight
+  dlcfi_exit();
+  s = dlcfi_rebuild(s);
+  return dlcfi_findDSO(s, (uintptr_t) vptr);
+}
+
+static inline void dlcfi_enter() {
+  __atomic_fetch_add(&dlcfi_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void dlcfi_exit() {
+  __atomic_fetch_sub(&dlcfi_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Entries of a class are next to each other, the vptr may be in any of them
+ */
+static bool dlcfi_inRangeTable(const RangeTable_t *rTable, const void *vptr, uint64_t hash) {
+  int64_t lo = 0, hi = rTable->nelements;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (rTable->elements[mid].nameHash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (int64_t i = lo; i < rTable->nelements && rTable->elements[i].nameHash == hash; i++) {
+    const RangeTableElement_t *elem = &rTable->elements[i];
+    uintptr_t start = (uintptr_t) elem + elem->startRel;
+    uintptr_t diff = (uintptr_t) vptr - start;
+    if ((uintptr_t) vptr >= start && diff < (uintptr_t) (elem->width * elem->alignment) &&
+        diff % elem->alignment == 0)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * className is only compared when the caller has it (vptr_safe); compilers
+ * that pass the hash alone (vptr_safe_id) rely on the 64 bit hash.
+ */
+static RangeMapElement_t *dlcfi_findRange(const DSOInfo_t *dso, uint64_t hash, const char *className) {
+  RangeMap_t *rMap = dso->rMap;
+
+  // equal hashes are sorted by position, so the first match wins like in findRange
+  for (int64_t i = dlcfi_lowerBound(dso->rIndex, rMap->nelements, hash);
+       i < rMap->nelements && dso->rIndex[i].hash == hash; i++) {
+    RangeMapElement_t *elem = &rMap->elements[dso->rIndex[i].index];
+    if (!className || !strcmp(className, elem->name))
+      return elem;
+  }
+  return NULL;
+}
+
+static bool dlcfi_inWhiteList(const DSOInfo_t *dso, const void *vptr, uint64_t hash,
+                              const char *className) {
+  WhiteList_t *wList = dso->wList;
+
+  for (int64_t i = dlcfi_lowerBound(dso->wIndex, wList->nelements, hash);
+       i < wList->nelements && dso->wIndex[i].hash == hash; i++) {
+    WhiteListElement_t *elem = &wList->elements[dso->wIndex[i].index];
+    if ((!className || !strcmp(className, elem->name)) && elem->value == (intptr_t)vptr)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Check counters. They are updated with relaxed atomics and never print on
+ * their own; dlcfi_dump_stats() prints them, at exit too when DLCFI_STATS is
+ * set in the environment ("1" or "stderr" for stderr, anything else is a
+ * file name).
+ *
+ * Classes and objects are kept in fixed size open addressing tables keyed by
+ * the class name hash and by the hash of the object name, so the counters of
+ * an object survive its dlclose(). Keys that do not fit only count in the
+ * totals.
+ */
+#define DLCFI_CLASS_SLOTS (1 << 14)
+#define DLCFI_DSO_SLOTS   (1 << 8)
+
+typedef struct _CounterSlot {
+  uint64_t key;                    // 0: empty
+  const char *name;                // strdup'ed, set once
+  dlcfi_stats_t stats;
+} CounterSlot_t;
+
+static CounterSlot_t dlcfi_classStats[DLCFI_CLASS_SLOTS];
+static CounterSlot_t dlcfi_dsoStats[DLCFI_DSO_SLOTS];
+static dlcfi_stats_t dlcfi_totals;
+
+static CounterSlot_t *dlcfi_counterSlot(CounterSlot_t *table, unsigned size, uint64_t key, const char *name) {
+  if (key == 0)
+    key = 1;
+
+  for (unsigned probe = 0; probe < size; probe++) {
+    CounterSlot_t *slot = &table[(key + probe) & (size - 1)];
+    uint64_t cur = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+    if (cur == 0) {
+      uint64_t expected = 0;
+      if (__atomic_compare_exchange_n(&slot->key, &expected, key, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        cur = key;
+      else
+        cur = expected;
+    }
+
+    if (cur == key) {
+      if (name && !__atomic_load_n(&slot->name, __ATOMIC_ACQUIRE)) {
+        char *copy = strdup(name);
+        const char *expected = NULL;
+        if (!__atomic_compare_exchange_n(&slot->name, &expected, (const char *) copy, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+          free(copy);
+      }
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * The slot of an object is looked up when a snapshot is built, not for every
+ * check
+ */
+static CounterSlot_t *dlcfi_dsoCounters(const char *name) {
+  return dlcfi_counterSlot(dlcfi_dsoStats, DLCFI_DSO_SLOTS, dlcfi_hash(name), name);
+}
+
+typedef enum {
+  DLCFI_RANGE_HIT,
+  DLCFI_WHITELIST_HIT,
+  DLCFI_UNCHECKED,
+  DLCFI_FAILURE
+} dlcfi_outcome_t;
+
+static inline void dlcfi_countOne(dlcfi_stats_t *stats, dlcfi_outcome_t outcome) {
+  __atomic_fetch_add(&stats->checks, 1, __ATOMIC_RELAXED);
+  switch (outcome) {
+  case DLCFI_RANGE_HIT:     __atomic_fetch_add(&stats->range_hits, 1, __ATOMIC_RELAXED); break;
+  case DLCFI_WHITELIST_HIT: __atomic_fetch_add(&stats->whitelist_hits, 1, __ATOMIC_RELAXED); break;
+  case DLCFI_UNCHECKED:     __atomic_fetch_add(&stats->unchecked, 1, __ATOMIC_RELAXED); break;
+  case DLCFI_FAILURE:       __atomic_fetch_add(&stats->failures, 1, __ATOMIC_RELAXED); break;
+  }
+}
+
+static void dlcfi_count(const DSOInfo_t *dso, uint64_t classHash, const char *className,
+                        dlcfi_outcome_t outcome) {
+  dlcfi_countOne(&dlcfi_totals, outcome);
+
+  CounterSlot_t *cls = dlcfi_counterSlot(dlcfi_classStats, DLCFI_CLASS_SLOTS, classHash, className);
+  if (cls)
+    dlcfi_countOne(&cls->stats, outcome);
+
+  static CounterSlot_t *unknown = NULL;
+  CounterSlot_t *obj = dso ? dso->counters : __atomic_load_n(&unknown, __ATOMIC_RELAXED);
+  if (!dso && !obj) {
+    obj = dlcfi_dsoCounters("<unknown>");
+    __atomic_store_n(&unknown, obj, __ATOMIC_RELAXED);
+  }
+  if (obj)
+    dlcfi_countOne(&obj->stats, outcome);
+}
+
+static void dlcfi_loadStats(const dlcfi_stats_t *from, dlcfi_stats_t *to) {
+  to->checks = __atomic_load_n(&from->checks, __ATOMIC_RELAXED);
+  to->range_hits = __atomic_load_n(&from->range_hits, __ATOMIC_RELAXED);
+  to->whitelist_hits = __atomic_load_n(&from->whitelist_hits, __ATOMIC_RELAXED);
+  to->unchecked = __atomic_load_n(&from->unchecked, __ATOMIC_RELAXED);
+  to->failures = __atomic_load_n(&from->failures, __ATOMIC_RELAXED);
+}
+
+static void dlcfi_resetStats(dlcfi_stats_t *stats) {
+  __atomic_store_n(&stats->checks, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->range_hits, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->whitelist_hits, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->unchecked, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->failures, 0, __ATOMIC_RELAXED);
+}
+
+extern "C" void dlcfi_get_totals(dlcfi_stats_t *out) {
+  dlcfi_loadStats(&dlcfi_totals, out);
+}
+
+extern "C" int dlcfi_get_class_stats(uint64_t classHash, dlcfi_stats_t *out) {
+  uint64_t key = classHash ? classHash : 1;
+  for (unsigned probe = 0; probe < DLCFI_CLASS_SLOTS; probe++) {
+    CounterSlot_t *slot = &dlcfi_classStats[(key + probe) & (DLCFI_CLASS_SLOTS - 1)];
+    uint64_t cur = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+    if (cur == 0)
+      return 0;
+    if (cur == key) {
+      dlcfi_loadStats(&slot->stats, out);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+extern "C" void dlcfi_for_each_class(dlcfi_class_visitor_t visitor, void *data) {
+  for (unsigned i = 0; i < DLCFI_CLASS_SLOTS; i++) {
+    CounterSlot_t *slot = &dlcfi_classStats[i];
+    uint64_t key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+    if (!key)
+      continue;
+    dlcfi_stats_t stats;
+    dlcfi_loadStats(&slot->stats, &stats);
+    visitor(key, __atomic_load_n(&slot->name, __ATOMIC_ACQUIRE), &stats, data);
+  }
+}
+
+extern "C" void dlcfi_for_each_dso(dlcfi_dso_visitor_t visitor, void *data) {
+  for (unsigned i = 0; i < DLCFI_DSO_SLOTS; i++) {
+    CounterSlot_t *slot = &dlcfi_dsoStats[i];
+    if (!__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE))
+      continue;
+    dlcfi_stats_t stats;
+    dlcfi_loadStats(&slot->stats, &stats);
+    const char *name = __atomic_load_n(&slot->name, __ATOMIC_ACQUIRE);
+    visitor(name ? name : "", &stats, data);
+  }
+}
+
+extern "C" void dlcfi_reset_stats(void) {
+  dlcfi_resetStats(&dlcfi_totals);
+  for (unsigned i = 0; i < DLCFI_CLASS_SLOTS; i++)
+    dlcfi_resetStats(&dlcfi_classStats[i].stats);
+  for (unsigned i = 0; i < DLCFI_DSO_SLOTS; i++)
+    dlcfi_resetStats(&dlcfi_dsoStats[i].stats);
+}
+
+static void dlcfi_printStats(FILE *out, const char *what, const dlcfi_stats_t *stats) {
+  fprintf(out, "%10llu %10llu %10llu %10llu %10llu  %s\n",
+          (unsigned long long) stats->checks,
+          (unsigned long long) stats->range_hits,
+          (unsigned long long) stats->whitelist_hits,
+          (unsigned long long) stats->unchecked,
+          (unsigned long long) stats->failures, what);
+}
+
+static void dlcfi_dumpDSO(const char *name, const dlcfi_stats_t *stats, void *data) {
+  // every loaded object has a slot, not only the checked ones
+  if (stats->checks)
+    dlcfi_printStats((FILE *) data, name, stats);
+}
+
+static void dlcfi_dumpClass(uint64_t classHash, const char *name, const dlcfi_stats_t *stats, void *data) {
+  char hashName[32];
+  if (!name) {
+    snprintf(hashName, sizeof(hashName), "%016llx", (unsigned long long) classHash);
+    name = hashName;
+  }
+  dlcfi_printStats((FILE *) data, name, stats);
+}
+
+extern "C" void dlcfi_dump_stats(FILE *out) {
+  dlcfi_stats_t totals;
+  dlcfi_get_totals(&totals);
+
+  fprintf(out, "%10s %10s %10s %10s %10s\n", "checks", "range", "whitelist", "unchecked", "failures");
+  dlcfi_printStats(out, "total", &totals);
+  fprintf(out, "-- per object\n");
+  dlcfi_for_each_dso(dlcfi_dumpDSO, out);
+  fprintf(out, "-- per class\n");
+  dlcfi_for_each_class(dlcfi_dumpClass, out);
+}
+
+static void dlcfi_dumpAtExit() {
+  const char *path = getenv("DLCFI_STATS");
+  if (!path)
+    return;
+
+  if (!strcmp(path, "1") || !strcmp(path, "stderr")) {
+    dlcfi_dump_stats(stderr);
+    return;
+  }
+
+  FILE *out = fopen(path, "a");
+  if (out) {
+    dlcfi_dump_stats(out);
+    fclose(out);
+  }
+}
+
+__attribute__((constructor)) static void dlcfi_init() {
+  if (getenv("DLCFI_STATS"))
+    atexit(dlcfi_dumpAtExit);
+}
+
+/*
+ * Objects may be unloaded and something else mapped at their address, so
+ * every dlclose() invalidates the cached snapshot. This wraps the dlclose of
+ * libdl for every object that resolves it after libdlcfi.
+ *
+ * The generation is bumped before the object goes away and the checks still
+ * using the old snapshot are waited for. Checks that start later see the new
+ * generation and rebuild, the snapshots they build are stale (see
+ * dlcfi_rebuild). The generation is bumped again once the object is gone.
+ *
+ * No lock is held across the dlclose of libdl: it takes the loader lock,
+ * which a check in a constructor run by dlopen() holds while it rebuilds.
+ */
+static int dlcfi_realDlclose(void *handle) {
+  typedef int (*dlclose_t)(void *);
+  static dlclose_t realDlclose = NULL;
+
+  if (!realDlclose)
+    realDlclose = (dlclose_t) dlsym(RTLD_NEXT, "dlclose");
+  assert(realDlclose && "dlclose of libdl not found");
+
+  return realDlclose(handle);
+}
+
+extern "C" int dlclose(void *handle) {
+  __atomic_fetch_add(&dlcfi_closes, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&dlcfi_rebuild_lock);
+  __atomic_fetch_add(&dlcfi_generation, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&dlcfi_readers, __ATOMIC_SEQ_CST) != 0)
+    sched_yield();
+  pthread_mutex_unlock(&dlcfi_rebuild_lock);
+
+  int closing = dlcfi_closing;
+  dlcfi_closing = 1;
+  int res = dlcfi_realDlclose(handle);
+  dlcfi_closing = closing;
+
+  __atomic_fetch_add(&dlcfi_generation, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_sub(&dlcfi_closes, 1, __ATOMIC_SEQ_CST);
+  return res;
+}
+
+/*
+ * Called by a constructor of every module with a range table (see
+ * SDLayoutBuilder::emitRangeTable). A snapshot built between the mapping of
+ * the module and this call thinks it is not checked, so the generation is
+ * bumped.
+ */
+extern "C" void __sd_register_range_table(const void *table) {
+  for (RegisteredTable_t *t = __atomic_load_n(&dlcfi_rangeTables, __ATOMIC_ACQUIRE); t; t = t->next) {
+    if (t->table == table) {
+      __atomic_store_n(&t->live, true, __ATOMIC_RELEASE);
+      __atomic_fetch_add(&dlcfi_generation, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+  }
+
+  RegisteredTable_t *t = (RegisteredTable_t *) malloc(sizeof(RegisteredTable_t));
+  if (!t)
+    return;
+  t->table = (const RangeTable_t *) table;
+  t->live = true;
+  t->next = __atomic_load_n(&dlcfi_rangeTables, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&dlcfi_rangeTables, &t->next, t, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  __atomic_fetch_add(&dlcfi_generation, 1, __ATOMIC_SEQ_CST);
+}
+
+extern "C" void __sd_unregister_range_table(const void *table) {
+  for (RegisteredTable_t *t = __atomic_load_n(&dlcfi_rangeTables, __ATOMIC_ACQUIRE); t; t = t->next)
+    if (t->table == table)
+      __atomic_store_n(&t->live, false, __ATOMIC_RELEASE);
+}
+
+static bool dlcfi_check(const void *vptr, uint64_t classHash, const char *className) {
+  dlcfi_outcome_t outcome = DLCFI_FAILURE;
+  const char *countName = className;
+
+  dlcfi_enter();
+  const DSOInfo_t *dso = dlcfi_lookupDSO(vptr);
+
+  if (dso) {
+    dlcfi_log("Pointer lies in library %s loaded at %p\n", dso->name, (void*) dso->mapStart);
+
+    if (!dso->rMap && dso->rTable) {
+      if (dlcfi_inRangeTable(dso->rTable, vptr, classHash))
+        outcome = DLCFI_RANGE_HIT;
+    } else if (!dso->rMap) {
+      dlcfi_log("Module %s was not compiled by our tool :(\n", dso->name);
+      outcome = DLCFI_UNCHECKED;
+    } else {
+      RangeMapElement_t *range = dlcfi_findRange(dso, classHash, className);
+      if (range) {
+        countName = range->name;
+        int64_t start = range->start;
+        int64_t size = range->size;
+        int64_t alignment = range->alignment;
+
+        if (((int64_t)vptr) >= start && ((int64_t)vptr < (start + size * alignment)) &&
+          ((int64_t)vptr) % alignment == 0) {
+          outcome = DLCFI_RANGE_HIT;
         }
       }
+
+      if (outcome == DLCFI_FAILURE && dso->wList &&
+          dlcfi_inWhiteList(dso, vptr, classHash, className))
+        outcome = DLCFI_WHITELIST_HIT;
     }
   }
-  printf("%s not found\n", className);
-  return false;
+
+  if (outcome == DLCFI_FAILURE)
+    dlcfi_log("%016llx not found\n", (unsigned long long) classHash);
+
+  dlcfi_count(dso, classHash, countName, outcome);
+  dlcfi_exit();
+  return outcome != DLCFI_FAILURE;
+}
+
+void __sd_vptr_check_failed(uint64_t callSite, uint64_t classHash, const void *vptr) {
+  Dl_info info;
+  const char *object = "?";
+  if (vptr && dladdr(vptr, &info) && info.dli_fname)
+    object = info.dli_fname;
+
+  fprintf(stderr, "SafeDispatch: vptr check %llu failed: class %016llx, vptr %p (%s)\n",
+          (unsigned long long) callSite, (unsigned long long) classHash, vptr, object);
+}
+
+bool vptr_safe(const void *vptr, const char *className) {
+  dlcfi_log("Checking %p for %s\n", vptr, className);
+  return dlcfi_check(vptr, dlcfi_hash(className), className);
+}
+
+/*
+ * Same as vptr_safe, for callers that pass sd_getClassNameHash(className)
+ */
+bool vptr_safe_id(const void *vptr, uint64_t classHash) {
+  dlcfi_log("Checking %p for class %016llx\n", vptr, (unsigned long long) classHash);
+  return dlcfi_check(vptr, classHash, NULL);
 }
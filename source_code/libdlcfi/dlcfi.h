@@ -0,0 +1,63 @@
+#ifndef DLCFI_H
+#define DLCFI_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counters of the cross-DSO vptr checks done by libdlcfi (vptr_safe and
+ * vptr_safe_id). Every check counts once in checks and once in exactly one
+ * of the other fields.
+ */
+typedef struct dlcfi_stats {
+  uint64_t checks;
+  uint64_t range_hits;       /* vptr in the range of the class */
+  uint64_t whitelist_hits;   /* vptr in the whitelist of the class */
+  uint64_t unchecked;        /* object was not built with SafeDispatch */
+  uint64_t failures;
+} dlcfi_stats_t;
+
+typedef void (*dlcfi_class_visitor_t)(uint64_t class_hash, const char *name,
+                                      const dlcfi_stats_t *stats, void *data);
+typedef void (*dlcfi_dso_visitor_t)(const char *name, const dlcfi_stats_t *stats,
+                                    void *data);
+
+void dlcfi_get_totals(dlcfi_stats_t *out);
+
+/* returns 0 if no check was done for the class */
+int dlcfi_get_class_stats(uint64_t class_hash, dlcfi_stats_t *out);
+
+/* name is NULL for classes only checked by hash */
+void dlcfi_for_each_class(dlcfi_class_visitor_t visitor, void *data);
+
+/* every object loaded since the start, checked or not */
+void dlcfi_for_each_dso(dlcfi_dso_visitor_t visitor, void *data);
+
+void dlcfi_reset_stats(void);
+
+/* also done at exit if DLCFI_STATS is set ("1"/"stderr" or a file name) */
+void dlcfi_dump_stats(FILE *out);
+
+/*
+ * Incremented by every dlclose() and range table registration. The per call
+ * site caches of accepted vptrs emitted by the compiler are only valid for the
+ * generation they were filled in.
+ */
+extern uint64_t dlcfi_generation;
+
+/*
+ * Called by a module built with SafeDispatch right before it traps on a
+ * failed vptr check. call_site is the id SDUpdateIndices printed for the
+ * check, class_hash the name hash of the class it expected.
+ */
+void __sd_vptr_check_failed(uint64_t call_site, uint64_t class_hash, const void *vptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -22,6 +22,8 @@
 // <http://www.gnu.org/licenses/>.
 
 #include "tinfo.h"
+#include <cstdlib>
+#include <cstring>
 
 namespace __cxxabiv1 {
 
@@ -34,53 +36,215 @@ static ptrdiff_t __ivtbl_get_ott(const void *vtable, const ptrdiff_t off) {
   return *(adjust_pointer<ptrdiff_t>(vtable, off));
 }
 
-// this is the external interface to the dynamic cast machinery
-/* sub: source address to be adjusted; nonnull, and since the
- *      source object is polymorphic, *(void**)sub is a virtual pointer.
- * src: static type of the source object.
- * dst: destination type (the "T" in "dynamic_cast<T>(v)").
- * src2dst_offset: a static hint about the location of the
- *    source subobject with respect to the complete object;
- *    special negative values are:
- *       -1: no hint
- *       -2: src is not a public base of dst
- *       -3: src is a multiple public base type but never a
- *           virtual base type
- *    otherwise, the src type is a unique public nonvirtual
- *    base type of dst at offset src2dst_offset from the
- *    origin of dst.  */
-extern "C" void *
-__ivtbl_dynamic_cast (const void *src_ptr,    // object started from
-                const __class_type_info *src_type, // type of the starting object
-                const __class_type_info *dst_type, // desired target type
-                ptrdiff_t src2dst,
-                ptrdiff_t rttiOff,
-                ptrdiff_t ottOff) // how src and dst are related
-  {
-  const void *vtable = *static_cast <const void *const *> (src_ptr);
+// Address point table of the interleaved vtables of a module, emitted by
+// SDLayoutBuilder and registered by a constructor of the module. With
+// interleaving the RTTI and offset-to-top entries of a vtable are not at
+// -1/-2 and their offsets depend on the cloud, so this is how the RTTI of
+// the whole object is found.
+struct __ivtbl_apinfo {
+  const void *addr_pt;
+  ptrdiff_t rtti_off;
+  ptrdiff_t ott_off;
+};
 
-  const void *whole_ptr =
-      adjust_pointer <void> (src_ptr, __ivtbl_get_ott(vtable, ottOff));
-  const __class_type_info *whole_type = __ivtbl_get_rtti(vtable, rttiOff);
+struct __ivtbl_apinfo_table {
+  const __ivtbl_apinfo *table;     // as registered
+  __ivtbl_apinfo *sorted;          // sorted by addr_pt
+  size_t n;
+  bool live;
+  __ivtbl_apinfo_table *next;
+};
+
+static __ivtbl_apinfo_table *__ivtbl_apinfo_tables = NULL;
+
+// Bumped when a table comes or goes, see __ivtbl_cache_slot.
+static unsigned long __ivtbl_cache_epoch;
+
+static int
+__ivtbl_compare_apinfo (const void *a, const void *b)
+{
+  const char *x = (const char *) ((const __ivtbl_apinfo *) a)->addr_pt;
+  const char *y = (const char *) ((const __ivtbl_apinfo *) b)->addr_pt;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+extern "C" void
+__ivtbl_register_apinfo (const __ivtbl_apinfo *table, size_t n)
+{
+  __ivtbl_apinfo_table *t = (__ivtbl_apinfo_table *) malloc (sizeof (__ivtbl_apinfo_table));
+  __ivtbl_apinfo *sorted = (__ivtbl_apinfo *) malloc (sizeof (__ivtbl_apinfo) * n);
+  if (!t || !sorted)
+    {
+      free (t);
+      free (sorted);
+      return;
+    }
+
+  memcpy (sorted, table, sizeof (__ivtbl_apinfo) * n);
+  qsort (sorted, n, sizeof (__ivtbl_apinfo), __ivtbl_compare_apinfo);
+
+  t->table = table;
+  t->sorted = sorted;
+  t->n = n;
+  t->live = true;
+  t->next = __atomic_load_n (&__ivtbl_apinfo_tables, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&__ivtbl_apinfo_tables, &t->next, t, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  __atomic_fetch_add (&__ivtbl_cache_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+// Tables are only marked dead: a concurrent lookup may still be reading one.
+extern "C" void
+__ivtbl_unregister_apinfo (const __ivtbl_apinfo *table, size_t)
+{
+  for (__ivtbl_apinfo_table *t = __atomic_load_n (&__ivtbl_apinfo_tables, __ATOMIC_ACQUIRE);
+       t; t = t->next)
+    if (t->table == table)
+      __atomic_store_n (&t->live, false, __ATOMIC_RELEASE);
+  __atomic_fetch_add (&__ivtbl_cache_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+static const __ivtbl_apinfo *
+__ivtbl_find_apinfo (const void *vtable)
+{
+  for (__ivtbl_apinfo_table *t = __atomic_load_n (&__ivtbl_apinfo_tables, __ATOMIC_ACQUIRE);
+       t; t = t->next)
+    {
+      if (!__atomic_load_n (&t->live, __ATOMIC_ACQUIRE))
+        continue;
+
+      size_t lo = 0, hi = t->n;
+      while (lo < hi)
+        {
+          size_t mid = lo + (hi - lo) / 2;
+          if ((const char *) t->sorted[mid].addr_pt < (const char *) vtable)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      if (lo < t->n && t->sorted[lo].addr_pt == vtable)
+        return &t->sorted[lo];
+    }
+  return NULL;
+}
+
+// Memoization of __ivtbl_dynamic_cast. The vptr of the source subobject
+// fixes the dynamic type and the position of the subobject in it, and the
+// vptr of the whole object tells a complete object from one under
+// construction, so together with the static arguments they determine the
+// result as an offset from src_ptr (or a failure).
+//
+// The table is direct mapped. Every slot is guarded by a sequence number
+// that is odd while a writer fills it: readers retry nothing, they just
+// treat a slot that changed under them as a miss, and writers that find a
+// slot busy do not cache.
+//
+// A vtable address may be reused by another module after a dlclose(), so
+// entries are only valid for the __ivtbl_cache_epoch read before the cast
+// they cache was computed.
+#define IVTBL_CACHE_SLOTS 4096
+
+struct __ivtbl_cache_slot {
+  unsigned long seq;
+  unsigned long epoch;
+  const void *vtable;
+  const void *whole_vtable;
+  const __class_type_info *src_type;
+  const __class_type_info *dst_type;
+  ptrdiff_t src2dst;
+  ptrdiff_t adjust;                // result - src_ptr
+  bool found;                      // false: the cast fails
+};
+
+static __ivtbl_cache_slot __ivtbl_cache[IVTBL_CACHE_SLOTS];
+
+static unsigned
+__ivtbl_cache_index (const void *vtable, const void *whole_vtable,
+                     const __class_type_info *src_type,
+                     const __class_type_info *dst_type, ptrdiff_t src2dst)
+{
+  unsigned long h = (unsigned long) vtable;
+  h = h * 31 + (unsigned long) whole_vtable;
+  h = h * 31 + (unsigned long) src_type;
+  h = h * 31 + (unsigned long) dst_type;
+  h = h * 31 + (unsigned long) src2dst;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9UL;
+  h ^= h >> 32;
+  return h & (IVTBL_CACHE_SLOTS - 1);
+}
+
+static bool
+__ivtbl_cache_lookup (__ivtbl_cache_slot &slot, unsigned long epoch, const void *vtable,
+                      const void *whole_vtable, const __class_type_info *src_type,
+                      const __class_type_info *dst_type, ptrdiff_t src2dst,
+                      ptrdiff_t &adjust, bool &found)
+{
+  unsigned long seq = __atomic_load_n (&slot.seq, __ATOMIC_ACQUIRE);
+  if (seq & 1)
+    return false;
 
+  bool hit = __atomic_load_n (&slot.epoch, __ATOMIC_RELAXED) == epoch
+    && __atomic_load_n (&slot.vtable, __ATOMIC_RELAXED) == vtable
+    && __atomic_load_n (&slot.whole_vtable, __ATOMIC_RELAXED) == whole_vtable
+    && __atomic_load_n (&slot.src_type, __ATOMIC_RELAXED) == src_type
+    && __atomic_load_n (&slot.dst_type, __ATOMIC_RELAXED) == dst_type
+    && __atomic_load_n (&slot.src2dst, __ATOMIC_RELAXED) == src2dst;
+  adjust = __atomic_load_n (&slot.adjust, __ATOMIC_RELAXED);
+  found = __atomic_load_n (&slot.found, __ATOMIC_RELAXED);
+
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  return hit && __atomic_load_n (&slot.seq, __ATOMIC_RELAXED) == seq;
+}
+
+static void
+__ivtbl_cache_store (__ivtbl_cache_slot &slot, unsigned long epoch, const void *vtable,
+                     const void *whole_vtable, const __class_type_info *src_type,
+                     const __class_type_info *dst_type, ptrdiff_t src2dst,
+                     ptrdiff_t adjust, bool found)
+{
+  unsigned long seq = __atomic_load_n (&slot.seq, __ATOMIC_RELAXED);
+  if ((seq & 1) || !__atomic_compare_exchange_n (&slot.seq, &seq, seq + 1, false,
+                                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  __atomic_store_n (&slot.epoch, epoch, __ATOMIC_RELAXED);
+  __atomic_store_n (&slot.vtable, vtable, __ATOMIC_RELAXED);
+  __atomic_store_n (&slot.whole_vtable, whole_vtable, __ATOMIC_RELAXED);
+  __atomic_store_n (&slot.src_type, src_type, __ATOMIC_RELAXED);
+  __atomic_store_n (&slot.dst_type, dst_type, __ATOMIC_RELAXED);
+  __atomic_store_n (&slot.src2dst, src2dst, __ATOMIC_RELAXED);
+  __atomic_store_n (&slot.adjust, adjust, __ATOMIC_RELAXED);
+  __atomic_store_n (&slot.found, found, __ATOMIC_RELAXED);
+
+  __atomic_store_n (&slot.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// the uncached cast, see __ivtbl_dynamic_cast
+static void *
+__ivtbl_do_dynamic_cast (const void *src_ptr,
+                         const __class_type_info *src_type,
+                         const __class_type_info *dst_type,
+                         ptrdiff_t src2dst,
+                         const void *whole_ptr,
+                         const void *whole_vtable,
+                         const __class_type_info *whole_type)
+{
   // If the whole object vptr doesn't refer to the whole object type, we're
   // in the middle of constructing a primary base, and src is a separate
   // base.  This has undefined behavior and we can't find anything outside
   // of the base we're actually constructing, so fail now rather than
   // segfault later trying to use a vbase offset that doesn't exist.
-  const void *whole_vtable = *static_cast <const void *const *> (whole_ptr);
-  __class_type_info::__dyncast_result result; 
+  // The RTTI offset of the whole object comes from the address point table;
+  // objects of modules without one are not checked.
+  const __ivtbl_apinfo *whole_info = __ivtbl_find_apinfo (whole_vtable);
+  if (whole_info && __ivtbl_get_rtti (whole_vtable, whole_info->rtti_off) != whole_type)
+    return NULL;
 
-  // TODO(dbounov): we had to remove this check since at static time we don't know
-  // the rtti offset for the whole object, since we don't know the precise whole
-  // object type. Should figure out a way to support this again
-  /*
-  const __class_type_info *whole_type1 = __ivtbl_get_rtti(whole_vtable, rttiOffWhole);
+  __class_type_info::__dyncast_result result; 
 
-  if (whole_type1 != whole_type)
-    return NULL;
-  */
-  
   whole_type->__do_dyncast (src2dst, __class_type_info::__contained_public,
                             dst_type, whole_ptr, src_type, src_ptr, result);
   if (!result.dst_ptr)
@@ -107,5 +271,56 @@ __ivtbl_dynamic_cast (const void *src_ptr,    // object started from
   return NULL;
 }
 
+// this is the external interface to the dynamic cast machinery
+/* sub: source address to be adjusted; nonnull, and since the
+ *      source object is polymorphic, *(void**)sub is a virtual pointer.
+ * src: static type of the source object.
+ * dst: destination type (the "T" in "dynamic_cast<T>(v)").
+ * src2dst_offset: a static hint about the location of the
+ *    source subobject with respect to the complete object;
+ *    special negative values are:
+ *       -1: no hint
+ *       -2: src is not a public base of dst
+ *       -3: src is a multiple public base type but never a
+ *           virtual base type
+ *    otherwise, the src type is a unique public nonvirtual
+ *    base type of dst at offset src2dst_offset from the
+ *    origin of dst.  */
+extern "C" void *
+__ivtbl_dynamic_cast (const void *src_ptr,    // object started from
+                const __class_type_info *src_type, // type of the starting object
+                const __class_type_info *dst_type, // desired target type
+                ptrdiff_t src2dst,
+                ptrdiff_t rttiOff,
+                ptrdiff_t ottOff) // how src and dst are related
+  {
+  const void *vtable = *static_cast <const void *const *> (src_ptr);
+
+  const void *whole_ptr =
+      adjust_pointer <void> (src_ptr, __ivtbl_get_ott(vtable, ottOff));
+  const __class_type_info *whole_type = __ivtbl_get_rtti(vtable, rttiOff);
+
+  // the whole object type is checked in __ivtbl_do_dynamic_cast
+  const void *whole_vtable = *static_cast <const void *const *> (whole_ptr);
+
+  __ivtbl_cache_slot &slot =
+    __ivtbl_cache[__ivtbl_cache_index (vtable, whole_vtable, src_type, dst_type, src2dst)];
+  unsigned long epoch = __atomic_load_n (&__ivtbl_cache_epoch, __ATOMIC_ACQUIRE);
+  ptrdiff_t adjust;
+  bool found;
+
+  if (__ivtbl_cache_lookup (slot, epoch, vtable, whole_vtable, src_type, dst_type, src2dst,
+                            adjust, found))
+    return found ? const_cast <void *> (adjust_pointer <void> (src_ptr, adjust)) : NULL;
+
+  void *dst_ptr = __ivtbl_do_dynamic_cast (src_ptr, src_type, dst_type, src2dst,
+                                           whole_ptr, whole_vtable, whole_type);
+
+  __ivtbl_cache_store (slot, epoch, vtable, whole_vtable, src_type, dst_type, src2dst,
+                       dst_ptr ? (const char *) dst_ptr - (const char *) src_ptr : 0,
+                       dst_ptr != NULL);
+  return dst_ptr;
+}
+
 }
 
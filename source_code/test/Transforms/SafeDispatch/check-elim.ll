@@ -0,0 +1,220 @@
+; RUN: opt < %s -sdCheckElim -S | FileCheck %s
+
+; Checks as SDUpdateIndices emits them: the sd_subst_check_* calls of a vptr
+; branch to a success block or to the trap block of the function.
+
+@vt = global [8 x i8*] zeroinitializer, align 16
+
+declare i1 @llvm.sd.subst.check.range(i8*, i64, i64, i64)
+declare void @llvm.trap()
+declare void @clobber(i8**)
+
+; A check dominated by the success block of the same check of the same vptr
+; is removed.
+; CHECK-LABEL: @dominated(
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %v,
+; CHECK-NOT: call i1 @llvm.sd.subst.check.range
+; CHECK: ret void
+define void @dominated(i8** %obj) {
+entry:
+  %v = load i8*, i8** %obj
+  %c1 = call i1 @llvm.sd.subst.check.range(i8* %v, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c1, label %ok1, label %trap
+
+ok1:
+  %c2 = call i1 @llvm.sd.subst.check.range(i8* %v, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c2, label %ok2, label %trap
+
+ok2:
+  ret void
+
+trap:
+  call void @llvm.trap()
+  unreachable
+}
+
+; Two loads of the vptr with nothing written in between are the same vptr.
+; CHECK-LABEL: @reloaded(
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %v1,
+; CHECK-NOT: call i1 @llvm.sd.subst.check.range
+; CHECK: ret void
+define void @reloaded(i8** %obj) {
+entry:
+  %v1 = load i8*, i8** %obj
+  %v2 = load i8*, i8** %obj
+  %c1 = call i1 @llvm.sd.subst.check.range(i8* %v1, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c1, label %ok1, label %trap
+
+ok1:
+  %c2 = call i1 @llvm.sd.subst.check.range(i8* %v2, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c2, label %ok2, label %trap
+
+ok2:
+  ret void
+
+trap:
+  call void @llvm.trap()
+  unreachable
+}
+
+; The vptr is redefined between the loads, both checks stay.
+; CHECK-LABEL: @redefined(
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %v1,
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %v2,
+; CHECK: ret void
+define void @redefined(i8** %obj, i8* %other) {
+entry:
+  %v1 = load i8*, i8** %obj
+  store i8* %other, i8** %obj
+  %v2 = load i8*, i8** %obj
+  %c1 = call i1 @llvm.sd.subst.check.range(i8* %v1, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c1, label %ok1, label %trap
+
+ok1:
+  %c2 = call i1 @llvm.sd.subst.check.range(i8* %v2, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c2, label %ok2, label %trap
+
+ok2:
+  ret void
+
+trap:
+  call void @llvm.trap()
+  unreachable
+}
+
+; A call between the loads may change the vptr, both checks stay.
+; CHECK-LABEL: @clobbered(
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %v1,
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %v2,
+; CHECK: ret void
+define void @clobbered(i8** %obj) {
+entry:
+  %v1 = load i8*, i8** %obj
+  call void @clobber(i8** %obj)
+  %v2 = load i8*, i8** %obj
+  %c1 = call i1 @llvm.sd.subst.check.range(i8* %v1, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c1, label %ok1, label %trap
+
+ok1:
+  %c2 = call i1 @llvm.sd.subst.check.range(i8* %v2, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c2, label %ok2, label %trap
+
+ok2:
+  ret void
+
+trap:
+  call void @llvm.trap()
+  unreachable
+}
+
+; A check of a loop invariant vptr that runs on every iteration is hoisted
+; into the preheader, the check in the loop is then dominated and removed.
+; CHECK-LABEL: @hoisted(
+; CHECK: entry:
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %v,
+; CHECK: sd.vptr_check.hoisted:
+; CHECK-NOT: call i1 @llvm.sd.subst.check.range
+; CHECK: ret void
+define void @hoisted(i8** %obj, i32 %n) {
+entry:
+  %v = load i8*, i8** %obj
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %ok ]
+  %c = call i1 @llvm.sd.subst.check.range(i8* %v, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c, label %ok, label %trap
+
+ok:
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+
+trap:
+  call void @llvm.trap()
+  unreachable
+}
+
+; The check only runs on some iterations, it is not hoisted.
+; CHECK-LABEL: @conditional(
+; CHECK: entry:
+; CHECK-NOT: call i1 @llvm.sd.subst.check.range
+; CHECK: check:
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %v,
+; CHECK: ret void
+define void @conditional(i8** %obj, i32 %n, i1 %b) {
+entry:
+  %v = load i8*, i8** %obj
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  br i1 %b, label %check, label %latch
+
+check:
+  %c = call i1 @llvm.sd.subst.check.range(i8* %v, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %c, label %latch, label %trap
+
+latch:
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+
+trap:
+  call void @llvm.trap()
+  unreachable
+}
+
+; The preheader of the inner loop is in the outer loop, so is the block split
+; off it. Both checks are hoisted out of their loops.
+; CHECK-LABEL: @nested(
+; CHECK: entry:
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %w,
+; CHECK: inner.ph:
+; CHECK: call i1 @llvm.sd.subst.check.range(i8* %v,
+; CHECK: sd.vptr_check.hoisted{{[0-9]*}}:
+; CHECK: inner:
+; CHECK-NOT: call i1 @llvm.sd.subst.check.range
+; CHECK: ret void
+define void @nested(i8** %obj, i8** %other, i32 %n) {
+entry:
+  %v = load i8*, i8** %obj
+  %w = load i8*, i8** %other
+  br label %outer
+
+outer:
+  %j = phi i32 [ 0, %entry ], [ %j.next, %outer.latch ]
+  %cw = call i1 @llvm.sd.subst.check.range(i8* %w, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %cw, label %inner.ph, label %trap
+
+inner.ph:
+  br label %inner
+
+inner:
+  %i = phi i32 [ 0, %inner.ph ], [ %i.next, %ok ]
+  %cv = call i1 @llvm.sd.subst.check.range(i8* %v, i64 ptrtoint ([8 x i8*]* @vt to i64), i64 2, i64 16)
+  br i1 %cv, label %ok, label %trap
+
+ok:
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %outer.latch, label %inner
+
+outer.latch:
+  %j.next = add i32 %j, 1
+  %outer.done = icmp eq i32 %j.next, %n
+  br i1 %outer.done, label %exit, label %outer
+
+exit:
+  ret void
+
+trap:
+  call void @llvm.trap()
+  unreachable
+}
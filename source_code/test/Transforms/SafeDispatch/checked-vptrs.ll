@@ -0,0 +1,58 @@
+; RUN: opt < %s -cc -sdsdmp -S | FileCheck %s
+
+; The batched sd_get_checked_vptrs of a vectorized loop: cc turns it into a
+; vector range check of every lane with a single branch to the trap block and
+; sdsdmp lowers the range check lane by lane. The range of A holds the vtables
+; of A and B, so the lowering compares the rotated offset against the width.
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%class.A = type { i32 (...)** }
+
+@_ZTV1A = linkonce_odr unnamed_addr constant [3 x i8*] [i8* null, i8* null, i8* bitcast (void (%class.A*)* @_ZN1A1fEv to i8*)], align 8
+@_ZTV1B = linkonce_odr unnamed_addr constant [3 x i8*] [i8* null, i8* null, i8* bitcast (void (%class.A*)* @_ZN1B1fEv to i8*)], align 8
+
+declare <2 x i8*> @llvm.sd.get.checked.vptrs.v2p0i8(<2 x i8*>, metadata, metadata, metadata)
+
+define linkonce_odr void @_ZN1A1fEv(%class.A* %this) {
+  ret void
+}
+
+define linkonce_odr void @_ZN1B1fEv(%class.A* %this) {
+  ret void
+}
+
+; CHECK-LABEL: @check(
+; CHECK-NOT: @llvm.sd.get.checked.vptrs
+; CHECK-NOT: @llvm.sd.subst.check.range.v
+; CHECK: sub <2 x i64>
+; CHECK: [[ROR:%.*]] = or <2 x i64>
+; CHECK: icmp ult <2 x i64> [[ROR]], <i64 2, i64 2>
+; CHECK: icmp eq i2
+; CHECK: br i1 {{.*}}, label %sd.vptr_check.success, label %sd.check.fail
+; CHECK: sd.vptr_check.success:
+; CHECK: ret <2 x i8*> %vptrs
+define <2 x i8*> @check(<2 x i8*> %vptrs) {
+entry:
+  %checked = call <2 x i8*> @llvm.sd.get.checked.vptrs.v2p0i8(<2 x i8*> %vptrs, metadata !11, metadata !11, metadata !12)
+  ret <2 x i8*> %checked
+}
+
+!sd.class_info._ZTV1A = !{!0, !1, !2, !3}
+!sd.class_info._ZTV1B = !{!6, !7, !2, !8}
+
+!0 = !{!"_ZTV1A"}
+!1 = !{[3 x i8*]* @_ZTV1A}
+!2 = !{i64 1}
+!3 = !{i64 0, i64 0, i64 2, i64 2, !4, !5}
+!4 = !{i64 1, !"", i64 0, !13}
+!5 = !{i64 1, !"_ZN1A1fEv", i64 2}
+!6 = !{!"_ZTV1B"}
+!7 = !{[3 x i8*]* @_ZTV1B}
+!8 = !{i64 0, i64 0, i64 2, i64 2, !9, !10}
+!9 = !{i64 1, !"_ZTV1A", i64 0, !1}
+!10 = !{i64 1, !"_ZN1B1fEv", i64 2}
+!11 = !{!0, !1}
+!12 = !{!"_ZN1A1fEv"}
+!13 = !{!"NO_VTABLE"}
@@ -0,0 +1,39 @@
+; RUN: opt < %s -loop-vectorize -force-vector-width=2 -force-vector-interleave=1 -S | FileCheck %s
+
+; The vptr checks of a loop over an array of objects: the loop vectorizer
+; widens sd_get_checked_vptr to one sd_get_checked_vptrs of both lanes with
+; the same class metadata.
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare i8* @llvm.sd.get.checked.vptr(i8*, metadata, metadata, metadata)
+
+; CHECK-LABEL: @check(
+; CHECK: vector.body:
+; CHECK: [[VPTRS:%.*]] = load <2 x i8*>
+; CHECK: call <2 x i8*> @llvm.sd.get.checked.vptrs.v2p0i8(<2 x i8*> [[VPTRS]], metadata !0, metadata !0, metadata !3)
+; CHECK: store <2 x i8*>
+define void @check(i8** noalias %vptrs, i8** noalias %out, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %p = getelementptr inbounds i8*, i8** %vptrs, i64 %i
+  %vptr = load i8*, i8** %p, align 8
+  %checked = call i8* @llvm.sd.get.checked.vptr(i8* %vptr, metadata !0, metadata !0, metadata !3)
+  %q = getelementptr inbounds i8*, i8** %out, i64 %i
+  store i8* %checked, i8** %q, align 8
+  %i.next = add nuw nsw i64 %i, 1
+  %done = icmp eq i64 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+!0 = !{!1, !2}
+!1 = !{!"_ZTV1A"}
+!2 = !{i64 0}
+!3 = !{!"_ZN1A1fEv"}
@@ -1728,14 +1728,57 @@ static llvm::Value* sd_getCheckedVTable(CodeGenModule &CGM,
   */
 
   llvm::Type* i8ptr = llvm::Type::getInt8PtrTy(C);
-  llvm::Type* argTs[] = { i8ptr, i8ptr };
+  llvm::Type* i64 = llvm::Type::getInt64Ty(C);
+
+  // One entry inline cache of the last vptr libdlcfi accepted here. The
+  // class of a call site is fixed, so _SD_ICACHE only holds the vptr, xor'ed
+  // with the low 16 bits of dlcfi_generation (bumped by every dlclose) in the
+  // unused top bits of the address. A racing fill thus can never pair a vptr
+  // with a newer generation. The 16 bits wrap, so _SD_ICACHE_GEN also holds
+  // the full generation of the fill. It starts at a generation libdlcfi never
+  // reaches, so the zero initialized entry never hits, not even for a null vptr.
+  llvm::GlobalVariable *cacheGV = new llvm::GlobalVariable(M, i64, false,
+      llvm::GlobalValue::InternalLinkage, llvm::ConstantInt::get(i64, 0), "_SD_ICACHE");
+  cacheGV->setAlignment(8);
+  llvm::GlobalVariable *cacheGenGV = new llvm::GlobalVariable(M, i64, false,
+      llvm::GlobalValue::InternalLinkage, llvm::ConstantInt::get(i64, ~0ULL), "_SD_ICACHE_GEN");
+  cacheGenGV->setAlignment(8);
+  llvm::Constant *generationGV = M.getOrInsertGlobal("dlcfi_generation", i64);
+
+  llvm::LoadInst *generation = CGF.Builder.CreateAlignedLoad(generationGV, 8);
+  generation->setAtomic(llvm::Acquire);
+  llvm::LoadInst *cached = CGF.Builder.CreateAlignedLoad(cacheGV, 8);
+  cached->setAtomic(llvm::Monotonic);
+  llvm::LoadInst *cachedGen = CGF.Builder.CreateAlignedLoad(cacheGenGV, 8);
+  cachedGen->setAtomic(llvm::Monotonic);
+
+  llvm::Value *cacheKey = CGF.Builder.CreateXor(CGF.Builder.CreatePtrToInt(VTableAP, i64),
+                                                CGF.Builder.CreateShl(generation, 48));
+  llvm::Value *cacheHit = CGF.Builder.CreateAnd(CGF.Builder.CreateICmpEQ(cached, cacheKey),
+                                                CGF.Builder.CreateICmpEQ(cachedGen, generation));
+  llvm::BasicBlock *slowPath = CGF.createBasicBlock("vtblCheck.slowpath");
+  llvm::BasicBlock *fillCache = CGF.createBasicBlock("vtblCheck.fillcache");
+  CGF.Builder.CreateCondBr(cacheHit, checkDone, slowPath);
+
+  CGF.EmitBlock(slowPath);
+
+  // bool vptr_safe_id(const void*, uint64_t) in libdlcfi, the class is
+  // identified by the hash of its name so no name string is emitted
+  llvm::Type* argTs[] = { i8ptr, i64 };
   llvm::FunctionType *vptr_safeT = llvm::FunctionType::get(llvm::Type::getInt1Ty(C), argTs, false);
-  llvm::Constant *vptr_safeF = M.getOrInsertFunction("_Z9vptr_safePKvPKc", vptr_safeT);
+  llvm::Constant *vptr_safeF = M.getOrInsertFunction("_Z12vptr_safe_idPKvm", vptr_safeT);
   llvm::Value* slowPathSuccess = CGF.Builder.CreateCall2(vptr_safeF,
                                                          CGF.Builder.CreateBitCast(VTableAP, i8ptr),
-                                                         CGF.Builder.CreateGlobalStringPtr(Name));
+                                                         llvm::ConstantInt::get(i64, sd_getClassNameHash(Name)));
 
-  CGF.Builder.CreateCondBr(slowPathSuccess, checkDone, checkFailed);
+  CGF.Builder.CreateCondBr(slowPathSuccess, fillCache, checkFailed);
+
+  // the key uses the generation read before the check, so an object closed
+  // during the check leaves a stale key behind
+  CGF.EmitBlock(fillCache);
+  CGF.Builder.CreateAlignedStore(generation, cacheGenGV, 8)->setAtomic(llvm::Monotonic);
+  CGF.Builder.CreateAlignedStore(cacheKey, cacheGV, 8)->setAtomic(llvm::Monotonic);
+  CGF.Builder.CreateBr(checkDone);
 
   CGF.EmitBlock(checkFailed);
   CGF.Builder.CreateCall(CGM.getIntrinsic(llvm::Intrinsic::trap)); //Paul: see Intrinsics.td file
@@ -3765,6 +3765,9 @@ void Clang::ConstructJob(Compilation &C, const JobAction &JA,
   if (Args.hasArg(options::OPT_femit_ivtbl))
     CmdArgs.push_back("-femit-ivtbl");
 
+  if (Args.hasArg(options::OPT_fsd_legacy_class_info))
+    CmdArgs.push_back("-fsd-legacy-class-info");
+
   // Forward -f (flag) options which we can pass directly.
   Args.AddLastArg(CmdArgs, options::OPT_femit_all_decls);
   Args.AddLastArg(CmdArgs, options::OPT_fheinous_gnu_extensions);
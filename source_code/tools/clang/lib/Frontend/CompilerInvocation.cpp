@@ -649,6 +649,9 @@ static bool ParseCodeGenArgs(CodeGenOptions &Opts, ArgList &Args, InputKind IK,
   //Paul: emit interleaved v tables
   Opts.EmitIVTBL = Args.hasArg(OPT_femit_ivtbl);
 
+  // emit the class hierarchy metadata in the old (uncompressed) format
+  Opts.SDLegacyClassInfo = Args.hasArg(OPT_fsd_legacy_class_info);
+
   return Success;
 }
 
@@ -39,6 +39,7 @@
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/IPO/SafeDispatchCHACache.h"
 #include "llvm/Transforms/Utils/GlobalStatus.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
@@ -81,6 +82,7 @@ static Reloc::Model RelocationModel = Reloc::Default;
 static std::string output_name = "";
 static std::list<claimed_file> Modules;
 static std::vector<std::string> Cleanup;
+static std::unique_ptr<SDCHACache> CHACache;
 static llvm::TargetOptions TargetOpts;
 
 namespace options {
@@ -107,6 +109,8 @@ namespace options {
   static bool RunSDIVTBLPass = false;
   static bool RunSDOVTBLPass = false;
   static bool RunSDReturnPass = false;
+  // directory of the per input module class hierarchy cache, off when empty
+  static std::string SDCHACacheDir;
 
   static void process_plugin_option(const char* opt_)
   {
@@ -132,6 +136,8 @@ namespace options {
       RunSDReturnPass = true;
     } else if (opt == "sd-ovtbl") {
       RunSDOVTBLPass = true;
+    } else if (opt.startswith("sd-cha-cache=")) {
+      SDCHACacheDir = opt.substr(strlen("sd-cha-cache="));
     } else if (opt == "save-temps") {
       TheOutputType = OT_SAVE_TEMPS;
     } else if (opt == "disable-output") {
@@ -617,6 +623,9 @@ getModuleForFile(LLVMContext &Context, claimed_file &F,
   M.materializeMetadata();
   UpgradeDebugInfo(M);
 
+  if (CHACache)
+    CHACache->takeModuleRecords(M, BufferRef.getBuffer());
+
   SmallPtrSet<GlobalValue *, 8> Used;
   collectUsedGlobalVariables(M, Used, /*CompilerUsed*/ false);
 
@@ -740,6 +749,7 @@ static void runLTOPasses(Module &M, TargetMachine &TM) {
   PMB.EmitIVTBLs = options::RunSDIVTBLPass;
   PMB.EmitOVTBLs = options::RunSDOVTBLPass;
   PMB.EmitReturnChecks = options::RunSDReturnPass;
+  PMB.SDClassInfoCache = CHACache.get();
   PMB.OptLevel = options::OptLevel;
   PMB.populateLTOPassManager(passes);
   passes.run(M);
@@ -861,6 +871,9 @@ static ld_plugin_status allSymbolsReadHook(raw_fd_ostream *ApiFile) {
 
   std::string DefaultTriple = sys::getDefaultTargetTriple();
 
+  if (!options::SDCHACacheDir.empty())
+    CHACache.reset(new SDCHACache(options::SDCHACacheDir));
+
   StringSet<> Internalize;
   StringSet<> Maybe;
   for (claimed_file &F : Modules) {
@@ -881,6 +894,10 @@ static ld_plugin_status allSymbolsReadHook(raw_fd_ostream *ApiFile) {
       message(LDPL_FATAL, "Failed to release file information");
   }
 
+  if (CHACache)
+    message(LDPL_INFO, "SafeDispatch CHA cache: %u hits, %u misses",
+            CHACache->getHits(), CHACache->getMisses());
+
   for (const auto &Name : Internalize) {
     GlobalValue *GV = Combined->getNamedValue(Name.first());
     if (GV)
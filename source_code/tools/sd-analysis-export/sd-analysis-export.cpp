@@ -0,0 +1,145 @@
+//===-- sd-analysis-export.cpp - Export SDAnalysis results as CSV ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This utility converts the columnar .sda file written by the SDAnalysis pass
+// back into a CSV with one row per call site:
+//  sd-analysis-export [options] x.sda
+//  Options:
+//      -o <file>  - Write the CSV to <file> instead of stdout
+//      -targets   - Append the target sets of every call site to its row
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/SafeDispatchAnalysisFile.h"
+#include <algorithm>
+#include <set>
+#include <system_error>
+using namespace llvm;
+using namespace llvm::sdanalysis;
+
+static cl::opt<std::string>
+InputFilename(cl::Positional, cl::desc("<input .sda file>"), cl::Required);
+
+static cl::opt<std::string>
+OutputFilename("o", cl::desc("Output filename"), cl::value_desc("filename"),
+               cl::init("-"));
+
+static cl::opt<bool>
+ExportTargets("targets", cl::desc("Append the target names of every call site"));
+
+static const Column FirstSetColumn = COL_SET_PRECISE_SRC_TYPE;
+
+static void writeTargets(raw_ostream &Out, const SDAnalysisFile &File,
+                         StringRef Name, ArrayRef<support::ulittle32_t> Set) {
+  Out << "," << Name << "(" << Set.size() << "):";
+  for (uint32_t Member : Set)
+    Out << ",\"" << File.getString(Member) << "\"";
+}
+
+/// The TypeArmor targets are not stored per call site, they are the functions
+/// with at most as many params as the call site passes. SDAnalysisFile::open
+/// rejects files with a negative number of params.
+static void writeParamTargets(raw_ostream &Out, const SDAnalysisFile &File,
+                              StringRef Name, int64_t Params, bool Virtual) {
+  std::set<StringRef> Targets;
+  assert(Params >= 0);
+  unsigned Max = std::min<uint64_t>(Params, NUM_PARAM_SETS - 1);
+  for (unsigned N = 0; N <= Max; N++)
+    for (uint32_t Member : File.getSet(File.getParamSet(N, Virtual)))
+      Targets.insert(File.getString(Member));
+
+  Out << "," << Name << "(" << Targets.size() << "):";
+  for (StringRef Target : Targets)
+    Out << ",\"" << Target << "\"";
+}
+
+static void writeRow(raw_ostream &Out, const SDAnalysisFile &File, uint64_t Row) {
+  for (unsigned C = 0; C < FirstSetColumn; C++) {
+    if (C)
+      Out << ",";
+
+    int64_t Value = File.get(Row, (Column) C);
+    switch (C) {
+    case COL_KIND:
+      Out << (Value == KIND_VIRTUAL ? "virtual" : "indirect");
+      break;
+    case COL_DWARF:
+    case COL_FUNCTION_NAME:
+    case COL_CLASS_NAME:
+    case COL_PRECISE_NAME:
+    case COL_CALLER:
+      Out << File.getString(Value);
+      break;
+    case COL_METRIC:
+      Out << format("%f", File.getMetric(Row));
+      break;
+    default:
+      Out << Value;
+    }
+  }
+
+  if (!ExportTargets)
+    return;
+
+  int64_t Params = File.get(Row, COL_PARAMS);
+  for (unsigned C = FirstSetColumn; C < NUM_COLUMNS; C++) {
+    int64_t Id = File.get(Row, (Column) C);
+    if (Id != NO_ID)
+      writeTargets(Out, File, getColumnName(C), File.getSet(Id));
+
+    // keep the order of the metric CSVs: vTrust, IFCC, IFCCSafe, TypeArmor
+    if (C == COL_SET_SAFE_SRC_TYPE)
+      writeParamTargets(Out, File, "TypeArmor", Params, false);
+    else if (C == COL_SET_SAFE_SRC_TYPE_VIRTUAL)
+      writeParamTargets(Out, File, "TypeArmorVirtual", Params, true);
+  }
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+
+  llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
+  cl::ParseCommandLineOptions(argc, argv, "SafeDispatch analysis exporter\n");
+
+  ErrorOr<std::unique_ptr<SDAnalysisFile>> FileOrErr = SDAnalysisFile::open(InputFilename);
+  if (std::error_code EC = FileOrErr.getError()) {
+    errs() << argv[0] << ": " << InputFilename << ": " << EC.message() << "\n";
+    return 1;
+  }
+  const SDAnalysisFile &File = **FileOrErr;
+
+  std::error_code EC;
+  tool_output_file Out(OutputFilename, EC, sys::fs::F_Text);
+  if (EC) {
+    errs() << EC.message() << '\n';
+    return 1;
+  }
+
+  for (unsigned C = 0; C < FirstSetColumn; C++)
+    Out.os() << (C ? "," : "") << getColumnName(C);
+  Out.os() << "\n";
+
+  for (uint64_t Row = 0; Row < File.getNumCallSites(); Row++) {
+    writeRow(Out.os(), File, Row);
+    Out.os() << "\n";
+  }
+
+  Out.keep();
+  return 0;
+}
@@ -0,0 +1,168 @@
+//===- SafeDispatchAnalysisFile.cpp - Unit tests for the .sda file --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/IPO/SafeDispatchAnalysisFile.h"
+#include "llvm/ADT/SmallString.h"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <set>
+
+using namespace llvm;
+using namespace llvm::sdanalysis;
+
+namespace {
+
+class SDAnalysisFileTest : public testing::Test {
+protected:
+  SmallString<64> Path;
+
+  void SetUp() override {
+    ASSERT_FALSE(sys::fs::createTemporaryFile("SDAnalysisFileTest", "sda", Path));
+  }
+
+  void TearDown() override { sys::fs::remove(Path); }
+
+  static void fillRow(SDAnalysisFileWriter::row_t &Row) {
+    std::fill(Row, Row + NUM_COLUMNS, NO_ID);
+    Row[COL_KIND] = KIND_INDIRECT;
+    Row[COL_PARAMS] = 0;
+    Row[COL_METRIC] = 0;
+  }
+
+  /// Overwrite the int64 at Offset of the written file
+  void patch(uint64_t Offset, int64_t Value) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(Path);
+    ASSERT_TRUE((bool) Buf);
+    std::string Data = (*Buf)->getBuffer();
+    ASSERT_LE(Offset + 8, Data.size());
+
+    support::little64_t LE;
+    LE = Value;
+    memcpy(&Data[Offset], &LE, sizeof(LE));
+
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::F_None);
+    ASSERT_FALSE(EC);
+    OS << Data;
+  }
+};
+
+TEST_F(SDAnalysisFileTest, RoundTrip) {
+  std::set<std::string> Foo = {"_ZN1A3fooEv", "_ZN1B3fooEv"};
+  std::set<std::string> Bar = {"bar"};
+  std::set<std::string> NoParams = {"f0"};
+  std::set<std::string> OneParam = {"f1", "g1"};
+
+  SDAnalysisFileWriter W;
+  W.setParamSet(0, false, NoParams);
+  W.setParamSet(1, false, OneParam);
+
+  SDAnalysisFileWriter::row_t Row;
+  fillRow(Row);
+  Row[COL_KIND] = KIND_VIRTUAL;
+  Row[COL_FUNCTION_NAME] = W.addString("foo");
+  Row[COL_CLASS_NAME] = W.addString("A");
+  Row[COL_CALLER] = W.addString("main");
+  Row[COL_PARAMS] = 1;
+  Row[COL_PRECISE_SRC_TYPE] = Foo.size();
+  Row[COL_SET_PRECISE_SRC_TYPE] = W.addSet(Foo);
+  Row[COL_SET_SRC_TYPE] = W.addSet(Foo);
+  float Metric = 0.5f;
+  uint32_t MetricBits;
+  memcpy(&MetricBits, &Metric, sizeof(MetricBits));
+  Row[COL_METRIC] = MetricBits;
+  W.addRow(Row);
+
+  fillRow(Row);
+  Row[COL_CALLER] = W.addString("main");
+  Row[COL_PARAMS] = 9;
+  Row[COL_SET_SRC_TYPE] = W.addSet(Bar);
+  W.addRow(Row);
+
+  ASSERT_FALSE(W.write(Path, 10, 4, 3));
+
+  ErrorOr<std::unique_ptr<SDAnalysisFile>> FileOrErr = SDAnalysisFile::open(Path);
+  ASSERT_TRUE((bool) FileOrErr);
+  const SDAnalysisFile &File = **FileOrErr;
+
+  EXPECT_EQ(2u, File.getNumCallSites());
+  EXPECT_EQ(10u, File.getBaseLine());
+  EXPECT_EQ(4u, File.getBaseLineVirtual());
+  EXPECT_EQ(3u, File.getAllVFunctionsInVTables());
+
+  EXPECT_TRUE(File.isVirtual(0));
+  EXPECT_FALSE(File.isVirtual(1));
+  EXPECT_EQ("foo", File.getString(File.get(0, COL_FUNCTION_NAME)));
+  EXPECT_EQ("A", File.getString(File.get(0, COL_CLASS_NAME)));
+  EXPECT_EQ("", File.getString(File.get(0, COL_DWARF)));
+  EXPECT_EQ(File.get(0, COL_CALLER), File.get(1, COL_CALLER));
+  EXPECT_EQ(1, File.get(0, COL_PARAMS));
+  EXPECT_EQ(9, File.get(1, COL_PARAMS));
+  EXPECT_EQ(2, File.get(0, COL_PRECISE_SRC_TYPE));
+  EXPECT_EQ(0.5f, File.getMetric(0));
+
+  // a set shared by several columns is stored once
+  EXPECT_EQ(File.get(0, COL_SET_PRECISE_SRC_TYPE), File.get(0, COL_SET_SRC_TYPE));
+  ArrayRef<support::ulittle32_t> Set = File.getSet(File.get(0, COL_SET_SRC_TYPE));
+  ASSERT_EQ(2u, Set.size());
+  EXPECT_EQ("_ZN1A3fooEv", File.getString(Set[0]));
+  EXPECT_EQ("_ZN1B3fooEv", File.getString(Set[1]));
+
+  Set = File.getSet(File.get(1, COL_SET_SRC_TYPE));
+  ASSERT_EQ(1u, Set.size());
+  EXPECT_EQ("bar", File.getString(Set[0]));
+  EXPECT_TRUE(File.getSet(File.get(1, COL_SET_PRECISE_SRC_TYPE)).empty());
+
+  Set = File.getSet(File.getParamSet(1, false));
+  ASSERT_EQ(2u, Set.size());
+  EXPECT_EQ("f1", File.getString(Set[0]));
+  EXPECT_EQ(NO_ID, File.getParamSet(2, false));
+  EXPECT_EQ(NO_ID, File.getParamSet(0, true));
+}
+
+TEST_F(SDAnalysisFileTest, RejectsInvalidValues) {
+  std::set<std::string> Foo = {"foo", "bar"};
+
+  SDAnalysisFileWriter W;
+  SDAnalysisFileWriter::row_t Row;
+  fillRow(Row);
+  Row[COL_CALLER] = W.addString("main");
+  Row[COL_SET_SRC_TYPE] = W.addSet(Foo);
+  W.addRow(Row);
+  ASSERT_FALSE(W.write(Path, 0, 0, 0));
+  ASSERT_TRUE((bool) SDAnalysisFile::open(Path));
+
+  uint64_t ColumnsOffset = reinterpret_cast<const SDAnalysisFileHeader *>(
+      (*MemoryBuffer::getFile(Path))->getBufferStart())->ColumnsOffset;
+
+  // one call site, so the value of column C is at ColumnsOffset + 8 * C
+  struct {
+    Column C;
+    int64_t Value;
+  } Tests[] = {
+      {COL_KIND, 2},
+      {COL_CALLER, 1 << 20},
+      {COL_CALLER, -2},
+      {COL_PARAMS, -1},
+      {COL_SRC_TYPE, -2},
+      {COL_METRIC, -1},
+      {COL_SET_SRC_TYPE, 1},       // a member, not the start of a set
+      {COL_SET_SRC_TYPE, 1 << 20},
+  };
+
+  for (const auto &T : Tests) {
+    ASSERT_FALSE(W.write(Path, 0, 0, 0));
+    patch(ColumnsOffset + 8 * T.C, T.Value);
+    EXPECT_FALSE((bool) SDAnalysisFile::open(Path))
+        << getColumnName(T.C) << " = " << T.Value;
+  }
+}
+
+} // end anonymous namespace